@@ -0,0 +1,15 @@
+-- string keyed field reads and writes on small objects
+local points = {}
+for i = 1, 64 do
+	points[i] = { x = i, y = i * 2, z = i * 3, name = "p" }
+end
+
+local sum = 0
+for step = 1, 2000 do
+	for i = 1, 64 do
+		local p = points[i]
+		p.x = p.x + p.y
+		sum = sum + p.x + p.z
+	end
+end
+print(sum)
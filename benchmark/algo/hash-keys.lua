@@ -0,0 +1,34 @@
+-- inserts and lookups of integer keys that end up in the hash part,
+-- sequential, strided and pseudo random keys stress the probe lengths
+local n = 20000
+
+local function run(key)
+	local t = {}
+	for i = 1, n do
+		t[key(i)] = i
+	end
+	local sum = 0
+	for round = 1, 10 do
+		for i = 1, n do
+			sum = sum + t[key(i)]
+		end
+	end
+	return sum
+end
+
+local seed = 12345
+local random = {}
+for i = 1, n do
+	seed = (seed * 1103515245 + 12345) % 2147483648
+	random[i] = seed
+end
+
+print(run(function(i)
+	return i
+end))
+print(run(function(i)
+	return i * 1024
+end))
+print(run(function(i)
+	return random[i]
+end))
@@ -0,0 +1,23 @@
+-- pairs and ipairs over the array and the hash part of tables
+local n = 100000
+
+local list = {}
+local map = {}
+for i = 1, n do
+	list[i] = i
+	map["k" .. i] = i
+end
+
+local sum = 0
+for round = 1, 20 do
+	for _, v in ipairs(list) do
+		sum = sum + v
+	end
+	for _, v in pairs(list) do
+		sum = sum + v
+	end
+	for _, v in pairs(map) do
+		sum = sum + v
+	end
+end
+print(sum)
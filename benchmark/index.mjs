@@ -31,6 +31,11 @@ const wumbo = time_cmd.bind(
   path.join(path.dirname(import.meta.dirname), "wumbo"),
   { WUMBO_INIT_PATH: "wumbo_bench.mjs" },
 );
+const wumbo_intern = time_cmd.bind(
+  null,
+  path.join(path.dirname(import.meta.dirname), "wumbo"),
+  { WUMBO_INIT_PATH: "wumbo_bench.mjs", WUMBO_INTERN: "1" },
+);
 const lua_wasm = time_cmd.bind(
   null,
   `node ${path.join(path.dirname(process.env.WUMBO_PATH), "lua.mjs")} init.lua`,
@@ -56,6 +61,7 @@ const bench = async (name, cmd, algo) => {
 };
 
 const wumbo_bench = bench.bind(null, "wumbo", wumbo);
+const wumbo_intern_bench = bench.bind(null, "wumbo_intern", wumbo_intern);
 const lua_wasm_bench = bench.bind(null, "lua_wasm", lua_wasm);
 const fengari_bench = bench.bind(null, "fengari", fengari);
 const lua_bench = bench.bind(null, "lua", lua);
@@ -65,6 +71,9 @@ const algos = [
   "fibonacci.lua",
   // "heapsort.lua",
   "fixpoint-fact.lua",
+  "field-access.lua",
+  "hash-keys.lua",
+  "iteration.lua",
 ];
 
 const result = [];
@@ -78,6 +87,7 @@ for (const algo of algos) {
     title: title,
     data: [
       await wumbo_bench(p),
+      await wumbo_intern_bench(p),
       await lua_wasm_bench(p),
       await fengari_bench(p),
       await lua_bench(p),
@@ -5,7 +5,11 @@ const { newInstance, format } = await import(env.WUMBO_PATH);
 
 await benchmark({
   init: async () =>
-    await newInstance({ optimize: true, format: format.none })[0],
+    await newInstance({
+      optimize: true,
+      format: format.none,
+      intern: env.WUMBO_INTERN === "1",
+    })[0],
   compile: async (load, data) => (await load(data))[0],
   run: (_, f) => f(),
   cleanup: () => {},
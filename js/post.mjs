@@ -11,17 +11,20 @@ const strToBuf = (str) => new TextEncoder().encode(str);
 
 const makeImportObject = (override, load_func) => {
   const writer = (println) => {
-    let buffer = new Uint8Array(0);
+    // pieces of the unfinished line, joined once its newline arrives
+    const decoder = new TextDecoder();
+    let pending = [];
     return (s) => {
-      buffer = new Uint8Array([...buffer, ...s]);
-      for (
-        let i;
-        -1 !== (i = buffer.indexOf(0xa));
-        buffer = buffer.slice(i + 1)
-      )
-        println(bufToStr(buffer.slice(0, i)));
+      const lines = decoder.decode(s, { stream: true }).split("\n");
+      pending.push(lines[0]);
+      if (lines.length === 1) return;
+      println(pending.join(""));
+      for (let i = 1; i < lines.length - 1; ++i) println(lines[i]);
+      pending = [lines[lines.length - 1]];
     };
   };
+  // scratch memory shared with the runtime, strings are copied through it in bulk
+  const memory = new WebAssembly.Memory({ initial: 1 });
   const importObject = {
     load: {
       load: WebAssembly.Suspending
@@ -37,8 +40,24 @@ const makeImportObject = (override, load_func) => {
       toStringNum: (num) =>
         strToBuf(Number.isInteger(num) ? num.toFixed(1) : num.toString()),
       pow: (base, exponent) => Math.pow(base, exponent),
+      // % on numbers is C's fmod
+      fmod: (a, b) => a % b,
     },
     buffer: {
+      memory,
+      from_memory: (size) => new Uint8Array(memory.buffer, 0, size).slice(),
+      to_memory: (array) => {
+        const missing = array.length - memory.buffer.byteLength;
+        if (missing > 0) {
+          try {
+            memory.grow(Math.ceil(missing / 65536));
+          } catch {
+            return -1;
+          }
+        }
+        new Uint8Array(memory.buffer).set(array);
+        return array.length;
+      },
       new: (size) => new Uint8Array(size),
       set: (array, index, value) => (array[index] = value),
       get: (array, index) => array[index],
@@ -60,9 +79,11 @@ const load_lua = instance.cwrap("load_lua", "number", [
   "number",
   "number",
   "number",
+  "number",
 ]);
 const generate_runtime = instance.cwrap("generate_runtime", "number", [
   "number",
+  "number",
 ]);
 const clean_up = instance.cwrap("clean_up", "void", ["number"]);
 const get_size = instance.cwrap("get_size", "number", ["number"]);
@@ -88,13 +109,24 @@ const convertResult = async (result, format, importObject) => {
   }
 };
 
-const runtime = (optimize, format, importObject) => {
-  return convertResult(generate_runtime(optimize), format, importObject);
+const runtime = (optimize, format, importObject, intern) => {
+  return convertResult(
+    generate_runtime(optimize, intern),
+    format,
+    importObject,
+  );
 };
 
-const load = async (bytes, importObject, optimize, format, standalone) => {
+const load = async (
+  bytes,
+  importObject,
+  optimize,
+  format,
+  standalone,
+  intern,
+) => {
   const [exports, wat] = await convertResult(
-    load_lua(bytes, bytes.length, optimize, standalone),
+    load_lua(bytes, bytes.length, optimize, standalone, intern),
     format,
     importObject,
   );
@@ -121,9 +153,10 @@ export const newInstance = async ({
   optimize = true,
   format = undefined,
   standalone = false,
+  intern = false,
 } = {}) => {
   const load_func = (bytes) =>
-    load(bytes, importObject, optimize, format, standalone);
+    load(bytes, importObject, optimize, format, standalone, intern);
 
   const importObject = makeImportObject(
     override,
@@ -131,7 +164,12 @@ export const newInstance = async ({
   );
   let runtimeWat;
   if (!standalone) {
-    const [exports, wat] = await runtime(optimize, format, importObject);
+    const [exports, wat] = await runtime(
+      optimize,
+      format,
+      importObject,
+      intern,
+    );
     runtimeWat = wat;
     importObject.runtime = exports;
   }
@@ -214,6 +252,9 @@ export const newInstance = async ({
           throw e;
         }
       };
+      // print and io.write buffer their output, init_env flushes it when it returns.
+      // Hosts that run Lua code through other exports call this afterwards
+      result.flush = () => exports.flush();
       return [result, wat];
     },
     runtimeWat,
@@ -193,6 +193,7 @@ struct analyzer
     void visit(for_statement& p)
     {
         visit(p.exp);
+        block_scope b{_func_stack};
         _func_stack.alloc_local(p.var, p.usage);
 
         visit(p.inner);
@@ -200,6 +201,7 @@ struct analyzer
     void visit(for_each& p)
     {
         visit(p.explist);
+        block_scope b{_func_stack};
         p.usage.resize(p.names.size());
         size_t i = 0;
         for (auto& n : p.names)
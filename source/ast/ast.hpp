@@ -10,12 +10,27 @@
 namespace wumbo::ast
 {
 
+// static type of a local, inferred by ast::infer_types
+enum class type_hint : uint_fast8_t
+{
+    unknown, // no value seen yet
+    nil,
+    boolean,
+    integer,
+    number,
+    string,
+    table,
+    function,
+    any,
+};
+
 struct local_usage
 {
     size_t write_count = 0;
     size_t read_count  = 0;
     bool init          = false;
     bool upvalue       = false;
+    type_hint type     = type_hint::unknown;
 
     bool is_upvalue() const
     {
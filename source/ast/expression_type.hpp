@@ -0,0 +1,136 @@
+#pragma once
+
+#include "ast/ast.hpp"
+#include "utils/util.hpp"
+
+namespace wumbo::ast
+{
+
+inline type_hint join(type_hint a, type_hint b)
+{
+    if (a == type_hint::unknown)
+        return b;
+    if (b == type_hint::unknown || a == b)
+        return a;
+    return type_hint::any;
+}
+
+inline bool is_numeric(type_hint t)
+{
+    return t == type_hint::integer || t == type_hint::number;
+}
+
+// static type of an expression, lookup maps a variable name to its type.
+// unknown operands keep the result unknown until the fixpoint is reached
+template<typename Lookup>
+type_hint expression_type(const expression& exp, Lookup&& lookup)
+{
+    return std::visit(overload{
+                          [](const nil&)
+                          {
+                              return type_hint::nil;
+                          },
+                          [](const boolean&)
+                          {
+                              return type_hint::boolean;
+                          },
+                          [](const int_type&)
+                          {
+                              return type_hint::integer;
+                          },
+                          [](const float_type&)
+                          {
+                              return type_hint::number;
+                          },
+                          [](const literal&)
+                          {
+                              return type_hint::string;
+                          },
+                          [](const function_body&)
+                          {
+                              return type_hint::function;
+                          },
+                          [](const table_constructor&)
+                          {
+                              return type_hint::table;
+                          },
+                          [&](const box<prefixexp>& p)
+                          {
+                              if (!p->tail.empty())
+                                  return type_hint::any;
+                              return std::visit(overload{
+                                                    [&](const name_t& name)
+                                                    {
+                                                        return lookup(name);
+                                                    },
+                                                    [&](const expression& inner)
+                                                    {
+                                                        return expression_type(inner, lookup);
+                                                    },
+                                                },
+                                                p->chead);
+                          },
+                          [&](const box<bin_operation>& p)
+                          {
+                              auto l = expression_type(p->lhs, lookup);
+                              auto r = expression_type(p->rhs, lookup);
+
+                              if (p->op == bin_operator::logic_and || p->op == bin_operator::logic_or)
+                                  return join(l, r);
+                              if (l == type_hint::unknown || r == type_hint::unknown)
+                                  return type_hint::unknown;
+
+                              // strings are coerced by arithmetic and everything else may
+                              // have a metamethod, so only numbers give a known result
+                              bool numeric = is_numeric(l) && is_numeric(r);
+                              switch (p->op)
+                              {
+                              case bin_operator::addition:
+                              case bin_operator::subtraction:
+                              case bin_operator::multiplication:
+                              case bin_operator::modulo:
+                              case bin_operator::division_floor:
+                                  if (!numeric)
+                                      return type_hint::any;
+                                  return l == type_hint::integer && r == type_hint::integer ? type_hint::integer : type_hint::number;
+                              case bin_operator::division:
+                              case bin_operator::exponentiation:
+                                  return numeric ? type_hint::number : type_hint::any;
+                              case bin_operator::binary_or:
+                              case bin_operator::binary_and:
+                              case bin_operator::binary_xor:
+                              case bin_operator::binary_right_shift:
+                              case bin_operator::binary_left_shift:
+                                  return numeric ? type_hint::integer : type_hint::any;
+                              case bin_operator::concat:
+                                  return (l == type_hint::string || is_numeric(l)) && (r == type_hint::string || is_numeric(r)) ? type_hint::string : type_hint::any;
+                              default: // comparison
+                                  return type_hint::boolean;
+                              }
+                          },
+                          [&](const box<un_operation>& p)
+                          {
+                              if (p->op == un_operator::logic_not)
+                                  return type_hint::boolean;
+
+                              auto t = expression_type(p->rhs, lookup);
+                              if (t == type_hint::unknown)
+                                  return t;
+                              switch (p->op)
+                              {
+                              case un_operator::minus:
+                                  return is_numeric(t) ? t : type_hint::any;
+                              case un_operator::len:
+                                  return t == type_hint::string ? type_hint::integer : type_hint::any;
+                              default: // binary_not
+                                  return is_numeric(t) ? type_hint::integer : type_hint::any;
+                              }
+                          },
+                          [](const ellipsis&)
+                          {
+                              return type_hint::any;
+                          },
+                      },
+                      exp.inner);
+}
+} // namespace wumbo::ast
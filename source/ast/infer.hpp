@@ -0,0 +1,334 @@
+#pragma once
+
+#include "ast/ast.hpp"
+#include "ast/expression_type.hpp"
+#include "ast/func_stack.hpp"
+#include "utils/util.hpp"
+
+namespace wumbo::ast
+{
+
+// flow insensitive: the type of a local is the join of every value assigned
+// to it anywhere in the chunk, iterated until nothing changes
+struct type_inference
+{
+    function_stack _func_stack;
+    bool changed = false;
+
+    type_hint lookup(const name_t& name) const
+    {
+        auto [var_type, usage] = _func_stack.find(name);
+        return usage ? usage->type : type_hint::any;
+    }
+
+    type_hint type_of(const expression& exp) const
+    {
+        return expression_type(exp, [this](const name_t& name)
+                               {
+                                   return lookup(name);
+                               });
+    }
+
+    // type of the i-th value after the list is adjusted to the number of targets
+    type_hint type_of(const expression_list& list, size_t i) const
+    {
+        if (i + 1 < list.size())
+            return type_of(list[i]);
+        if (list.empty())
+            return type_hint::nil;
+
+        auto& last = list.back();
+        bool multi = std::holds_alternative<ellipsis>(last.inner);
+        if (auto p = std::get_if<box<prefixexp>>(&last.inner); p && !(*p)->tail.empty())
+            multi = std::holds_alternative<functail>((*p)->tail.back());
+
+        if (i + 1 == list.size())
+            return multi ? type_hint::any : type_of(last);
+        return multi ? type_hint::any : type_hint::nil;
+    }
+
+    void assign(local_usage& usage, type_hint type)
+    {
+        auto joined = join(usage.type, type);
+        changed |= joined != usage.type;
+        usage.type = joined;
+    }
+
+    void assign(const name_t& name, type_hint type)
+    {
+        if (auto [var_type, usage] = _func_stack.find(name); usage)
+            assign(*usage, type);
+    }
+
+    void declare(const name_t& name, local_usage& usage, type_hint type)
+    {
+        _func_stack.alloc_local(name, usage);
+        assign(usage, type);
+    }
+
+    void _functail(functail& f)
+    {
+        visit(f.args);
+    }
+
+    void _vartail(vartail& v)
+    {
+        if (auto exp = std::get_if<expression>(&v))
+            visit(*exp);
+    }
+
+    void visit(assignments& p)
+    {
+        visit(p.explist);
+        size_t i = 0;
+        for (auto& var : p.varlist)
+        {
+            std::visit(overload{
+                           [&](std::pair<expression, vartail>& exp)
+                           {
+                               visit(exp.first);
+                               _vartail(exp.second);
+                           },
+                           [&](const name_t& name)
+                           {
+                               if (var.tail.empty())
+                                   assign(name, type_of(p.explist, i));
+                           },
+                       },
+                       var.head);
+
+            for (auto& [func, vartail] : var.tail)
+            {
+                for (auto& f : func)
+                    _functail(f);
+                _vartail(vartail);
+            }
+            ++i;
+        }
+    }
+
+    void visit(function_call& p)
+    {
+        if (auto exp = std::get_if<expression>(&p.head))
+            visit(*exp);
+
+        for (auto& [var, func] : p.tail)
+        {
+            for (auto& v : var)
+                _vartail(v);
+            _functail(func);
+        }
+    }
+
+    void visit(prefixexp& p)
+    {
+        if (auto exp = std::get_if<expression>(&p.chead))
+            visit(*exp);
+
+        for (auto& t : p.tail)
+        {
+            std::visit(overload{
+                           [&](functail& f)
+                           {
+                               _functail(f);
+                           },
+                           [&](vartail& v)
+                           {
+                               _vartail(v);
+                           },
+                       },
+                       t);
+        }
+    }
+
+    void visit(label_statement& p)
+    {
+    }
+    void visit(key_break& p)
+    {
+    }
+    void visit(goto_statement& p)
+    {
+    }
+    void visit(do_statement& p)
+    {
+        visit(p.inner);
+    }
+    void visit(while_statement& p)
+    {
+        visit(p.condition);
+        visit(p.inner);
+    }
+    void visit(repeat_statement& p)
+    {
+        // the condition sees the locals of the body
+        block_scope b{_func_stack};
+        unscoped_block(p.inner);
+        visit(p.condition);
+    }
+    void visit(if_statement& p)
+    {
+        for (auto& [cond_exp, body] : p.cond_block)
+        {
+            visit(cond_exp);
+            visit(body);
+        }
+        if (p.else_block)
+            visit(*p.else_block);
+    }
+
+    void visit(for_statement& p)
+    {
+        visit(p.exp);
+
+        // integer loop if both the initial value and the step are integers
+        auto init = type_of(p.exp[0]);
+        auto step = p.exp.size() < 3 ? type_hint::integer : type_of(p.exp[2]);
+        auto type = type_hint::any;
+        if (init == type_hint::unknown || step == type_hint::unknown)
+            type = type_hint::unknown;
+        else if (init == type_hint::integer && step == type_hint::integer)
+            type = type_hint::integer;
+        else if (is_numeric(init) && is_numeric(step))
+            type = type_hint::number;
+
+        block_scope b{_func_stack};
+        declare(p.var, p.usage, type);
+
+        visit(p.inner);
+    }
+    void visit(for_each& p)
+    {
+        visit(p.explist);
+        block_scope b{_func_stack};
+        size_t i = 0;
+        for (auto& n : p.names)
+            declare(n, p.usage[i++], type_hint::any);
+
+        visit(p.inner);
+    }
+    void visit(function_definition& p)
+    {
+        visit(p.body);
+        if (p.function_name.size() == 1)
+            assign(p.function_name.front(), type_hint::function);
+    }
+    void visit(local_function& p)
+    {
+        declare(p.name, p.usage, type_hint::function);
+        visit(p.body);
+    }
+    void visit(local_variables& p)
+    {
+        visit(p.explist);
+
+        // the new locals are not visible to their own initializers
+        std::vector<type_hint> types;
+        for (size_t i = 0; i < p.names.size(); ++i)
+            types.push_back(type_of(p.explist, i));
+
+        for (size_t i = 0; i < p.names.size(); ++i)
+            declare(p.names[i], p.usage[i], types[i]);
+    }
+
+    void visit(expression& p)
+    {
+        std::visit(*this, p.inner);
+    }
+
+    void visit(expression_list& p)
+    {
+        for (auto& exp : p)
+            visit(exp);
+    }
+
+    void visit(nil& p)
+    {
+    }
+    void visit(boolean& p)
+    {
+    }
+    void visit(int_type& p)
+    {
+    }
+    void visit(float_type& p)
+    {
+    }
+    void visit(literal& p)
+    {
+    }
+    void visit(ellipsis& p)
+    {
+    }
+    void visit(function_body& p)
+    {
+        function_frame f{_func_stack};
+        size_t i = 0;
+        for (auto& n : p.params)
+            declare(n, p.usage[i++], type_hint::any);
+
+        visit(p.inner);
+    }
+
+    void visit(table_constructor& p)
+    {
+        for (auto& field : p)
+        {
+            if (auto index = std::get_if<expression>(&field.index))
+                visit(*index);
+            visit(field.value);
+        }
+    }
+    void visit(bin_operation& p)
+    {
+        visit(p.lhs);
+        visit(p.rhs);
+    }
+
+    void visit(un_operation& p)
+    {
+        visit(p.rhs);
+    }
+
+    template<typename T>
+    void operator()(box<T>& p)
+    {
+        (*this)(*p);
+    }
+
+    template<typename T>
+    void operator()(T& p)
+    {
+        visit(p);
+    }
+
+    void unscoped_block(block& p)
+    {
+        for (auto& statement : p.statements)
+        {
+            std::visit(*this, statement.inner);
+        }
+        if (p.retstat)
+        {
+            visit(*p.retstat);
+        }
+    }
+
+    void visit(block& p)
+    {
+        block_scope b{_func_stack};
+        unscoped_block(p);
+    }
+};
+
+// runs after the analyzer, the usage of every local is already allocated
+inline void infer_types(block& chunk)
+{
+    type_inference pass;
+    do
+    {
+        pass.changed = false;
+        pass.visit(chunk);
+    } while (pass.changed);
+}
+} // namespace wumbo::ast
@@ -39,7 +39,7 @@ expr_ref compiler::_functail(const functail& p, expr_ref function)
         // see _vartail
         auto local = help_var_scope{_func_stack, anyref()};
         auto tbl   = local_tee(local, function, anyref());
-        function   = table_get(tbl, add_string(*p.name));
+        function   = table_get_field(tbl, *p.name);
 
         args.push_back(local_get(local, anyref()));
     }
@@ -64,7 +64,7 @@ expr_ref compiler::_vartail(const vartail& p, expr_ref var)
                           },
                           [&](const name_t& name)
                           {
-                              return table_get(var, add_string(name));
+                              return table_get_field(var, name);
                           },
                       },
                       p);
@@ -126,6 +126,18 @@ expr_ref_list compiler::operator()(const assignments& p)
 {
     expr_ref_list result;
 
+    // x = exp needs no value list and keeps typed locals unboxed
+    if (p.varlist.size() == 1 && p.explist.size() == 1 && p.varlist.front().tail.empty())
+    {
+        if (auto name = std::get_if<name_t>(&p.varlist.front().head))
+        {
+            auto [var_type, index, type] = _func_stack.find(*name);
+            if (var_type == var_type::local && type != upvalue_type())
+                return {local_set(index, value_as(p.explist.front(), type))};
+            return {set_var(*name, single_value((*this)(p.explist.front())))};
+        }
+    }
+
     auto local = help_var_scope{_func_stack, ref_array_type()};
     result.push_back(local_set(local, (*this)(p.explist)));
 
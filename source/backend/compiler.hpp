@@ -8,6 +8,7 @@
 #include <vector>
 
 #include "ast/ast.hpp"
+#include "ast/expression_type.hpp"
 #include "binaryen-c.h"
 #include "func_stack.hpp"
 #include "runtime/runtime.hpp"
@@ -27,7 +28,10 @@ struct compiler : ext_types
         , _runtime{runtime}
     {
         if (_runtime.mod == mod)
-            types = _runtime.types;
+        {
+            types   = _runtime.types;
+            strings = _runtime.strings;
+        }
     }
 
     runtime& _runtime;
@@ -71,6 +75,8 @@ struct compiler : ext_types
     function_stack _func_stack;
 
     size_t function_name = 0;
+    size_t field_caches  = 0;
+    size_t shapes        = 0;
 
     expr_ref get_upvalue(size_t index)
     {
@@ -90,6 +96,69 @@ struct compiler : ext_types
         //return array_get(exp, const_i32(result), upvalue_type());
     }
 
+    // wasm type of a lua local, locals with a static type are kept unboxed
+    BinaryenType storage_type(const local_usage& usage) const
+    {
+        if (usage.upvalue)
+            return anyref();
+        switch (usage.type)
+        {
+        case type_hint::integer:
+            return integer_type();
+        case type_hint::number:
+            return number_type();
+        case type_hint::string:
+            return type<value_type::string>();
+        case type_hint::table:
+            return type<value_type::table>();
+        default:
+            return anyref();
+        }
+    }
+
+    expr_ref from_storage(expr_ref value, BinaryenType storage)
+    {
+        if (storage == integer_type())
+            return new_integer(value);
+        if (storage == number_type())
+            return new_number(value);
+        return value;
+    }
+
+    // the type inference guarantees that the casts succeed
+    expr_ref to_storage(expr_ref value, BinaryenType storage)
+    {
+        if (storage == anyref() || BinaryenExpressionGetType(value) == storage)
+            return value;
+        if (storage == integer_type())
+            return unbox_integer(value);
+        if (storage == number_type())
+            return unbox_number(BinaryenRefCast(mod, value, type<value_type::number>()));
+        return BinaryenRefCast(mod, value, storage);
+    }
+
+    type_hint static_type(const expression& exp) const
+    {
+        return expression_type(exp, [this](const name_t& name)
+                               {
+                                   auto [var_type, index, storage] = _func_stack.find(name);
+                                   if (var_type != var_type::local)
+                                       return type_hint::any;
+                                   if (storage == integer_type())
+                                       return type_hint::integer;
+                                   if (storage == number_type())
+                                       return type_hint::number;
+                                   if (storage == type<value_type::string>())
+                                       return type_hint::string;
+                                   if (storage == type<value_type::table>())
+                                       return type_hint::table;
+                                   return type_hint::any;
+                               });
+    }
+
+    expr_ref unboxed(const expression& exp, value_type vtype);
+    expr_ref value_as(const expression& exp, BinaryenType storage);
+
     expr_ref get_var(const name_t& name)
     {
         auto [var_type, index, type] = _func_stack.find(name);
@@ -97,7 +166,7 @@ struct compiler : ext_types
         {
         case var_type::local:
             if (type != upvalue_type())
-                return local_get(index, anyref());
+                return from_storage(local_get(index, type), type);
             return BinaryenStructGet(mod, 0, local_get(index, upvalue_type()), anyref(), false);
         case var_type::upvalue:
             if (type != upvalue_type())
@@ -105,7 +174,7 @@ struct compiler : ext_types
             return BinaryenStructGet(mod, 0, BinaryenRefCast(mod, get_upvalue(index), upvalue_type()), anyref(), false);
         case var_type::global:
             assert(name != "_ENV" && "no environment set");
-            return table_get(get_var("_ENV"), add_string(name));
+            return table_get_field(get_var("_ENV"), name);
         default:
             return BinaryenUnreachable(mod);
         }
@@ -118,7 +187,7 @@ struct compiler : ext_types
         {
         case var_type::local:
             if (type != upvalue_type())
-                return local_set(index, value);
+                return local_set(index, to_storage(value, type));
             return BinaryenStructSet(mod, 0, local_get(index, upvalue_type()), value);
         case var_type::upvalue:
             assert(type == upvalue_type() && "must be upvalue");
@@ -159,6 +228,16 @@ struct compiler : ext_types
                           });
     }
 
+    expr_ref single_value(expr_ref value)
+    {
+        if (BinaryenExpressionGetType(value) == ref_array_type())
+        {
+            auto local = help_var_scope{_func_stack, ref_array_type()};
+            return at_or_null(local, 0, value);
+        }
+        return value;
+    }
+
     expr_ref_list operator()(const function_call& p);
 
     expr_ref_list operator()(const assignments& p);
@@ -209,8 +288,7 @@ struct compiler : ext_types
         expr_ref first = nullptr;
         for (auto& [cond_exp, body] : p.cond_block)
         {
-            auto cond = (*this)(cond_exp);
-            auto next = make_if(_runtime.call(functions::to_bool, cond), make_block((*this)(body)));
+            auto next = make_if(condition(cond_exp), make_block((*this)(body)));
             if (last)
                 BinaryenIfSetIfFalse(last, next);
             else
@@ -480,6 +558,7 @@ struct compiler : ext_types
     expr_ref find_bucket(expr_ref table, expr_ref hash);
 
     expr_ref table_get(expr_ref table, expr_ref key);
+    expr_ref table_get_field(expr_ref table, const name_t& name);
 
     expr_ref table_set(expr_ref table, expr_ref key, expr_ref value);
 
@@ -487,6 +566,13 @@ struct compiler : ext_types
 
     expr_ref call(expr_ref func, expr_ref args);
 
+    template<typename Fast, typename Slow>
+    expr_ref numeric_fast_path(const bin_operation& p, Fast&& fast, Slow&& slow);
+    expr_ref arithmetic_unboxed(bin_operator op, value_type vtype, expr_ref a, expr_ref b);
+    expr_ref arithmetic(const bin_operation& p, functions function);
+    expr_ref comparison(const bin_operation& p);
+    expr_ref concat(const bin_operation& p);
+    expr_ref condition(const expression& p);
     expr_ref operator()(const bin_operation& p);
 
     expr_ref operator()(const un_operation& p);
@@ -552,8 +638,24 @@ struct compiler : ext_types
 
         auto init = add_func_ref("*init", chunk, {}, {}, true);
         BinaryenAddFunctionExport(mod, "*init", "init");
-        // call init function with ... args
-        env.push_back(call(init, local_get(0, ref_array_type())));
+        // call init function with ... args, the buffered output is flushed even if it raises an error
+        help_var_scope result{_func_stack, ref_array_type(), "result"};
+        expr_ref rethrow = make_block(std::array{
+            _runtime.call(functions::flush_output, std::span<const expr_ref>{}),
+            BinaryenRethrow(mod, "+init"),
+        });
+        env.push_back(BinaryenTry(mod,
+                                  "+init",
+                                  make_block(std::array{
+                                      local_set(result, call(init, local_get(0, ref_array_type()))),
+                                      _runtime.call(functions::flush_output, std::span<const expr_ref>{}),
+                                      local_get(result, ref_array_type()),
+                                  }),
+                                  nullptr,
+                                  0,
+                                  &rethrow,
+                                  1,
+                                  nullptr));
 
         export_func(_runtime.require(functions::get_type_num).name);
         export_func(_runtime.require(functions::to_js_integer).name);
@@ -564,6 +666,9 @@ struct compiler : ext_types
         export_func(_runtime.require(functions::any_array_size).name);
         export_func(_runtime.require(functions::box_number).name);
         export_func(_runtime.require(functions::box_integer).name);
+        // init_env flushes before it returns. Lua code the host runs later through another
+        // entry point, e.g. a callback, leaves its output buffered until the host calls flush
+        export_func(_runtime.require(functions::flush_output).name, "flush");
 
         auto locals = frame.get_local_type_list();
         BinaryenAddFunction(mod,
@@ -2,6 +2,9 @@
 #include "binaryen-c.h"
 #include "compiler.hpp"
 
+#include <algorithm>
+#include <list>
+
 namespace wumbo
 {
 
@@ -27,6 +30,7 @@ expr_ref_list compiler::operator()(const local_function& p)
         expr_ref exp[] = {
             ref,
             null(),
+            const_i32(0),
         };
         auto func = BinaryenStructNew(mod, std::data(exp), std::size(exp), BinaryenTypeGetHeapType(type<value_type::function>()));
 
@@ -44,6 +48,48 @@ expr_ref_list compiler::operator()(const local_function& p)
 
 expr_ref_list compiler::operator()(const local_variables& p)
 {
+    std::vector<BinaryenType> types;
+    for (auto& usage : p.usage)
+        types.push_back(storage_type(usage));
+
+    bool typed = std::any_of(types.begin(), types.end(), [](BinaryenType type)
+                             {
+                                 return type != anyref();
+                             });
+
+    if (typed && p.explist.size() >= p.names.size())
+    {
+        // every local has its own expression. the values are kept in
+        // temporaries until all of them are evaluated, the new locals are not
+        // in scope before that
+        expr_ref_list result;
+        std::list<help_var_scope> values;
+        for (size_t i = 0; i < p.explist.size(); ++i)
+        {
+            if (i >= p.names.size())
+            {
+                result.push_back(drop((*this)(p.explist[i])));
+                continue;
+            }
+            auto& value = values.emplace_back(_func_stack, types[i]);
+            result.push_back(local_set(value, value_as(p.explist[i], types[i])));
+        }
+
+        auto value = values.begin();
+        for (size_t i = 0; i < p.names.size(); ++i, ++value)
+        {
+            auto get = local_get(*value, types[i]);
+            if (p.usage[i].is_upvalue())
+            {
+                auto index = _func_stack.alloc_lua_local(p.names[i], upvalue_type());
+                result.push_back(local_set(index, BinaryenStructNew(mod, &get, 1, BinaryenTypeGetHeapType(upvalue_type()))));
+            }
+            else
+                result.push_back(local_set(_func_stack.alloc_lua_local(p.names[i], types[i]), get));
+        }
+        return result;
+    }
+
     auto explist = (*this)(p.explist);
     auto local   = help_var_scope{_func_stack, ref_array_type()};
 
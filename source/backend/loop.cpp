@@ -2,6 +2,9 @@
 #include "backend/wasm_util.hpp"
 #include "compiler.hpp"
 
+#include <limits>
+#include <optional>
+
 namespace wumbo
 {
 static std::string loop_end(function_info& func)
@@ -33,17 +36,15 @@ expr_ref_list compiler::operator()(const while_statement& p)
     auto& func = _func_stack.current_function();
 
     loop_scope scope{func};
-    auto cond = (*this)(p.condition);
-
-    auto body = (*this)(p.inner);
 
     auto begin = loop_begin(func);
     auto end   = loop_end(func);
 
-    body.push_back(BinaryenBreak(mod, begin.c_str(), _runtime.call(functions::to_bool, cond), nullptr));
+    expr_ref_list body = {BinaryenBreak(mod, end.c_str(), unop(BinaryenEqZInt32(), condition(p.condition)), nullptr)};
+    append(body, (*this)(p.inner));
+    body.push_back(BinaryenBreak(mod, begin.c_str(), nullptr, nullptr));
 
     return {make_block(std::array{
-                           BinaryenBreak(mod, end.c_str(), _runtime.call(functions::to_bool_not, cond), nullptr),
                            BinaryenLoop(mod, begin.c_str(), make_block(body)),
                        },
                        end.c_str())};
@@ -58,88 +59,346 @@ expr_ref_list compiler::operator()(const repeat_statement& p)
 
     block_scope block{_func_stack};
     auto body = unscoped_block(p.inner);
-    auto cond = (*this)(p.condition);
+    auto cond = condition(p.condition);
 
-    body.push_back(BinaryenBreak(mod, begin.c_str(), _runtime.call(functions::to_bool_not, cond), nullptr));
+    body.push_back(BinaryenBreak(mod, begin.c_str(), unop(BinaryenEqZInt32(), cond), nullptr));
     return {BinaryenLoop(mod, begin.c_str(), make_block(body, end.c_str()))};
 }
 
-// TODO: make compatile to lua spec
+static std::optional<int_type> integer_constant(const expression& exp)
+{
+    if (auto value = std::get_if<int_type>(&exp.inner))
+        return *value;
+    if (auto op = std::get_if<box<un_operation>>(&exp.inner); op && (*op)->op == un_operator::minus)
+    {
+        if (auto value = std::get_if<int_type>(&(*op)->rhs.inner))
+            return static_cast<int_type>(0ull - static_cast<uint64_t>(*value));
+    }
+    return std::nullopt;
+}
+
 expr_ref_list compiler::operator()(const for_statement& p)
 {
+    // https://www.lua.org/manual/5.4/manual.html#3.3.5
+    // counter, limit and step live in unboxed locals, the iteration count is
+    // computed once like lua's forprep. the loop variable is only boxed when
+    // its static type is unknown
+
     block_scope block{_func_stack};
 
-    local_variables vars_help;
-    vars_help.explist = p.exp;
-    if (vars_help.explist.size() < 3)
-        vars_help.explist.push_back(expression{int_type{1}});
-    vars_help.names = {"*var", "*limit", "*step"};
-    vars_help.usage.resize(3);
-    for (auto& usage : vars_help.usage)
+    auto single = [&](const expression& exp)
     {
-        usage.read_count = 1;
-        usage.write_count = 1;
+        return single_value((*this)(exp));
+    };
+
+    auto init_const    = integer_constant(p.exp[0]);
+    auto step_const    = p.exp.size() < 3 ? std::optional<int_type>{1} : integer_constant(p.exp[2]);
+    auto typed_integer = [&](size_t i)
+    {
+        return i >= p.exp.size() || static_type(p.exp[i]) == type_hint::integer;
+    };
+    bool integer_loop = typed_integer(0) && typed_integer(2);
+
+    auto init  = help_var_scope{_func_stack, anyref()};
+    auto limit = help_var_scope{_func_stack, anyref()};
+    auto step  = help_var_scope{_func_stack, anyref()};
+
+    auto var_i   = help_var_scope{_func_stack, integer_type(), "*var"};
+    auto step_i  = help_var_scope{_func_stack, integer_type(), "*step"};
+    auto limit_i = help_var_scope{_func_stack, integer_type(), "*limit"};
+    auto count   = help_var_scope{_func_stack, integer_type(), "*count"};
+    auto var_f   = help_var_scope{_func_stack, number_type(), "*var"};
+    auto step_f  = help_var_scope{_func_stack, number_type(), "*step"};
+    auto limit_f = help_var_scope{_func_stack, number_type(), "*limit"};
+    auto is_int  = help_var_scope{_func_stack, bool_type()};
+
+    // statically typed integers of an integer loop are evaluated unboxed
+    bool init_typed  = integer_loop && !init_const;
+    bool limit_typed = integer_loop && typed_integer(1);
+    bool step_typed  = integer_loop && !step_const;
+
+    expr_ref_list result;
+    if (init_typed)
+        result.push_back(local_set(var_i, unboxed(p.exp[0], value_type::integer)));
+    else if (!init_const)
+        result.push_back(local_set(init, single(p.exp[0])));
+    if (limit_typed)
+        result.push_back(local_set(limit_i, unboxed(p.exp[1], value_type::integer)));
+    else
+        result.push_back(local_set(limit, single(p.exp[1])));
+    if (step_typed)
+        result.push_back(local_set(step_i, unboxed(p.exp[2], value_type::integer)));
+    else if (!step_const)
+        result.push_back(local_set(step, single(p.exp[2])));
+
+    auto& func = _func_stack.current_function();
+    loop_scope scope{func};
+
+    auto begin = loop_begin(func);
+    auto end   = loop_end(func);
+
+    // picks the branch at compile time when the sign of the step is known
+    auto by_step = [&](expr_ref step_positive, auto&& positive, auto&& negative)
+    {
+        if (step_const)
+            return *step_const > 0 ? positive() : negative();
+        return make_if(step_positive, positive(), negative());
+    };
+
+    auto step_zero = [&](expr_ref is_zero)
+    {
+        auto error = throw_error(add_string("'for' step is zero"));
+        if (step_const)
+            return *step_const == 0 ? error : BinaryenNop(mod);
+        return make_if(is_zero, error);
+    };
+
+    auto to_float = [&](expr_ref value, const char* error)
+    {
+        auto label = func.make_label("+for_float");
+        auto casts = std::array{
+            value_type::integer,
+            value_type::number,
+        };
+        return make_block(switch_value(value, casts, [&](value_type type, expr_ref exp)
+                                       {
+                                           switch (type)
+                                           {
+                                           case value_type::integer:
+                                               return BinaryenBreak(mod, label.c_str(), nullptr, int_to_num(unbox_integer(exp)));
+                                           case value_type::number:
+                                               return BinaryenBreak(mod, label.c_str(), nullptr, unbox_number(exp));
+                                           default:
+                                               return throw_error(add_string(error));
+                                           }
+                                       }),
+                          label.c_str());
+    };
+
+    // lua's forlimit: floats are rounded towards the loop direction and clipped
+    // to the integer range, limits that cannot be reached skip the loop
+    auto integer_limit = [&]()
+    {
+        auto step_positive = [&]()
+        {
+            return gt_int(local_get(step_i, integer_type()), const_integer(0));
+        };
+        auto label = func.make_label("+for_limit");
+        auto casts = std::array{
+            value_type::integer,
+            value_type::number,
+        };
+        return make_block(switch_value(local_get(limit, anyref()), casts, [&](value_type type, expr_ref exp)
+                                       {
+                                           switch (type)
+                                           {
+                                           case value_type::integer:
+                                               return BinaryenBreak(mod, label.c_str(), nullptr, unbox_integer(exp));
+                                           case value_type::number:
+                                           {
+                                               auto skip = [&]()
+                                               {
+                                                   return BinaryenBreak(mod, end.c_str(), nullptr, nullptr);
+                                               };
+                                               auto clip = [&](int64_t value)
+                                               {
+                                                   return [&, value]()
+                                                   {
+                                                       return BinaryenBreak(mod, label.c_str(), nullptr, const_integer(value));
+                                                   };
+                                               };
+                                               return make_block(std::array{
+                                                   local_set(limit_f,
+                                                             by_step(
+                                                                 step_positive(),
+                                                                 [&]()
+                                                                 {
+                                                                     return unop(BinaryenFloorFloat64(), unbox_number(exp));
+                                                                 },
+                                                                 [&]()
+                                                                 {
+                                                                     return unop(BinaryenCeilFloat64(), unbox_number(exp));
+                                                                 })),
+                                                   make_if(ge_num(local_get(limit_f, number_type()), const_number(0x1p63)),
+                                                           by_step(step_positive(), clip(std::numeric_limits<int64_t>::max()), skip)),
+                                                   make_if(ge_num(local_get(limit_f, number_type()), const_number(-0x1p63)),
+                                                           BinaryenBreak(mod, label.c_str(), nullptr, unop(BinaryenTruncSFloat64ToInt64(), local_get(limit_f, number_type())))),
+                                                   by_step(step_positive(), skip, clip(std::numeric_limits<int64_t>::min())),
+                                               });
+                                           }
+                                           default:
+                                               return throw_error(add_string("'for' limit must be a number"));
+                                           }
+                                       }),
+                          label.c_str());
+    };
+
+    auto integer_prep = [&](expr_ref init_value, expr_ref step_value)
+    {
+        auto step_positive = [&]()
+        {
+            return gt_int(local_get(step_i, integer_type()), const_integer(0));
+        };
+        auto var = [&]()
+        {
+            return local_get(var_i, integer_type());
+        };
+        auto lim = [&]()
+        {
+            return local_get(limit_i, integer_type());
+        };
+        return make_block(std::array{
+            init_value ? local_set(var_i, init_value) : BinaryenNop(mod),
+            step_value ? local_set(step_i, step_value) : BinaryenNop(mod),
+            step_zero(unop(BinaryenEqZInt64(), local_get(step_i, integer_type()))),
+            limit_typed ? BinaryenNop(mod) : local_set(limit_i, integer_limit()),
+            BinaryenBreak(mod,
+                          end.c_str(),
+                          by_step(
+                              step_positive(),
+                              [&]()
+                              {
+                                  return gt_int(var(), lim());
+                              },
+                              [&]()
+                              {
+                                  return lt_int(var(), lim());
+                              }),
+                          nullptr),
+            // unsigned, the distance between two int64 values may exceed INT64_MAX
+            local_set(count,
+                      by_step(
+                          step_positive(),
+                          [&]()
+                          {
+                              return binop(BinaryenDivUInt64(), sub_int(lim(), var()), local_get(step_i, integer_type()));
+                          },
+                          [&]()
+                          {
+                              return binop(BinaryenDivUInt64(), sub_int(var(), lim()), sub_int(const_integer(0), local_get(step_i, integer_type())));
+                          })),
+        });
+    };
+
+    auto float_prep = [&](expr_ref init_value, expr_ref step_value)
+    {
+        auto step_positive = [&]()
+        {
+            return gt_num(local_get(step_f, number_type()), const_number(0));
+        };
+        auto var = [&]()
+        {
+            return local_get(var_f, number_type());
+        };
+        auto lim = [&]()
+        {
+            return local_get(limit_f, number_type());
+        };
+        return make_block(std::array{
+            local_set(var_f, init_value),
+            local_set(limit_f, to_float(local_get(limit, anyref()), "'for' limit must be a number")),
+            local_set(step_f, step_value),
+            step_zero(eq_num(local_get(step_f, number_type()), const_number(0))),
+            BinaryenBreak(mod,
+                          end.c_str(),
+                          by_step(
+                              step_positive(),
+                              [&]()
+                              {
+                                  return lt_num(lim(), var());
+                              },
+                              [&]()
+                              {
+                                  return lt_num(var(), lim());
+                              }),
+                          nullptr),
+        });
+    };
+
+    auto integer_next = [&]()
+    {
+        return make_block(std::array{
+            BinaryenBreak(mod, end.c_str(), unop(BinaryenEqZInt64(), local_get(count, integer_type())), nullptr),
+            local_set(count, sub_int(local_get(count, integer_type()), const_integer(1))),
+            local_set(var_i, add_int(local_get(var_i, integer_type()), local_get(step_i, integer_type()))),
+        });
+    };
+
+    auto float_next = [&]()
+    {
+        return make_block(std::array{
+            local_set(var_f, add_num(local_get(var_f, number_type()), local_get(step_f, number_type()))),
+            BinaryenBreak(mod,
+                          end.c_str(),
+                          unop(BinaryenEqZInt32(),
+                               by_step(
+                                   gt_num(local_get(step_f, number_type()), const_number(0)),
+                                   [&]()
+                                   {
+                                       return le_num(local_get(var_f, number_type()), local_get(limit_f, number_type()));
+                                   },
+                                   [&]()
+                                   {
+                                       return le_num(local_get(limit_f, number_type()), local_get(var_f, number_type()));
+                                   })),
+                          nullptr),
+        });
+    };
+
+    if (integer_loop)
+        result.push_back(integer_prep(init_typed ? nullptr : const_integer(*init_const), step_typed ? nullptr : const_integer(*step_const)));
+    else
+    {
+        // a constant initial value or step is not in a local, only the other one is tested
+        auto test = init_const ? const_i32(1) : is_integer(local_get(init, anyref()));
+        if (!step_const)
+            test = init_const ? is_integer(local_get(step, anyref())) : binop(BinaryenAndInt32(), test, is_integer(local_get(step, anyref())));
+
+        auto init_int   = init_const ? const_integer(*init_const) : unbox_integer(local_get(init, anyref()));
+        auto init_float = init_const ? const_number(static_cast<double>(*init_const)) : to_float(local_get(init, anyref()), "'for' initial value must be a number");
+        auto step_int   = step_const ? const_integer(*step_const) : unbox_integer(local_get(step, anyref()));
+        auto step_float = step_const ? const_number(static_cast<double>(*step_const)) : to_float(local_get(step, anyref()), "'for' step must be a number");
+
+        result.push_back(make_if(local_tee(is_int, test, bool_type()),
+                                 integer_prep(init_int, step_int),
+                                 float_prep(init_float, step_float)));
     }
-    expr_ref_list result = {(*this)(vars_help)};
-    // improve this mess
-    // while (*step > 0 and *limit >= *var) or (step <= 0 and *limit <= *var) do
-    //     -- loop body
-    //     *var = *var + *step
-    // end
-    bin_operation test_step;
-    test_step.lhs.inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*step");
-    test_step.rhs.inner.emplace<box<prefixexp>>()->chead.emplace<expression>().inner.emplace<int_type>(0);
-    test_step.op = bin_operator::greater_than;
-    bin_operation cmp;
-    cmp.lhs.inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*limit");
-    cmp.rhs.inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*var");
-    cmp.op = bin_operator::greater_or_equal;
-    bin_operation up;
-    up.lhs.inner.emplace<box<prefixexp>>()->chead.emplace<expression>().inner.emplace<box<bin_operation>>(std::move(test_step));
-    up.rhs.inner.emplace<box<prefixexp>>()->chead.emplace<expression>().inner.emplace<box<bin_operation>>(std::move(cmp));
-    up.op = bin_operator::logic_and;
-
-    bin_operation not_test_step;
-    not_test_step.lhs.inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*step");
-    not_test_step.rhs.inner.emplace<box<prefixexp>>()->chead.emplace<expression>().inner.emplace<int_type>(0);
-    not_test_step.op = bin_operator::less_or_equal;
-    bin_operation cmp2;
-    cmp2.lhs.inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*limit");
-    cmp2.rhs.inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*var");
-    cmp2.op = bin_operator::less_or_equal;
-    bin_operation down;
-    down.lhs.inner.emplace<box<prefixexp>>()->chead.emplace<expression>().inner.emplace<box<bin_operation>>(std::move(not_test_step));
-    down.rhs.inner.emplace<box<prefixexp>>()->chead.emplace<expression>().inner.emplace<box<bin_operation>>(std::move(cmp2));
-    down.op = bin_operator::logic_and;
-
-    bin_operation o;
-    o.lhs.inner.emplace<box<prefixexp>>()->chead.emplace<expression>().inner.emplace<box<bin_operation>>(std::move(up));
-    o.rhs.inner.emplace<box<prefixexp>>()->chead.emplace<expression>().inner.emplace<box<bin_operation>>(std::move(down));
-    o.op = bin_operator::logic_or;
-
-    while_statement w;
-    w.condition.inner.emplace<box<bin_operation>>(std::move(o));
-    local_variables counter;
-    counter.names = {p.var};
-    counter.usage = {p.usage};
-    counter.explist.emplace_back().inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*var");
-    w.inner.statements.emplace_back().inner.emplace<local_variables>(std::move(counter));
-    append(w.inner.statements, p.inner.statements);
-    w.inner.retstat = p.inner.retstat;
-
-    bin_operation inc;
-    inc.lhs.inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*var");
-    inc.rhs.inner.emplace<box<prefixexp>>()->chead.emplace<name_t>("*step");
-    inc.op = bin_operator::addition;
-
-    assignments assign;
-    assign.varlist.emplace_back().head.emplace<name_t>("*var");
-    assign.explist.emplace_back().inner.emplace<box<bin_operation>>(inc);
-    w.inner.statements.emplace_back().inner.emplace<assignments>(std::move(assign));
-
-    append(result, (*this)(w));
 
-    return result;
+    expr_ref_list body;
+    {
+        block_scope inner{_func_stack};
+
+        auto value = integer_loop ? new_integer(local_get(var_i, integer_type()))
+                                  : make_if(local_get(is_int, bool_type()),
+                                            new_integer(local_get(var_i, integer_type())),
+                                            new_number(local_get(var_f, number_type())));
+
+        if (p.usage.is_upvalue())
+        {
+            auto index = _func_stack.alloc_lua_local(p.var, upvalue_type());
+            body.push_back(local_set(index, BinaryenStructNew(mod, &value, 1, BinaryenTypeGetHeapType(upvalue_type()))));
+        }
+        else if (integer_loop && storage_type(p.usage) == integer_type())
+        {
+            auto index = _func_stack.alloc_lua_local(p.var, integer_type());
+            if (p.usage.read_count > 0)
+                body.push_back(local_set(index, local_get(var_i, integer_type())));
+        }
+        else
+        {
+            auto index = _func_stack.alloc_lua_local(p.var, anyref());
+            if (p.usage.read_count > 0)
+                body.push_back(local_set(index, value));
+        }
+        append(body, unscoped_block(p.inner));
+    }
+
+    body.push_back(integer_loop ? integer_next() : make_if(local_get(is_int, bool_type()), integer_next(), float_next()));
+    body.push_back(BinaryenBreak(mod, begin.c_str(), nullptr, nullptr));
+
+    result.push_back(BinaryenLoop(mod, begin.c_str(), make_block(body)));
+
+    return {make_block(result, end.c_str())};
 }
 expr_ref_list compiler::operator()(const for_each& p)
 {
@@ -2,25 +2,488 @@
 #include "compiler.hpp"
 
 #include <functional>
+#include <optional>
+#include <variant>
 
 namespace wumbo
 {
 
-expr_ref compiler::operator()(const bin_operation& p)
+static std::optional<value_type> literal_type(const expression& exp)
+{
+    if (std::holds_alternative<int_type>(exp.inner))
+        return value_type::integer;
+    if (std::holds_alternative<float_type>(exp.inner))
+        return value_type::number;
+    return std::nullopt;
+}
+
+template<typename Fast, typename Slow>
+expr_ref compiler::numeric_fast_path(const bin_operation& p, Fast&& fast, Slow&& slow)
+{
+    // integer x integer and number x number are handled inline behind a type
+    // test, everything else goes through the runtime. numeric literals and
+    // operands with a static type are never boxed unless the runtime call is
+    // taken and need no test
+    struct operand
+    {
+        const expression& exp;
+        std::optional<value_type> literal;
+        type_hint hint;
+        std::optional<help_var_scope> local;
+    };
+
+    operand left{p.lhs, literal_type(p.lhs), static_type(p.lhs)};
+    operand right{p.rhs, literal_type(p.rhs), static_type(p.rhs)};
+
+    auto known = [](const operand& o) -> std::optional<value_type>
+    {
+        if (o.hint == type_hint::integer)
+            return value_type::integer;
+        if (o.hint == type_hint::number)
+            return value_type::number;
+        return std::nullopt;
+    };
+
+    expr_ref_list result;
+    for (auto* o : {&left, &right})
+    {
+        if (o->literal)
+            continue;
+        if (auto vtype = known(*o))
+        {
+            o->local.emplace(_func_stack, *vtype == value_type::integer ? integer_type() : number_type());
+            result.push_back(local_set(*o->local, unboxed(o->exp, *vtype)));
+        }
+        else
+        {
+            o->local.emplace(_func_stack, anyref());
+            result.push_back(local_set(*o->local, single_value((*this)(o->exp))));
+        }
+    }
+
+    auto boxed = [&](operand& o)
+    {
+        if (o.literal)
+            return (*this)(o.exp);
+        if (auto vtype = known(o))
+            return *vtype == value_type::integer ? new_integer(local_get(*o.local, integer_type())) : new_number(local_get(*o.local, number_type()));
+        return local_get(*o.local, anyref());
+    };
+
+    auto slow_path = [&]()
+    {
+        return slow(boxed(left), boxed(right));
+    };
+
+    auto operand_value = [&](operand& o, value_type vtype)
+    {
+        if (o.literal == value_type::integer)
+        {
+            auto value = std::get<int_type>(o.exp.inner);
+            return vtype == value_type::integer ? const_integer(value) : const_number(static_cast<double>(value));
+        }
+        if (o.literal == value_type::number)
+            return const_number(std::get<float_type>(o.exp.inner));
+        if (known(o))
+            return local_get(*o.local, vtype == value_type::integer ? integer_type() : number_type());
+        if (vtype == value_type::integer)
+            return unbox_integer(local_get(*o.local, anyref()));
+        return unbox_number(BinaryenRefCast(mod, local_get(*o.local, anyref()), type<value_type::number>()));
+    };
+
+    // nullptr when the operand is statically of the tested type, other static
+    // types rule out the fast path completely. integer literals take part in
+    // float operations as long as the conversion is exact
+    auto test = [&](operand& o, value_type vtype, bool& possible) -> expr_ref
+    {
+        if (o.literal == value_type::integer && vtype == value_type::number)
+        {
+            constexpr int_type exact = int_type{1} << 53;
+            auto value               = std::get<int_type>(o.exp.inner);
+            possible &= -exact <= value && value <= exact;
+        }
+        else if (o.literal)
+            possible &= o.literal == vtype;
+        else if (auto static_vtype = known(o))
+            possible &= static_vtype == vtype;
+        else if (o.hint != type_hint::any && o.hint != type_hint::unknown)
+            possible = false;
+
+        if (o.literal || (o.hint != type_hint::any && o.hint != type_hint::unknown))
+            return nullptr;
+        return test_type(local_get(*o.local, anyref()), vtype);
+    };
+
+    expr_ref exp = nullptr;
+    for (auto vtype : {value_type::number, value_type::integer})
+    {
+        bool possible = true;
+        auto l        = test(left, vtype, possible);
+        auto r        = test(right, vtype, possible);
+        if (!possible)
+            continue;
+        if (vtype == value_type::number && left.literal == value_type::integer && right.literal == value_type::integer)
+            continue; // two integer literals are always integers
+
+        auto a    = operand_value(left, vtype);
+        auto b    = operand_value(right, vtype);
+        auto path = fast(vtype, a, b, slow_path);
+        auto cond = l && r ? binop(BinaryenAndInt32(), l, r) : (l ? l : r);
+        exp       = cond ? make_if(cond, path, exp ? exp : slow_path()) : path;
+    }
+    result.push_back(exp ? exp : slow_path());
+    return make_block(result);
+}
+
+expr_ref compiler::arithmetic_unboxed(bin_operator op, value_type vtype, expr_ref a, expr_ref b)
+{
+    // the result is an i64 for integer operands except for the division
+    if (vtype == value_type::integer)
+    {
+        switch (op)
+        {
+        case bin_operator::addition:
+            return add_int(a, b);
+        case bin_operator::subtraction:
+            return sub_int(a, b);
+        case bin_operator::multiplication:
+            return mul_int(a, b);
+        case bin_operator::division:
+            return div_num(int_to_num(a), int_to_num(b));
+        case bin_operator::modulo:
+        {
+            // floored modulo
+            auto divisor = help_var_scope{_func_stack, integer_type()};
+            auto rem     = help_var_scope{_func_stack, integer_type()};
+
+            auto m = add_int(local_tee(rem, binop(BinaryenRemSInt64(), a, local_get(divisor, integer_type())), integer_type()),
+                             make_if(binop(BinaryenAndInt32(),
+                                           ne_int(local_get(rem, integer_type()), const_integer(0)),
+                                           lt_int(xor_int(local_get(rem, integer_type()), local_get(divisor, integer_type())), const_integer(0))),
+                                     local_get(divisor, integer_type()),
+                                     const_integer(0)));
+            return make_if(unop(BinaryenEqZInt64(), local_tee(divisor, b, integer_type())),
+                           throw_error(add_string("attempt to perform 'n%0'")),
+                           m);
+        }
+        default:
+            semantic_error("");
+        }
+    }
+
+    switch (op)
+    {
+    case bin_operator::addition:
+        return add_num(a, b);
+    case bin_operator::subtraction:
+        return sub_num(a, b);
+    case bin_operator::multiplication:
+        return mul_num(a, b);
+    case bin_operator::division:
+        return div_num(a, b);
+    case bin_operator::modulo:
+    {
+        // luai_nummod: m = fmod(a, b); if ((m > 0) ? b < 0 : (m < 0 && b > 0)) m += b;
+        auto divisor = help_var_scope{_func_stack, number_type()};
+        auto rem     = help_var_scope{_func_stack, number_type()};
+        auto m       = [&]()
+        {
+            return local_get(rem, number_type());
+        };
+        auto d = [&]()
+        {
+            return local_get(divisor, number_type());
+        };
+        auto adjust = make_if(gt_num(local_tee(rem, fmod_num(a, local_tee(divisor, b, number_type())), number_type()), const_number(0)),
+                              lt_num(d(), const_number(0)),
+                              binop(BinaryenAndInt32(), lt_num(m(), const_number(0)), gt_num(d(), const_number(0))));
+        return make_if(adjust, add_num(m(), d()), m());
+    }
+    default:
+        semantic_error("");
+    }
+}
+
+expr_ref compiler::arithmetic(const bin_operation& p, functions function)
+{
+    auto fast = [&](value_type vtype, expr_ref a, expr_ref b, auto&&) -> expr_ref
+    {
+        auto result = arithmetic_unboxed(p.op, vtype, a, b);
+        if (vtype == value_type::integer && p.op != bin_operator::division)
+            return new_integer(result);
+        return new_number(result);
+    };
+
+    return numeric_fast_path(p, fast, [&](expr_ref left, expr_ref right)
+                             {
+                                 return _runtime.call(function, std::array{left, right});
+                             });
+}
+
+expr_ref compiler::unboxed(const expression& exp, value_type vtype)
+{
+    // exp has the static type vtype, operations on statically typed operands
+    // are computed without boxing the intermediate results
+    auto fallback = [&]() -> expr_ref
+    {
+        auto value = single_value((*this)(exp));
+        if (vtype == value_type::integer)
+            return unbox_integer(value);
+        return unbox_number(BinaryenRefCast(mod, value, type<value_type::number>()));
+    };
+
+    auto operand = [&](const expression& e, value_type operand_type) -> expr_ref
+    {
+        if (static_type(e) == type_hint::integer)
+        {
+            auto value = unboxed(e, value_type::integer);
+            return operand_type == value_type::number ? int_to_num(value) : value;
+        }
+        return unboxed(e, value_type::number);
+    };
+
+    return std::visit(overload{
+                          [&](const int_type& value) -> expr_ref
+                          {
+                              return const_integer(value);
+                          },
+                          [&](const float_type& value) -> expr_ref
+                          {
+                              return const_number(value);
+                          },
+                          [&](const box<prefixexp>& p) -> expr_ref
+                          {
+                              if (!p->tail.empty())
+                                  return fallback();
+                              if (auto inner = std::get_if<expression>(&p->chead))
+                                  return unboxed(*inner, vtype);
+
+                              auto [var_type, index, storage] = _func_stack.find(std::get<name_t>(p->chead));
+                              if (var_type == var_type::local && (storage == integer_type() || storage == number_type()))
+                                  return local_get(index, storage);
+                              return fallback();
+                          },
+                          [&](const box<bin_operation>& p) -> expr_ref
+                          {
+                              switch (p->op)
+                              {
+                              case bin_operator::addition:
+                              case bin_operator::subtraction:
+                              case bin_operator::multiplication:
+                              case bin_operator::division:
+                              case bin_operator::modulo:
+                              {
+                                  bool integer = static_type(p->lhs) == type_hint::integer && static_type(p->rhs) == type_hint::integer;
+                                  auto operand_type = integer ? value_type::integer : value_type::number;
+                                  auto a            = operand(p->lhs, operand_type);
+                                  auto b            = operand(p->rhs, operand_type);
+                                  return arithmetic_unboxed(p->op, operand_type, a, b);
+                              }
+                              default:
+                                  return fallback();
+                              }
+                          },
+                          [&](const box<un_operation>& p) -> expr_ref
+                          {
+                              if (p->op != un_operator::minus)
+                                  return fallback();
+                              if (vtype == value_type::integer)
+                                  return sub_int(const_integer(0), unboxed(p->rhs, vtype));
+                              return unop(BinaryenNegFloat64(), unboxed(p->rhs, vtype));
+                          },
+                          [&](const auto&)
+                          {
+                              return fallback();
+                          },
+                      },
+                      exp.inner);
+}
+
+expr_ref compiler::value_as(const expression& exp, BinaryenType storage)
+{
+    auto hint = static_type(exp);
+    if (storage == integer_type() && hint == type_hint::integer)
+        return unboxed(exp, value_type::integer);
+    if (storage == number_type() && hint == type_hint::number)
+        return unboxed(exp, value_type::number);
+    return to_storage(single_value((*this)(exp)), storage);
+}
+
+expr_ref compiler::comparison(const bin_operation& p)
 {
-    auto lhs = (*this)(p.lhs);
-    auto rhs = (*this)(p.rhs);
+    bool is_equality = p.op == bin_operator::equality || p.op == bin_operator::inequality;
 
-    if (BinaryenExpressionGetType(lhs) == ref_array_type())
+    // x == nil only needs a null check
+    if (is_equality && (std::holds_alternative<nil>(p.lhs.inner) || std::holds_alternative<nil>(p.rhs.inner)))
     {
-        auto local = help_var_scope{_func_stack, ref_array_type()};
-        lhs        = at_or_null(local, 0, lhs);
+        auto& other  = std::holds_alternative<nil>(p.lhs.inner) ? p.rhs : p.lhs;
+        auto is_null = BinaryenRefIsNull(mod, single_value((*this)(other)));
+        return p.op == bin_operator::equality ? is_null : unop(BinaryenEqZInt32(), is_null);
     }
-    if (BinaryenExpressionGetType(rhs) == ref_array_type())
+
+    auto fast = [&](value_type vtype, expr_ref a, expr_ref b, auto&&) -> expr_ref
     {
-        auto local = help_var_scope{_func_stack, ref_array_type()};
-        rhs        = at_or_null(local, 0, rhs);
+        bool is_int = vtype == value_type::integer;
+        switch (p.op)
+        {
+        case bin_operator::equality:
+            return is_int ? eq_int(a, b) : eq_num(a, b);
+        case bin_operator::inequality:
+            return is_int ? ne_int(a, b) : ne_num(a, b);
+        case bin_operator::less_than:
+            return is_int ? lt_int(a, b) : lt_num(a, b);
+        case bin_operator::greater_than:
+            return is_int ? gt_int(a, b) : gt_num(a, b);
+        case bin_operator::less_or_equal:
+            return is_int ? le_int(a, b) : le_num(a, b);
+        case bin_operator::greater_or_equal:
+            return is_int ? ge_int(a, b) : ge_num(a, b);
+        default:
+            semantic_error("");
+        }
+    };
+
+    auto function = [&]()
+    {
+        switch (p.op)
+        {
+        case bin_operator::equality:
+            return functions::equality;
+        case bin_operator::inequality:
+            return functions::inequality;
+        case bin_operator::less_than:
+            return functions::less_than;
+        case bin_operator::greater_than:
+            return functions::greater_than;
+        case bin_operator::less_or_equal:
+            return functions::less_or_equal;
+        case bin_operator::greater_or_equal:
+            return functions::greater_or_equal;
+        default:
+            semantic_error("");
+        }
+    }();
+
+    return numeric_fast_path(p, fast, [&](expr_ref left, expr_ref right)
+                             {
+                                 return unbox_boolean(_runtime.call(function, std::array{left, right}));
+                             });
+}
+
+expr_ref compiler::condition(const expression& p)
+{
+    // lowers an expression used as a condition straight to an i32
+    return std::visit(overload{
+                          [&](const nil&)
+                          {
+                              return const_boolean(false);
+                          },
+                          [&](const boolean& b)
+                          {
+                              return const_boolean(b.value);
+                          },
+                          [&](const box<un_operation>& op)
+                          {
+                              if (op->op == un_operator::logic_not)
+                                  return unop(BinaryenEqZInt32(), condition(op->rhs));
+                              return _runtime.call(functions::to_bool, single_value((*this)(p)));
+                          },
+                          [&](const box<bin_operation>& op)
+                          {
+                              switch (op->op)
+                              {
+                              case bin_operator::logic_and:
+                                  return make_if(condition(op->lhs), condition(op->rhs), const_boolean(false));
+                              case bin_operator::logic_or:
+                                  return make_if(condition(op->lhs), const_boolean(true), condition(op->rhs));
+                              case bin_operator::equality:
+                              case bin_operator::inequality:
+                              case bin_operator::less_than:
+                              case bin_operator::greater_than:
+                              case bin_operator::less_or_equal:
+                              case bin_operator::greater_or_equal:
+                                  return comparison(*op);
+                              default:
+                                  return _runtime.call(functions::to_bool, single_value((*this)(p)));
+                              }
+                          },
+                          [&](const auto&)
+                          {
+                              return _runtime.call(functions::to_bool, single_value((*this)(p)));
+                          },
+                      },
+                      p.inner);
+}
+
+expr_ref compiler::concat(const bin_operation& p)
+{
+    // a .. b .. c is parsed as a .. (b .. c), the whole chain becomes one runtime call
+    std::vector<const expression*> operands;
+    auto flatten = [&](auto& self, const expression& exp) -> void
+    {
+        if (auto op = std::get_if<box<bin_operation>>(&exp.inner); op && (*op)->op == bin_operator::concat)
+        {
+            self(self, (*op)->lhs);
+            self(self, (*op)->rhs);
+        }
+        else
+            operands.push_back(&exp);
+    };
+    flatten(flatten, p.lhs);
+    flatten(flatten, p.rhs);
+
+    // adjacent string literals are joined at compile time
+    expr_ref_list values;
+    std::optional<std::string> joined;
+    for (auto exp : operands)
+    {
+        if (auto str = std::get_if<literal>(&exp->inner))
+        {
+            joined = joined.value_or("") + str->str;
+            continue;
+        }
+        if (joined)
+            values.push_back(add_string(*std::exchange(joined, std::nullopt)));
+        values.push_back(single_value((*this)(*exp)));
     }
+    if (joined)
+        values.push_back(add_string(*joined));
+
+    if (values.size() == 1)
+        return values.front();
+    return _runtime.call(functions::concat, ref_array::create_fixed(*this, values));
+}
+
+expr_ref compiler::operator()(const bin_operation& p)
+{
+    switch (p.op)
+    {
+    case bin_operator::addition:
+        return arithmetic(p, functions::addition);
+    case bin_operator::subtraction:
+        return arithmetic(p, functions::subtraction);
+    case bin_operator::multiplication:
+        return arithmetic(p, functions::multiplication);
+    case bin_operator::division:
+        return arithmetic(p, functions::division);
+    case bin_operator::modulo:
+        return arithmetic(p, functions::modulo);
+    case bin_operator::equality:
+    case bin_operator::inequality:
+    case bin_operator::less_than:
+    case bin_operator::greater_than:
+    case bin_operator::less_or_equal:
+    case bin_operator::greater_or_equal:
+        return new_boolean(comparison(p));
+    case bin_operator::concat:
+        return concat(p);
+    default:
+        break;
+    }
+
+    auto lhs = single_value((*this)(p.lhs));
+    auto rhs = single_value((*this)(p.rhs));
+
     switch (p.op)
     {
     case bin_operator::logic_and:
@@ -42,20 +505,10 @@ expr_ref compiler::operator()(const bin_operation& p)
     {
         switch (op)
         {
-        case bin_operator::addition:
-            return functions::addition;
-        case bin_operator::subtraction:
-            return functions::subtraction;
-        case bin_operator::multiplication:
-            return functions::multiplication;
-        case bin_operator::division:
-            return functions::division;
         case bin_operator::division_floor:
             return functions::division_floor;
         case bin_operator::exponentiation:
             return functions::exponentiation;
-        case bin_operator::modulo:
-            return functions::modulo;
 
         case bin_operator::binary_or:
             return functions::binary_or;
@@ -68,21 +521,6 @@ expr_ref compiler::operator()(const bin_operation& p)
         case bin_operator::binary_left_shift:
             return functions::binary_left_shift;
 
-        case bin_operator::equality:
-            return functions::equality;
-        case bin_operator::inequality:
-            return functions::inequality;
-        case bin_operator::less_than:
-            return functions::less_than;
-        case bin_operator::greater_than:
-            return functions::greater_than;
-        case bin_operator::less_or_equal:
-            return functions::less_or_equal;
-        case bin_operator::greater_or_equal:
-            return functions::greater_or_equal;
-
-        //case bin_operator::concat:
-        //    return functions::concat;
         default:
             semantic_error("");
         }
@@ -93,21 +531,17 @@ expr_ref compiler::operator()(const bin_operation& p)
 
 expr_ref compiler::operator()(const un_operation& p)
 {
-    auto rhs = (*this)(p.rhs);
+    if (p.op == un_operator::logic_not)
+        return new_boolean(unop(BinaryenEqZInt32(), condition(p.rhs)));
+
+    auto rhs = single_value((*this)(p.rhs));
 
-    if (BinaryenExpressionGetType(rhs) == ref_array_type())
-    {
-        auto local = help_var_scope{_func_stack, ref_array_type()};
-        rhs        = at_or_null(local, 0, rhs);
-    }
     functions f = [this](un_operator op)
     {
         switch (op)
         {
         case un_operator::minus:
             return functions::minus;
-        case un_operator::logic_not:
-            return functions::logic_not;
         case un_operator::len:
             return functions::len;
         case un_operator::binary_not:
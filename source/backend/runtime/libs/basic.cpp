@@ -6,7 +6,6 @@ namespace wumbo
 build_return_t runtime::open_basic_lib()
 {
     lua_std_func_t std{*this};
-    BinaryenAddFunctionImport(mod, "stdout", "native", "stdout", BinaryenTypeExternref(), BinaryenTypeNone());
     BinaryenAddFunctionImport(mod, "load_lua", "load", "load", BinaryenTypeExternref(), lua_func());
 
     std("assert", std::array{"v", "..."}, [this](runtime::function_stack& stack, auto&& vars)
@@ -53,9 +52,24 @@ build_return_t runtime::open_basic_lib()
                                     }
                                 });
         });
-    std("ipairs", std::array{"t"}, [this](function_stack& stack, auto&& vars)
+    auto ipairs_iter = std.global("ipairs_iter", std::array{"t", "i"}, [this](function_stack& stack, auto&& vars)
+                                  {
+                                      auto [t, i] = vars;
+                                      auto value  = stack.alloc(anyref(), "value");
+                                      auto index  = [&]()
+                                      {
+                                          return new_integer(add_int(unbox_integer(stack.get(i)), const_integer(1)));
+                                      };
+                                      return std::array{
+                                          make_if(BinaryenRefIsNull(mod, stack.tee(value, call(functions::table_get, std::array{stack.get(t), index()}))),
+                                                  make_return(ref_array::create_fixed(*this, null()))),
+                                          make_return(ref_array::create_fixed(*this, std::array{index(), stack.get(value)})),
+                                      };
+                                  });
+    std("ipairs", std::array{"t"}, [&](function_stack& stack, auto&& vars)
         {
-            return BinaryenUnreachable(mod);
+            auto [t] = vars;
+            return make_return(ref_array::create_fixed(*this, std::array{ipairs_iter(), stack.get(t), new_integer(const_integer(0))}));
         });
 
     std("load", std::array{"chunk", "chunkname", "mode", "env"}, ref_array::create_fixed(*this, local_get(0, get_type<table>())), [this](function_stack& stack, auto&& vars)
@@ -88,13 +102,16 @@ build_return_t runtime::open_basic_lib()
         {
             return BinaryenUnreachable(mod);
         });
-    std("next", std::array{"table", "index"}, [this](function_stack& stack, auto&& vars)
+    auto next = std.global("next", std::array{"table", "index"}, [this](function_stack& stack, auto&& vars)
+                           {
+                               auto [table, index] = vars;
+                               return make_return(table_next(BinaryenRefCast(mod, stack.get(table), get_type<runtime::table>()), stack.get(index)));
+                           });
+    std.set("next", next());
+    std("pairs", std::array{"t"}, [&](function_stack& stack, auto&& vars)
         {
-            return BinaryenUnreachable(mod);
-        });
-    std("pairs", std::array{"t"}, [this](function_stack& stack, auto&& vars)
-        {
-            return BinaryenUnreachable(mod);
+            auto [t] = vars;
+            return make_return(ref_array::create_fixed(*this, std::array{next(), stack.get(t), null()}));
         });
 
     auto make_pcall = [this](bool x)
@@ -143,11 +160,10 @@ build_return_t runtime::open_basic_lib()
 
             auto exp = array_get(stack.get(vaarg), stack.get(i), anyref());
             exp      = call(functions::to_string, exp);
-            exp      = call(functions::lua_str_to_js_array, exp);
-            exp      = make_call("stdout", exp, BinaryenTypeNone());
+            exp      = write_output()(std::array{exp});
 
             exp = loop(i, size, make_block(std::array{
-                                    make_if(stack.get(i), make_call("stdout", call(functions::lua_str_to_js_array, add_string("\t")), BinaryenTypeNone())),
+                                    make_if(stack.get(i), write_output()(std::array{add_string("\t")})),
                                     exp,
                                 }),
                        const_i32(0),
@@ -155,7 +171,9 @@ build_return_t runtime::open_basic_lib()
 
             return std::array{
                 exp,
-                make_call("stdout", call(functions::lua_str_to_js_array, add_string("\n")), BinaryenTypeNone()),
+                write_output()(std::array{add_string("\n")}),
+                make_if(binop(BinaryenGeUInt32(), output_length(), const_i32(output_flush_length)),
+                        call(functions::flush_output, std::span<const expr_ref>{})),
                 null(),
             };
         });
@@ -169,7 +187,24 @@ build_return_t runtime::open_basic_lib()
         });
     std("rawlen", std::array{"v"}, [this](function_stack& stack, auto&& vars)
         {
-            return BinaryenUnreachable(mod);
+            auto [v]   = vars;
+            auto casts = std::array{
+                value_type::string,
+                value_type::table,
+            };
+            return switch_value(stack.get(v), casts, [&](value_type type, expr_ref exp)
+                                {
+                                    switch (type)
+                                    {
+                                    case value_type::string:
+                                        return make_return(ref_array::create_fixed(*this, new_integer(size_to_integer(string_length(exp)))));
+                                    case value_type::table:
+                                        // the border without __len
+                                        return make_return(ref_array::create_fixed(*this, new_integer(size_to_integer(table_border(exp)))));
+                                    default:
+                                        return throw_error(add_string("table or string expected"));
+                                    }
+                                });
         });
     std("rawset", std::array{"table", "index", "value"}, [this](function_stack& stack, auto&& vars)
         {
@@ -193,6 +228,8 @@ build_return_t runtime::open_basic_lib()
                                     case value_type::table:
                                         return make_block(std::array{
                                             table::set<table::metatable>(*this, exp, m),
+                                            // inherited fields cached through the old metatable
+                                            prototype_changed(BinaryenRefCast(mod, stack.get(table), this->type<value_type::table>())),
                                             make_return(make_ref_array(stack, std::array{stack.get(table)})),
                                         });
                                     default:
@@ -2,6 +2,81 @@
 
 namespace wumbo
 {
+// the pending output lives in a byte array, the first *output_length bytes are used
+static void add_output_globals(runtime& self)
+{
+    if (!BinaryenGetGlobal(self.mod, "*output"))
+    {
+        BinaryenAddGlobal(self.mod, "*output", self.get_type<ext_types::string_array>(), true, self.null());
+        BinaryenAddGlobal(self.mod, "*output_length", self.size_type(), true, self.const_i32(0));
+        self.import_func("stdout", BinaryenTypeExternref(), BinaryenTypeNone(), "native");
+    }
+}
+
+expr_ref runtime::output_length()
+{
+    add_output_globals(*this);
+    return BinaryenGlobalGet(mod, "*output_length", size_type());
+}
+
+runtime::function_stack::func_t runtime::write_output()
+{
+    add_output_globals(*this);
+    runtime::function_stack stack{mod};
+
+    return stack.add_function("*write_output", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+                              {
+                                  auto str = stack.alloc(type<value_type::string>(), "str");
+                                  stack.locals();
+
+                                  auto data = stack.alloc(get_type<string_array>(), "data");
+                                  auto len  = stack.alloc(size_type(), "len");
+
+                                  auto buffer = [&]()
+                                  {
+                                      return BinaryenGlobalGet(mod, "*output", get_type<string_array>());
+                                  };
+
+                                  return make_block(std::array{
+                                      stack.set(len, array_len(stack.tee(data, string_data(stack.get(str))))),
+                                      make_if(binop(BinaryenGtUInt32(), binop(BinaryenAddInt32(), output_length(), stack.get(len)), const_i32(output_buffer_size)),
+                                              make_block(std::array{
+                                                  call(functions::flush_output, std::span<const expr_ref>{}),
+                                                  // does not fit at all, passed on directly
+                                                  make_if(binop(BinaryenGtUInt32(), stack.get(len), const_i32(output_buffer_size)),
+                                                          make_block(std::array{
+                                                              make_call("stdout", call(functions::lua_str_to_js_array, stack.get(str)), BinaryenTypeNone()),
+                                                              make_return(),
+                                                          })),
+                                              })),
+                                      make_if(BinaryenRefIsNull(mod, buffer()),
+                                              BinaryenGlobalSet(mod, "*output", string_array::create(*this, const_i32(output_buffer_size)))),
+                                      BinaryenArrayCopy(mod, buffer(), output_length(), stack.get(data), const_i32(0), stack.get(len)),
+                                      BinaryenGlobalSet(mod, "*output_length", binop(BinaryenAddInt32(), output_length(), stack.get(len))),
+                                  });
+                              });
+}
+
+build_return_t runtime::flush_output()
+{
+    add_output_globals(*this);
+
+    return {std::vector<BinaryenType>{
+                get_type<string_array>(),
+            },
+            make_block(std::array{
+                make_if(unop(BinaryenEqZInt32(), output_length()), make_return()),
+                local_set(0, string_array::create(*this, output_length())),
+                BinaryenArrayCopy(mod,
+                                  local_get(0, get_type<string_array>()),
+                                  const_i32(0),
+                                  BinaryenGlobalGet(mod, "*output", get_type<string_array>()),
+                                  const_i32(0),
+                                  output_length()),
+                BinaryenGlobalSet(mod, "*output_length", const_i32(0)),
+                make_call("stdout", call(functions::lua_str_to_js_array, new_string(local_get(0, get_type<string_array>()))), BinaryenTypeNone()),
+            })};
+}
 
 build_return_t runtime::open_io_lib()
 {
@@ -15,7 +90,10 @@ build_return_t runtime::open_io_lib()
 
     std("flush", std::array<const char*, 0>{}, [this](runtime::function_stack& stack, auto&& vars) -> expr_ref
         {
-            return BinaryenUnreachable(mod);
+            return make_block(std::array{
+                call(functions::flush_output, std::span<const expr_ref>{}),
+                null(),
+            });
         });
 
     std("input", std::array{"file"}, [this](runtime::function_stack& stack, auto&& vars) -> expr_ref
@@ -68,7 +146,20 @@ build_return_t runtime::open_io_lib()
     std("write", std::array{"..."}, [this](runtime::function_stack& stack, auto&& vars) -> expr_ref
         {
             auto [vaarg] = vars;
-            return BinaryenUnreachable(mod);
+            auto i       = stack.alloc(size_type(), "i");
+            auto size    = stack.alloc(size_type(), "size");
+            auto value   = stack.alloc(anyref(), "value");
+
+            auto is_writable = binop(BinaryenOrInt32(),
+                                     test_type(stack.tee(value, array_get(stack.get(vaarg), stack.get(i), anyref())), value_type::string),
+                                     binop(BinaryenOrInt32(),
+                                           test_type(stack.get(value), value_type::number),
+                                           test_type(stack.get(value), value_type::integer)));
+
+            return make_block(std::array{
+                loop(i, size, make_if(is_writable, write_output()(std::array{call(functions::to_string, stack.get(value))}), throw_error(add_string("bad argument to 'write' (string expected)"))), const_i32(0), array_len(stack.get(vaarg))),
+                null(),
+            });
         });
     std.result.push_back(local_get(0, get_type<table>()));
 
@@ -67,6 +67,8 @@ struct runtime::op
                 switch (right_type)
                 {
                 case value_type::integer:
+                    if (!int_op) // operation always results in a float
+                        return self->make_return(self->new_number(std::invoke(num_op, self, self->int_to_num(left), self->int_to_num(right))));
                     return self->make_return(self->new_integer(std::invoke(int_op, self, left, right)));
                 case value_type::number:
                     left = self->int_to_num(left);
@@ -177,14 +179,43 @@ struct runtime::op
         }
     };
 
-    template<typename F>
-    static build_return_t bin(runtime* self, const char* function, F&& op)
+    // operands of other types go to the metamethods
+    static auto meta(runtime::event e)
+    {
+        return [e](runtime* self, expr_ref left, expr_ref right)
+        {
+            return self->make_return(self->binary_metamethod(left, right, e));
+        };
+    }
+
+    // a > b is b < a and a >= b is b <= a
+    static auto order(runtime::event e, bool swap = false)
+    {
+        return [e, swap](runtime* self, expr_ref left, expr_ref right)
+        {
+            if (swap)
+                std::swap(left, right);
+            return self->make_return(self->new_boolean(self->call(functions::to_bool, self->binary_metamethod(left, right, e))));
+        };
+    }
+
+    static auto equal(bool negate = false)
+    {
+        return [negate](runtime* self, expr_ref left, expr_ref right)
+        {
+            auto result = self->values_equal(left, right);
+            return self->make_return(self->new_boolean(negate ? self->unop(BinaryenEqZInt32(), result) : result));
+        };
+    }
+
+    template<typename F, typename M>
+    static build_return_t bin(runtime* self, const char* function, F&& op, M&& fallback)
     {
         return {std::vector<BinaryenType>{},
                 self->make_block(self->switch_value(self->local_get(0, anyref()), op.casts, [&](value_type left_type, expr_ref left)
                                                     {
                                                         if (std::find(std::begin(op.casts), std::end(op.casts), left_type) == std::end(op.casts))
-                                                            return self->throw_error(self->add_string("unexpected type"));
+                                                            return fallback(self, self->local_get(0, anyref()), self->local_get(1, anyref()));
 
                                                         auto func_name = std::string{function} + type_name(left_type);
 
@@ -205,17 +236,17 @@ struct runtime::op
                                                                                                                     switch (left_type)
                                                                                                                     {
                                                                                                                     case value_type::integer:
-                                                                                                                        left = BinaryenStructGet(self->mod, 0, left, self->integer_type(), false);
+                                                                                                                        left = self->unbox_integer(left);
                                                                                                                         switch (right_type)
                                                                                                                         {
                                                                                                                         case value_type::integer:
-                                                                                                                            right = BinaryenStructGet(self->mod, 0, right, self->integer_type(), false);
+                                                                                                                            right = self->unbox_integer(right);
                                                                                                                             break;
                                                                                                                         case value_type::number:
                                                                                                                             right = BinaryenStructGet(self->mod, 0, right, self->number_type(), false);
                                                                                                                             break;
                                                                                                                         default:
-                                                                                                                            return self->throw_error(self->add_string("unexpected type"));
+                                                                                                                            return fallback(self, self->local_get(0, self->type(left_type)), self->local_get(1, anyref()));
                                                                                                                         }
                                                                                                                         break;
 
@@ -224,13 +255,13 @@ struct runtime::op
                                                                                                                         switch (right_type)
                                                                                                                         {
                                                                                                                         case value_type::integer:
-                                                                                                                            right = BinaryenStructGet(self->mod, 0, right, self->integer_type(), false);
+                                                                                                                            right = self->unbox_integer(right);
                                                                                                                             break;
                                                                                                                         case value_type::number:
                                                                                                                             right = BinaryenStructGet(self->mod, 0, right, self->number_type(), false);
                                                                                                                             break;
                                                                                                                         default:
-                                                                                                                            return self->throw_error(self->add_string("unexpected type"));
+                                                                                                                            return fallback(self, self->local_get(0, self->type(left_type)), self->local_get(1, anyref()));
                                                                                                                         }
                                                                                                                         break;
 
@@ -247,101 +278,220 @@ struct runtime::op
     }
 };
 
+// the handler of the left operand or else of the right one, called with both
+expr_ref runtime::binary_metamethod(expr_ref left, expr_ref right, event e)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function(std::string{"*metamethod"} + event_names[static_cast<size_t>(e)], anyref(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto left  = stack.alloc(anyref(), "left");
+                                       auto right = stack.alloc(anyref(), "right");
+                                       stack.locals();
+                                       auto handler = stack.alloc(anyref(), "handler");
+
+                                       return make_block(std::array{
+                                           make_if(BinaryenRefIsNull(mod, stack.tee(handler, metamethod(metatable_of(stack.get(left)), e))),
+                                                   stack.set(handler, metamethod(metatable_of(stack.get(right)), e))),
+                                           make_if(BinaryenRefIsNull(mod, stack.get(handler)),
+                                                   throw_error(add_string("unexpected type"))),
+                                           make_return(first_result(call(functions::invoke,
+                                                                         std::array{
+                                                                             stack.get(handler),
+                                                                             ref_array::create_fixed(*this, std::array{stack.get(left), stack.get(right)}),
+                                                                         }))),
+                                       });
+                                   });
+    return func(std::array{left, right});
+}
+
+// == for operands that are not both numbers: the same object, equal strings or
+// tables with __eq
+expr_ref runtime::values_equal(expr_ref left, expr_ref right)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function("*values_equal", bool_type(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto left  = stack.alloc(anyref(), "left");
+                                       auto right = stack.alloc(anyref(), "right");
+                                       stack.locals();
+                                       auto handler = stack.alloc(anyref(), "handler");
+
+                                       auto eq = [&](size_t local)
+                                       {
+                                           return BinaryenRefCast(mod, stack.get(local), BinaryenTypeFromHeapType(BinaryenHeapTypeEq(), true));
+                                       };
+                                       auto both = [&](value_type vtype)
+                                       {
+                                           return binop(BinaryenAndInt32(),
+                                                        BinaryenRefTest(mod, stack.get(left), type(vtype)),
+                                                        BinaryenRefTest(mod, stack.get(right), type(vtype)));
+                                       };
+                                       return make_block(std::array{
+                                           make_if(BinaryenRefEq(mod, eq(left), eq(right)),
+                                                   make_return(const_boolean(true))),
+                                           make_if(both(value_type::string),
+                                                   make_return(compare(value_type::string)(std::array{BinaryenRefCast(mod, stack.get(left), type<value_type::string>()), stack.get(right)}))),
+                                           make_if(unop(BinaryenEqZInt32(), both(value_type::table)),
+                                                   make_return(const_boolean(false))),
+                                           make_if(BinaryenRefIsNull(mod, stack.tee(handler, metamethod(metatable_of(stack.get(left)), event::eq))),
+                                                   stack.set(handler, metamethod(metatable_of(stack.get(right)), event::eq))),
+                                           make_if(BinaryenRefIsNull(mod, stack.get(handler)),
+                                                   make_return(const_boolean(false))),
+                                           make_return(call(functions::to_bool,
+                                                            first_result(call(functions::invoke,
+                                                                              std::array{
+                                                                                  stack.get(handler),
+                                                                                  ref_array::create_fixed(*this, std::array{stack.get(left), stack.get(right)}),
+                                                                              })))),
+                                       });
+                                   });
+    return func(std::array{left, right});
+}
+
 build_return_t runtime::addition()
 {
-    return op::bin(this, "addition", op::arith{&runtime::add_int, &runtime::add_num});
+    return op::bin(this, "addition", op::arith{&runtime::add_int, &runtime::add_num}, op::meta(event::add));
 }
 
 build_return_t runtime::subtraction()
 {
-    return op::bin(this, "subtraction", op::arith{&runtime::sub_int, &runtime::sub_num});
+    return op::bin(this, "subtraction", op::arith{&runtime::sub_int, &runtime::sub_num}, op::meta(event::sub));
 }
 
 build_return_t runtime::multiplication()
 {
-    return op::bin(this, "multiplication", op::arith{&runtime::mul_int, &runtime::mul_num});
+    return op::bin(this, "multiplication", op::arith{&runtime::mul_int, &runtime::mul_num}, op::meta(event::mul));
 }
 
 build_return_t runtime::division()
 {
-    return op::bin(this, "division", op::arith{&runtime::div_int, &runtime::div_num});
+    return op::bin(this, "division", op::arith{nullptr, &runtime::div_num}, op::meta(event::div));
 }
 
 build_return_t runtime::division_floor()
 {
-    return op::bin(this, "division_floor", op::arith{&runtime::div_int, &runtime::div_num});
+    return op::bin(this, "division_floor", op::arith{&runtime::div_int, &runtime::div_num}, op::meta(event::idiv));
 }
 
 build_return_t runtime::exponentiation()
 {
     import_func("pow", create_type(number_type(), number_type()), number_type(), "native", "pow");
-    return op::bin(this, "exponentiation", op::expo{});
+    return op::bin(this, "exponentiation", op::expo{}, op::meta(event::pow));
 }
 
 build_return_t runtime::modulo()
 {
-    return op::bin(this, "modulo", op::arith{&runtime::rem_int, &runtime::div_num});
+    return op::bin(this, "modulo", op::arith{&runtime::mod_int, &runtime::mod_num}, op::meta(event::mod));
+}
+
+expr_ref runtime::mod_int(expr_ref left, expr_ref right)
+{
+    function_stack stack{mod};
+    auto func = stack.add_function("*modulo_integer", integer_type(), [&](function_stack& stack)
+                                   {
+                                       auto a = stack.alloc(integer_type(), "a");
+                                       auto b = stack.alloc(integer_type(), "b");
+                                       stack.locals();
+                                       auto m = stack.alloc(integer_type(), "m");
+
+                                       // floored modulo, the result has the sign of the divisor
+                                       return make_block(std::array{
+                                           make_if(unop(BinaryenEqZInt64(), stack.get(b)), throw_error(add_string("attempt to perform 'n%0'"))),
+                                           stack.set(m, binop(BinaryenRemSInt64(), stack.get(a), stack.get(b))),
+                                           make_if(binop(BinaryenAndInt32(),
+                                                         ne_int(stack.get(m), const_integer(0)),
+                                                         lt_int(xor_int(stack.get(m), stack.get(b)), const_integer(0))),
+                                                   make_return(add_int(stack.get(m), stack.get(b)))),
+                                           make_return(stack.get(m)),
+                                       });
+                                   });
+    return func(std::array{left, right});
+}
+
+expr_ref runtime::mod_num(expr_ref left, expr_ref right)
+{
+    function_stack stack{mod};
+    auto func = stack.add_function("*modulo_number", number_type(), [&](function_stack& stack)
+                                   {
+                                       auto a = stack.alloc(number_type(), "a");
+                                       auto b = stack.alloc(number_type(), "b");
+                                       stack.locals();
+                                       auto m = stack.alloc(number_type(), "m");
+
+                                       // luai_nummod: m = fmod(a, b); if ((m > 0) ? b < 0 : (m < 0 && b > 0)) m += b;
+                                       return make_block(std::array{
+                                           stack.set(m, fmod_num(stack.get(a), stack.get(b))),
+                                           make_if(make_if(gt_num(stack.get(m), const_number(0)),
+                                                           lt_num(stack.get(b), const_number(0)),
+                                                           binop(BinaryenAndInt32(), lt_num(stack.get(m), const_number(0)), gt_num(stack.get(b), const_number(0)))),
+                                                   make_return(add_num(stack.get(m), stack.get(b)))),
+                                           make_return(stack.get(m)),
+                                       });
+                                   });
+    return func(std::array{left, right});
 }
 
 build_return_t runtime::binary_or()
 {
-    return op::bin(this, "binary_or", op::bit{&runtime::or_int});
+    return op::bin(this, "binary_or", op::bit{&runtime::or_int}, op::meta(event::bor));
 }
 
 build_return_t runtime::binary_and()
 {
-    return op::bin(this, "binary_and", op::bit{&runtime::and_int});
+    return op::bin(this, "binary_and", op::bit{&runtime::and_int}, op::meta(event::band));
 }
 
 build_return_t runtime::binary_xor()
 {
-    return op::bin(this, "binary_xor", op::bit{&runtime::xor_int});
+    return op::bin(this, "binary_xor", op::bit{&runtime::xor_int}, op::meta(event::bxor));
 }
 
 build_return_t runtime::binary_right_shift()
 {
-    return op::bin(this, "binary_right_shift", op::bit{&runtime::shr_int});
+    return op::bin(this, "binary_right_shift", op::bit{&runtime::shr_int}, op::meta(event::shr));
 }
 
 build_return_t runtime::binary_left_shift()
 {
-    return op::bin(this, "binary_left_shift", op::bit{&runtime::shl_int});
+    return op::bin(this, "binary_left_shift", op::bit{&runtime::shl_int}, op::meta(event::shl));
 }
 
 build_return_t runtime::equality()
 {
-    return op::bin(this, "equality", op::cmp{&runtime::eq_int, &runtime::eq_num});
+    return op::bin(this, "equality", op::cmp{&runtime::eq_int, &runtime::eq_num}, op::equal());
 }
 
 build_return_t runtime::inequality()
 {
-    return op::bin(this, "inequality", op::cmp{&runtime::ne_int, &runtime::ne_num});
+    return op::bin(this, "inequality", op::cmp{&runtime::ne_int, &runtime::ne_num}, op::equal(true));
 }
 
 build_return_t runtime::less_than()
 {
-    return op::bin(this, "less_than", op::cmp{&runtime::lt_int, &runtime::lt_num});
+    return op::bin(this, "less_than", op::cmp{&runtime::lt_int, &runtime::lt_num}, op::order(event::lt));
 }
 
 build_return_t runtime::greater_than()
 {
-    return op::bin(this, "greater_than", op::cmp{&runtime::gt_int, &runtime::ge_num});
+    return op::bin(this, "greater_than", op::cmp{&runtime::gt_int, &runtime::gt_num}, op::order(event::lt, true));
 }
 
 build_return_t runtime::less_or_equal()
 {
-    return op::bin(this, "less_or_equal", op::cmp{&runtime::le_int, &runtime::le_num});
+    return op::bin(this, "less_or_equal", op::cmp{&runtime::le_int, &runtime::le_num}, op::order(event::le));
 }
 
 build_return_t runtime::greater_or_equal()
 {
-    return op::bin(this, "greater_or_equal", op::cmp{&runtime::ge_int, &runtime::ge_num});
+    return op::bin(this, "greater_or_equal", op::cmp{&runtime::ge_int, &runtime::ge_num}, op::order(event::le, true));
 }
 
 build_return_t runtime::logic_not()
 {
     return {std::vector<BinaryenType>{},
-            BinaryenRefI31(mod, call(functions::to_bool_not, local_get(0, anyref())))};
+            new_boolean(call(functions::to_bool_not, local_get(0, anyref())))};
 }
 
 build_return_t runtime::binary_not()
@@ -357,13 +507,14 @@ build_return_t runtime::binary_not()
                                         switch (type)
                                         {
                                         case value_type::integer:
-                                            exp = BinaryenStructGet(mod, 0, exp, integer_type(), false);
+                                            exp = unbox_integer(exp);
                                             return make_return(new_integer(xor_int(const_integer(-1), exp)));
                                         case value_type::number:
                                             // TODO
                                             return make_return(exp);
                                         default:
-                                            return throw_error(add_string("unexpected type"));
+                                            // the operand is passed twice like in Lua
+                                            return make_return(binary_metamethod(local_get(0, anyref()), local_get(0, anyref()), event::bnot));
                                         }
                                     }))};
 }
@@ -380,13 +531,13 @@ build_return_t runtime::minus()
                                         switch (type)
                                         {
                                         case value_type::integer:
-                                            exp = BinaryenStructGet(mod, 0, exp, integer_type(), false);
+                                            exp = unbox_integer(exp);
                                             return make_return(new_integer(mul_int(const_integer(-1), exp)));
                                         case value_type::number:
                                             exp = BinaryenStructGet(mod, 0, exp, number_type(), false);
                                             return make_return(new_number(neg_num(exp)));
                                         default:
-                                            return throw_error(add_string("unexpected type"));
+                                            return make_return(binary_metamethod(local_get(0, anyref()), local_get(0, anyref()), event::unm));
                                         }
                                     }))};
 }
@@ -399,15 +550,33 @@ build_return_t runtime::len()
         //value_type::userdata,
     };
 
-    return {std::vector<BinaryenType>{},
+    auto table = [&]()
+    {
+        return local_get(1, get_type<runtime::table>());
+    };
+    auto handler = [&]()
+    {
+        return local_get(2, anyref());
+    };
+
+    return {std::vector<BinaryenType>{get_type<runtime::table>(), anyref()},
             make_block(switch_value(local_get(0, anyref()), casts, [&](value_type type, expr_ref exp)
                                     {
                                         switch (type)
                                         {
                                         case value_type::string:
-                                            return make_return(new_integer(size_to_integer(array_len(exp))));
+                                            return make_return(new_integer(size_to_integer(string_length(exp))));
                                         case value_type::table:
-                                            return make_return(new_integer(size_to_integer(array_len(table::get<table::array>(*this, exp)))));
+                                            // __len comes before the border
+                                            return make_block(std::array{
+                                                make_if(BinaryenRefIsNull(mod, local_tee(2, metamethod(table::get<table::metatable>(*this, local_tee(1, exp, get_type<runtime::table>())), event::len), anyref())),
+                                                        make_return(new_integer(size_to_integer(table_border(table()))))),
+                                                make_return(first_result(call(functions::invoke,
+                                                                              std::array{
+                                                                                  handler(),
+                                                                                  ref_array::create_fixed(*this, table()),
+                                                                              }))),
+                                            });
                                         case value_type::userdata:
                                         {
                                             // TODO
@@ -415,8 +584,7 @@ build_return_t runtime::len()
                                             return drop(exp);
                                         }
                                         default:
-
-                                            return throw_error(add_string("unexpected type"));
+                                            return make_return(binary_metamethod(local_get(0, anyref()), local_get(0, anyref()), event::len));
                                         }
                                     }))};
 }
@@ -30,6 +30,8 @@ void runtime::build_types()
 
 void runtime::build()
 {
+    if (intern_strings && !strings->ranges.empty())
+        require(functions::intern_string);
     if (create_functions != function_action::none)
         BinaryenAddTag(mod, error_tag, anyref(), BinaryenTypeNone());
     if (export_functions != function_action::none)
@@ -80,6 +82,7 @@ void runtime::build()
                                 body);
         }
     }
+    build_strings(intern_strings ? _funcs[static_cast<size_t>(functions::intern_string)].name : nullptr);
 }
 
 runtime::function_stack::func_t runtime::compare(value_type vtype)
@@ -109,17 +112,20 @@ runtime::function_stack::func_t runtime::compare(value_type vtype)
                              switch (type_right)
                              {
                              case value_type::integer:
-                                 return make_return(binop(BinaryenEqInt64(), integer::get<integer::inner>(*this, stack.get(first)), integer::get<integer::inner>(*this, exp_right)));
+                                 return make_return(binop(BinaryenEqInt64(), unbox_integer(stack.get(first)), unbox_integer(exp_right)));
                              case value_type::number:
                                  return make_return(binop(BinaryenEqFloat64(), number::get<number::inner>(*this, stack.get(first)), number::get<number::inner>(*this, exp_right)));
+                             case value_type::boolean:
+                                 return make_return(binop(BinaryenEqInt32(), bool_box::get<bool_box::inner>(*this, stack.get(first)), bool_box::get<bool_box::inner>(*this, exp_right)));
                              case value_type::table:
                              case value_type::function:
+                             case value_type::userdata:
                              case value_type::thread:
-                                 return BinaryenRefEq(mod, stack.get(first), exp_right);
+                                 return make_return(BinaryenRefEq(mod, stack.get(first), exp_right));
 
                              case value_type::string:
                              {
-                                 auto string_t = type<value_type::string>();
+                                 auto string_t = get_type<string_array>();
 
                                  auto i           = stack.alloc(size_type(), "i");
                                  auto exp_i       = stack.alloc(string_t, "exp_i");
@@ -132,28 +138,45 @@ runtime::function_stack::func_t runtime::compare(value_type vtype)
                                                   const_i32(1));
                                  };
 
+                                 // identical objects, e.g. two reads of the same literal or interned strings
+                                 auto right = stack.alloc(type<value_type::string>(), "right");
+                                 auto same  = BinaryenRefEq(mod, stack.get(first), stack.tee(right, exp_right));
+
+                                 // both hashes are cached and differ
+                                 auto hash_left    = stack.alloc(size_type(), "hash_left");
+                                 auto hash_right   = stack.alloc(size_type(), "hash_right");
+                                 auto hash_differs = binop(BinaryenAndInt32(),
+                                                           binop(BinaryenNeInt32(),
+                                                                 stack.tee(hash_left, string::get<string::hash>(*this, stack.get(first))),
+                                                                 stack.tee(hash_right, string::get<string::hash>(*this, stack.get(right)))),
+                                                           binop(BinaryenAndInt32(),
+                                                                 binop(BinaryenNeInt32(), stack.get(hash_left), const_i32(0)),
+                                                                 binop(BinaryenNeInt32(), stack.get(hash_right), const_i32(0))));
                                  return make_return(
-                                     make_if(binop(BinaryenEqInt32(), stack.tee(i, array_len(stack.tee(exp_i, stack.get(0)))), array_len(stack.tee(exp_right_i, exp_right))),
-                                             BinaryenLoop(mod,
-                                                          "+loop",
-                                                          BinaryenIf(mod,
-                                                                     stack.get(i),
-                                                                     make_block(std::array{
-                                                                         BinaryenBreak(mod,
-                                                                                       "+loop",
-                                                                                       binop(BinaryenEqInt32(),
-                                                                                             string::get(*this, stack.get(exp_i), stack.tee(i, dec(stack.get(i)))),
-                                                                                             string::get(*this, stack.get(exp_right_i), stack.get(i))),
-                                                                                       nullptr),
-                                                                         const_i32(0),
-                                                                     }),
-                                                                     const_i32(1))),
-
-                                             const_i32(0)));
+                                     make_if(same,
+                                             const_i32(1),
+                                             make_if(hash_differs,
+                                                     const_i32(0),
+                                                     make_if(binop(BinaryenEqInt32(),
+                                                                   stack.tee(i, array_len(stack.tee(exp_i, string_data(stack.get(first))))),
+                                                                   array_len(stack.tee(exp_right_i, string_data(stack.get(right))))),
+                                                             BinaryenLoop(mod,
+                                                                          "+loop",
+                                                                          BinaryenIf(mod,
+                                                                                     stack.get(i),
+                                                                                     make_block(std::array{
+                                                                                         BinaryenBreak(mod,
+                                                                                                       "+loop",
+                                                                                                       binop(BinaryenEqInt32(),
+                                                                                                             string_array::get(*this, stack.get(exp_i), stack.tee(i, dec(stack.get(i)))),
+                                                                                                             string_array::get(*this, stack.get(exp_right_i), stack.get(i))),
+                                                                                                       nullptr),
+                                                                                         const_i32(0),
+                                                                                     }),
+                                                                                     const_i32(1))),
+                                                             const_i32(0)))));
                              }
                              case value_type::nil:
-                             case value_type::boolean:
-                             case value_type::userdata:
                              default:
                                  return BinaryenUnreachable(mod);
                              }
@@ -177,7 +200,7 @@ build_return_t runtime::to_bool()
                                         case value_type::nil:
                                             return make_return(const_i32(0));
                                         case value_type::boolean:
-                                            return make_return(BinaryenI31Get(mod, exp, false));
+                                            return make_return(bool_box::get<bool_box::inner>(*this, exp));
                                         default:
                                             return make_return(const_i32(1));
                                         }
@@ -198,7 +221,7 @@ build_return_t runtime::to_bool_not()
                                         case value_type::nil:
                                             return make_return(const_i32(1));
                                         case value_type::boolean:
-                                            return make_return(BinaryenUnary(mod, BinaryenEqZInt32(), BinaryenI31Get(mod, exp, false)));
+                                            return make_return(BinaryenUnary(mod, BinaryenEqZInt32(), bool_box::get<bool_box::inner>(*this, exp)));
                                         default:
                                             return make_return(const_i32(0));
                                         }
@@ -207,8 +230,6 @@ build_return_t runtime::to_bool_not()
 
 build_return_t runtime::to_string()
 {
-    import_func("int_to_str", integer_type(), BinaryenTypeExternref(), "native", "toString");
-    import_func("num_to_str", number_type(), BinaryenTypeExternref(), "native", "toString");
     auto casts = std::array{
         value_type::string,
         value_type::boolean,
@@ -224,19 +245,15 @@ build_return_t runtime::to_string()
                                             exp = add_string("nil");
                                             break;
                                         case value_type::boolean:
-                                            exp = make_if(BinaryenI31Get(mod, exp, false), add_string("true"), add_string("false"));
+                                            exp = make_if(bool_box::get<bool_box::inner>(*this, exp), add_string("true"), add_string("false"));
                                             break;
                                         case value_type::string:
                                             break;
                                         case value_type::integer:
-                                            exp = BinaryenStructGet(mod, 0, exp, integer_type(), false);
-                                            exp = make_call("int_to_str", exp, BinaryenTypeExternref());
-                                            exp = call(functions::js_array_to_lua_str, exp);
+                                            exp = integer_to_string()(std::array{unbox_integer(exp)});
                                             break;
                                         case value_type::number:
-                                            exp = BinaryenStructGet(mod, 0, exp, integer_type(), false);
-                                            exp = make_call("num_to_str", exp, BinaryenTypeExternref());
-                                            exp = call(functions::js_array_to_lua_str, exp);
+                                            exp = number_to_string()(std::array{unbox_number(exp)});
                                             break;
                                         default:
                                             exp = null();
@@ -277,74 +294,145 @@ build_return_t runtime::to_number()
                                     }))};
 }
 
+void runtime::import_scratch_memory()
+{
+    if (!BinaryenHasMemory(mod))
+        BinaryenAddMemoryImport(mod, scratch_memory, "buffer", "memory", false);
+}
+
 build_return_t runtime::lua_str_to_js_array()
 {
+    // the bytes are stored in the scratch memory and the host copies them out with one call,
+    // the per byte path is only taken if the memory cannot grow
+    import_scratch_memory();
+    import_func("buffer_from_memory", size_type(), BinaryenTypeExternref(), "buffer", "from_memory");
     import_func("buffer_new", size_type(), BinaryenTypeExternref(), "buffer", "new");
     import_func("buffer_set", create_type(BinaryenTypeExternref(), size_type(), char_type()), BinaryenTypeNone(), "buffer", "set");
 
-    auto str     = local_get(0, type<value_type::string>()); // get string
-    auto str_len = array_len(str);                           // get string len
+    auto data    = string_data(local_get(0, type<value_type::string>()));
+    auto str     = [&]() { return local_get(3, get_type<string_array>()); }; // get string
+    auto str_len = array_len(local_tee(3, data, get_type<string_array>())); // get string len
+    auto pages   = BinaryenBinary(mod,
+                                BinaryenShrUInt32(),
+                                BinaryenBinary(mod, BinaryenAddInt32(), local_get(1, size_type()), const_i32(0xffff)),
+                                const_i32(16));
 
     return {std::vector<BinaryenType>{
                 size_type(),
                 BinaryenTypeExternref(),
+                get_type<string_array>(),
+                size_type(),
             },
             make_block(std::array{
-                local_set(2, make_call("buffer_new", local_tee(1, str_len, size_type()), BinaryenTypeExternref())),
-                make_if(local_get(1, size_type()),
+                local_set(1, str_len),
+                make_block(std::array{
+                               // pages missing in the scratch memory
+                               BinaryenBreak(mod,
+                                             "+bulk",
+                                             BinaryenBinary(mod,
+                                                            BinaryenLeSInt32(),
+                                                            local_tee(4, BinaryenBinary(mod, BinaryenSubInt32(), pages, BinaryenMemorySize(mod, scratch_memory, false)), size_type()),
+                                                            const_i32(0)),
+                                             nullptr),
+                               BinaryenBreak(mod,
+                                             "+bulk",
+                                             BinaryenBinary(mod, BinaryenNeInt32(), BinaryenMemoryGrow(mod, local_get(4, size_type()), scratch_memory, false), const_i32(-1)),
+                                             nullptr),
+
+                               local_set(2, make_call("buffer_new", local_get(1, size_type()), BinaryenTypeExternref())),
+                               make_if(local_get(1, size_type()),
+                                       BinaryenLoop(mod,
+                                                    "+bytes",
+                                                    make_block(std::array{
+                                                        make_call("buffer_set",
+                                                                  std::array{
+                                                                      local_get(2, BinaryenTypeExternref()),
+                                                                      local_tee(1, BinaryenBinary(mod, BinaryenSubInt32(), local_get(1, size_type()), const_i32(1)), size_type()),
+                                                                      array_get(str(), local_get(1, size_type()), char_type()),
+                                                                  },
+                                                                  BinaryenTypeNone()),
+                                                        BinaryenBreak(mod,
+                                                                      "+bytes",
+                                                                      local_get(1, size_type()),
+                                                                      nullptr),
+                                                    }))),
+                               make_return(local_get(2, BinaryenTypeExternref())),
+                           },
+                           "+bulk"),
+
+                local_set(4, local_get(1, size_type())),
+                make_if(local_get(4, size_type()),
                         BinaryenLoop(mod,
                                      "+loop",
                                      make_block(std::array{
-                                         make_call("buffer_set",
-                                                   std::array{
-                                                       local_get(2, BinaryenTypeExternref()),
-                                                       local_tee(1, BinaryenBinary(mod, BinaryenSubInt32(), local_get(1, size_type()), const_i32(1)), size_type()),
-                                                       array_get(str, local_get(1, size_type()), char_type()),
-                                                   },
-                                                   BinaryenTypeNone()),
+                                         BinaryenStore(mod,
+                                                       1,
+                                                       0,
+                                                       1,
+                                                       local_tee(4, BinaryenBinary(mod, BinaryenSubInt32(), local_get(4, size_type()), const_i32(1)), size_type()),
+                                                       array_get(str(), local_get(4, size_type()), char_type()),
+                                                       BinaryenTypeInt32(),
+                                                       scratch_memory),
                                          BinaryenBreak(mod,
                                                        "+loop",
-                                                       local_get(1, size_type()),
+                                                       local_get(4, size_type()),
                                                        nullptr),
                                      }))),
 
-                make_return(local_get(2, BinaryenTypeExternref())),
+                make_return(make_call("buffer_from_memory", local_get(1, size_type()), BinaryenTypeExternref())),
             })};
 }
 
 build_return_t runtime::js_array_to_lua_str()
 {
+    // the host copies the bytes into the scratch memory in one call and returns their count,
+    // or -1 if they do not fit, then they are read one by one
+    import_scratch_memory();
+    import_func("buffer_to_memory", BinaryenTypeExternref(), size_type(), "buffer", "to_memory");
     import_func("buffer_size", BinaryenTypeExternref(), size_type(), "buffer", "size");
     import_func("buffer_get", create_type(BinaryenTypeExternref(), size_type()), char_type(), "buffer", "get");
 
-    auto str     = local_get(0, BinaryenTypeExternref());      // get string
-    auto str_len = make_call("buffer_size", str, size_type()); // get string len
+    auto str = [&]() { return local_get(0, BinaryenTypeExternref()); }; // get string
+
+    auto copy_loop = [&](const char* label, expr_ref get_char)
+    {
+        return make_if(local_get(1, size_type()),
+                       BinaryenLoop(mod,
+                                    label,
+                                    make_block(std::array{
+                                        array_set(local_get(2, get_type<string_array>()),
+                                                  local_tee(1, BinaryenBinary(mod, BinaryenSubInt32(), local_get(1, size_type()), const_i32(1)), size_type()),
+                                                  get_char),
+                                        BinaryenBreak(mod,
+                                                      label,
+                                                      local_get(1, size_type()),
+                                                      nullptr),
+                                    })));
+    };
 
     return {std::vector<BinaryenType>{
                 size_type(),
-                type<value_type::string>(),
+                get_type<string_array>(),
             },
             make_block(std::array{
-                local_set(2, BinaryenArrayNew(mod, BinaryenTypeGetHeapType(type<value_type::string>()), local_tee(1, str_len, size_type()), nullptr)),
-                make_if(local_get(1, size_type()),
-                        BinaryenLoop(mod,
-                                     "+loop",
-                                     make_block(std::array{
-                                         array_set(local_get(2, type<value_type::string>()),
-                                                   local_tee(1, BinaryenBinary(mod, BinaryenSubInt32(), local_get(1, size_type()), const_i32(1)), size_type()),
-                                                   make_call("buffer_get",
-                                                             std::array{
-                                                                 str,
-                                                                 local_get(1, size_type()),
-                                                             },
-                                                             char_type())),
-                                         BinaryenBreak(mod,
-                                                       "+loop",
-                                                       local_get(1, size_type()),
-                                                       nullptr),
-                                     }))),
-
-                make_return(local_get(2, type<value_type::string>())),
+                make_if(BinaryenBinary(mod, BinaryenEqInt32(), local_tee(1, make_call("buffer_to_memory", str(), size_type()), size_type()), const_i32(-1)),
+                        make_block(std::array{
+                            local_set(2, string_array::create(*this, local_tee(1, make_call("buffer_size", str(), size_type()), size_type()))),
+                            copy_loop("+bytes",
+                                      make_call("buffer_get",
+                                                std::array{
+                                                    str(),
+                                                    local_get(1, size_type()),
+                                                },
+                                                char_type())),
+                        }),
+                        make_block(std::array{
+                            local_set(2, string_array::create(*this, local_get(1, size_type()))),
+                            copy_loop("+loop", BinaryenLoad(mod, 1, false, 0, 1, BinaryenTypeInt32(), local_get(1, size_type()), scratch_memory)),
+                        })),
+
+                make_return(intern_strings ? call(functions::intern_string, new_string(local_get(2, get_type<string_array>())))
+                                           : new_string(local_get(2, get_type<string_array>()))),
             })};
 }
 
@@ -405,7 +493,7 @@ build_return_t runtime::box_number()
 
 build_return_t runtime::to_js_integer()
 {
-    return {std::vector<BinaryenType>{}, unbox_integer(BinaryenRefCast(mod, local_get(0, anyref()), type<value_type::integer>()))};
+    return {std::vector<BinaryenType>{}, unbox_integer(local_get(0, anyref()))};
 }
 
 build_return_t runtime::to_js_string()
@@ -433,12 +521,41 @@ build_return_t runtime::any_array_create()
     return {std::vector<BinaryenType>{}, BinaryenArrayNew(mod, BinaryenTypeGetHeapType(ref_array_type()), local_get(0, size_type()), nullptr)};
 }
 
+expr_ref runtime::first_result(expr_ref results)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function("*first_result", anyref(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto results = stack.alloc(ref_array_type(), "results");
+                                       stack.locals();
+
+                                       return make_block(std::array{
+                                           make_if(BinaryenRefIsNull(mod, stack.get(results)),
+                                                   make_return(null())),
+                                           make_if(unop(BinaryenEqZInt32(), array_len(stack.get(results))),
+                                                   make_return(null())),
+                                           make_return(ref_array::get(*this, stack.get(results), const_i32(0))),
+                                       });
+                                   });
+
+    return func(std::array{results});
+}
+
 build_return_t runtime::invoke()
 {
     auto casts = std::array{
         value_type::function,
     };
-    return {std::vector<BinaryenType>{type<value_type::function>()},
+    auto handler = [&]()
+    {
+        return local_get(3, anyref());
+    };
+    auto args = [&]()
+    {
+        return local_get(1, ref_array_type());
+    };
+    return {std::vector<BinaryenType>{type<value_type::function>(), anyref(), ref_array_type()},
             make_block(switch_value(local_get(0, anyref()), casts, [&](value_type exp_type, expr_ref exp)
                                     {
                                         switch (exp_type)
@@ -459,7 +576,22 @@ build_return_t runtime::invoke()
                                         }
 
                                         default:
-                                            return throw_error(add_string("not a function"));
+                                        {
+                                            // __call gets the called value in front of the arguments
+                                            auto with_self = make_if(BinaryenRefIsNull(mod, args()),
+                                                                     ref_array::create_fixed(*this, local_get(0, anyref())),
+                                                                     make_block(std::array{
+                                                                         resize_array(4, ref_array_type(), args(), const_i32(1), true),
+                                                                         ref_array::set(*this, local_get(4, ref_array_type()), const_i32(0), local_get(0, anyref())),
+                                                                         local_get(4, ref_array_type()),
+                                                                     }));
+                                            expr_ref call_args[] = {handler(), with_self};
+                                            return make_block(std::array{
+                                                make_if(BinaryenRefIsNull(mod, local_tee(3, metamethod(metatable_of(local_get(0, anyref())), event::call), anyref())),
+                                                        throw_error(add_string("not a function"))),
+                                                BinaryenReturnCall(mod, require(functions::invoke).name, call_args, std::size(call_args), ref_array_type()),
+                                            });
+                                        }
                                         }
                                     }))};
 }
@@ -3,61 +3,69 @@
 #include "backend/func_stack.hpp"
 #include "backend/wasm_util.hpp"
 #include "binaryen-c.h"
+#include <algorithm>
 #include <cassert>
+#include <limits>
 #include <type_traits>
 
-#define RUNTIME_FUNCTIONS(DO)                                                                   \
-    DO(table_get, create_type(anyref(), anyref()), anyref())                                    \
-    DO(table_set, create_type(anyref(), anyref(), anyref()), BinaryenTypeNone())                \
-    DO(table_create_array, ref_array_type(), get_type<table>())                                 \
-    DO(table_create_map, size_type(), get_type<table>())                                        \
-    DO(to_bool, anyref(), bool_type())                                                          \
-    DO(to_bool_not, anyref(), bool_type())                                                      \
-    DO(logic_not, anyref(), anyref())                                                           \
-    DO(binary_not, anyref(), anyref())                                                          \
-    DO(minus, anyref(), anyref())                                                               \
-    DO(len, anyref(), anyref())                                                                 \
-    DO(addition, create_type(anyref(), anyref()), anyref())                                     \
-    DO(subtraction, create_type(anyref(), anyref()), anyref())                                  \
-    DO(multiplication, create_type(anyref(), anyref()), anyref())                               \
-    DO(division, create_type(anyref(), anyref()), anyref())                                     \
-    DO(division_floor, create_type(anyref(), anyref()), anyref())                               \
-    DO(exponentiation, create_type(anyref(), anyref()), anyref())                               \
-    DO(modulo, create_type(anyref(), anyref()), anyref())                                       \
-    DO(binary_or, create_type(anyref(), anyref()), anyref())                                    \
-    DO(binary_and, create_type(anyref(), anyref()), anyref())                                   \
-    DO(binary_xor, create_type(anyref(), anyref()), anyref())                                   \
-    DO(binary_right_shift, create_type(anyref(), anyref()), anyref())                           \
-    DO(binary_left_shift, create_type(anyref(), anyref()), anyref())                            \
-    DO(equality, create_type(anyref(), anyref()), anyref())                                     \
-    DO(inequality, create_type(anyref(), anyref()), anyref())                                   \
-    DO(less_than, create_type(anyref(), anyref()), anyref())                                    \
-    DO(greater_than, create_type(anyref(), anyref()), anyref())                                 \
-    DO(less_or_equal, create_type(anyref(), anyref()), anyref())                                \
-    DO(greater_or_equal, create_type(anyref(), anyref()), anyref())                             \
-    DO(to_string, anyref(), type<value_type::string>())                                         \
-    DO(to_number, anyref(), anyref())                                                           \
-    DO(lua_str_to_js_array, type<value_type::string>(), BinaryenTypeExternref())                \
-    DO(js_array_to_lua_str, BinaryenTypeExternref(), type<value_type::string>())                \
-    DO(get_type_num, anyref(), size_type())                                                     \
-    DO(box_integer, integer_type(), type<value_type::integer>())                                \
-    DO(box_number, number_type(), type<value_type::number>())                                   \
-    DO(to_js_integer, anyref(), integer_type())                                                 \
-    DO(to_js_string, anyref(), BinaryenTypeExternref())                                         \
-    DO(any_array_size, ref_array_type(), size_type())                                           \
-    DO(any_array_create, size_type(), ref_array_type())                                         \
-    DO(any_array_get, create_type(ref_array_type(), size_type()), anyref())                     \
-    DO(any_array_set, create_type(ref_array_type(), size_type(), anyref()), BinaryenTypeNone()) \
-    DO(open_basic_lib, get_type<table>(), get_type<table>())                                    \
-    DO(open_coroutine_lib, get_type<table>(), get_type<table>())                                \
-    DO(open_table_lib, get_type<table>(), get_type<table>())                                    \
-    DO(open_io_lib, get_type<table>(), get_type<table>())                                       \
-    DO(open_os_lib, get_type<table>(), get_type<table>())                                       \
-    DO(open_package_lib, get_type<table>(), get_type<table>())                                  \
-    DO(open_string_lib, get_type<table>(), get_type<table>())                                   \
-    DO(open_math_lib, get_type<table>(), get_type<table>())                                     \
-    DO(open_utf8_lib, get_type<table>(), get_type<table>())                                     \
-    DO(open_debug_lib, get_type<table>(), get_type<table>())                                    \
+#define RUNTIME_FUNCTIONS(DO)                                                                                 \
+    DO(table_get, create_type(anyref(), anyref()), anyref())                                                  \
+    DO(table_get_field, create_type(anyref(), type<value_type::string>(), get_type<field_cache>()), anyref()) \
+    DO(table_set, create_type(anyref(), anyref(), anyref()), BinaryenTypeNone())                              \
+    DO(table_init, create_type(get_type<table>(), anyref(), anyref()), BinaryenTypeNone())                    \
+    DO(table_create_array, create_type(ref_array_type(), size_type()), get_type<table>())                     \
+    DO(table_create_map, size_type(), get_type<table>())                                                      \
+    DO(table_create_shaped, get_type<shape>(), get_type<table>())                                             \
+    DO(to_bool, anyref(), bool_type())                                                                        \
+    DO(to_bool_not, anyref(), bool_type())                                                                    \
+    DO(logic_not, anyref(), anyref())                                                                         \
+    DO(binary_not, anyref(), anyref())                                                                        \
+    DO(minus, anyref(), anyref())                                                                             \
+    DO(len, anyref(), anyref())                                                                               \
+    DO(addition, create_type(anyref(), anyref()), anyref())                                                   \
+    DO(subtraction, create_type(anyref(), anyref()), anyref())                                                \
+    DO(multiplication, create_type(anyref(), anyref()), anyref())                                             \
+    DO(division, create_type(anyref(), anyref()), anyref())                                                   \
+    DO(division_floor, create_type(anyref(), anyref()), anyref())                                             \
+    DO(exponentiation, create_type(anyref(), anyref()), anyref())                                             \
+    DO(modulo, create_type(anyref(), anyref()), anyref())                                                     \
+    DO(binary_or, create_type(anyref(), anyref()), anyref())                                                  \
+    DO(binary_and, create_type(anyref(), anyref()), anyref())                                                 \
+    DO(binary_xor, create_type(anyref(), anyref()), anyref())                                                 \
+    DO(binary_right_shift, create_type(anyref(), anyref()), anyref())                                         \
+    DO(binary_left_shift, create_type(anyref(), anyref()), anyref())                                          \
+    DO(equality, create_type(anyref(), anyref()), anyref())                                                   \
+    DO(inequality, create_type(anyref(), anyref()), anyref())                                                 \
+    DO(less_than, create_type(anyref(), anyref()), anyref())                                                  \
+    DO(greater_than, create_type(anyref(), anyref()), anyref())                                               \
+    DO(less_or_equal, create_type(anyref(), anyref()), anyref())                                              \
+    DO(greater_or_equal, create_type(anyref(), anyref()), anyref())                                           \
+    DO(to_string, anyref(), type<value_type::string>())                                                       \
+    DO(concat, ref_array_type(), type<value_type::string>())                                                  \
+    DO(to_number, anyref(), anyref())                                                                         \
+    DO(lua_str_to_js_array, type<value_type::string>(), BinaryenTypeExternref())                              \
+    DO(js_array_to_lua_str, BinaryenTypeExternref(), type<value_type::string>())                              \
+    DO(intern_string, type<value_type::string>(), type<value_type::string>())                                 \
+    DO(get_type_num, anyref(), size_type())                                                                   \
+    DO(box_integer, integer_type(), type<value_type::integer>())                                              \
+    DO(box_number, number_type(), type<value_type::number>())                                                 \
+    DO(to_js_integer, anyref(), integer_type())                                                               \
+    DO(to_js_string, anyref(), BinaryenTypeExternref())                                                       \
+    DO(flush_output, BinaryenTypeNone(), BinaryenTypeNone())                                                  \
+    DO(any_array_size, ref_array_type(), size_type())                                                         \
+    DO(any_array_create, size_type(), ref_array_type())                                                       \
+    DO(any_array_get, create_type(ref_array_type(), size_type()), anyref())                                   \
+    DO(any_array_set, create_type(ref_array_type(), size_type(), anyref()), BinaryenTypeNone())               \
+    DO(open_basic_lib, get_type<table>(), get_type<table>())                                                  \
+    DO(open_coroutine_lib, get_type<table>(), get_type<table>())                                              \
+    DO(open_table_lib, get_type<table>(), get_type<table>())                                                  \
+    DO(open_io_lib, get_type<table>(), get_type<table>())                                                     \
+    DO(open_os_lib, get_type<table>(), get_type<table>())                                                     \
+    DO(open_package_lib, get_type<table>(), get_type<table>())                                                \
+    DO(open_string_lib, get_type<table>(), get_type<table>())                                                 \
+    DO(open_math_lib, get_type<table>(), get_type<table>())                                                   \
+    DO(open_utf8_lib, get_type<table>(), get_type<table>())                                                   \
+    DO(open_debug_lib, get_type<table>(), get_type<table>())                                                  \
     DO(invoke, create_type(anyref(), ref_array_type()), ref_array_type())
 
 namespace wumbo
@@ -95,6 +103,31 @@ struct runtime : ext_types
     function_action import_functions = function_action::none;
     function_action create_functions = function_action::none;
     function_action export_functions = function_action::none;
+    // canonicalize literals and short strings so equal strings are the same object
+    bool intern_strings = false;
+    static constexpr int32_t max_interned_length = 40;
+    // concatenations at least this long become ropes and are copied only when the bytes are needed
+    static constexpr int32_t min_rope_length = 256;
+    // tables stop following shapes after this many keys and keep their own keys
+    static constexpr int32_t max_shape_depth = 16;
+    // constructors without fields still leave room for a few, objects are usually
+    // filled right after they are created
+    static constexpr int32_t min_shape_fields = 4;
+    // the hash capacity of a constructor with this many fields, like hash_capacity in table.cpp
+    static constexpr int32_t shape_capacity(int32_t count)
+    {
+        count            = std::max(count, min_shape_fields);
+        int32_t needed   = count + count / 4 + 1;
+        int32_t capacity = 2;
+        while (capacity < needed)
+            capacity *= 2;
+        return capacity;
+    }
+    // linear memory shared with the host, strings cross the boundary through it in bulk
+    static constexpr const char* scratch_memory = "*scratch";
+    // print and io.write collect their output and hand it to the host in chunks
+    static constexpr int32_t output_buffer_size  = 1 << 14;
+    static constexpr int32_t output_flush_length = 1 << 12;
     std::vector<bool> _required_functions;
     std::array<func_sig, static_cast<size_t>(functions::count)> _funcs;
 
@@ -230,6 +263,79 @@ struct runtime : ext_types
     };
 
     function_stack::func_t compare(value_type vtype);
+    function_stack::func_t integer_to_string();
+    function_stack::func_t number_to_string();
+    expr_ref string_data(expr_ref str);
+    expr_ref string_length(expr_ref str);
+    void import_scratch_memory();
+    function_stack::func_t write_output();
+    expr_ref output_length();
+    expr_ref table_border(expr_ref table);
+    expr_ref table_next(expr_ref table, expr_ref key);
+
+    // metamethods that are looked up, the position is the bit in table::flags
+    enum class event
+    {
+        index,
+        newindex,
+        call,
+        len,
+        unm,
+        bnot,
+        add,
+        sub,
+        mul,
+        div,
+        mod,
+        pow,
+        idiv,
+        band,
+        bor,
+        bxor,
+        shl,
+        shr,
+        eq,
+        lt,
+        le,
+        count,
+    };
+    static_assert(static_cast<int>(event::count) <= 32, "table::flags has a bit per event");
+    static constexpr std::array<const char*, static_cast<size_t>(event::count)> event_names = {
+        "__index",
+        "__newindex",
+        "__call",
+        "__len",
+        "__unm",
+        "__bnot",
+        "__add",
+        "__sub",
+        "__mul",
+        "__div",
+        "__mod",
+        "__pow",
+        "__idiv",
+        "__band",
+        "__bor",
+        "__bxor",
+        "__shl",
+        "__shr",
+        "__eq",
+        "__lt",
+        "__le",
+    };
+
+    // set in table::flags of the metatables and prototypes a field_cache depends on
+    static constexpr int32_t prototype_flag = std::numeric_limits<int32_t>::min();
+    expr_ref prototype_changed(expr_ref table);
+
+    expr_ref metatable_of(expr_ref value);
+    expr_ref metamethod(expr_ref metatable, event e);
+    expr_ref binary_metamethod(expr_ref left, expr_ref right, event e);
+    expr_ref values_equal(expr_ref left, expr_ref right);
+    expr_ref first_result(expr_ref results);
+
+    expr_ref mod_int(expr_ref left, expr_ref right);
+    expr_ref mod_num(expr_ref left, expr_ref right);
 
     const func_sig& require(functions function);
 
@@ -416,10 +522,37 @@ struct runtime : ext_types
             auto pre_name = prefix.empty() ? name : prefix + "." + name;
             result.push_back(self.add_lua_func(self.local_get(0, self.get_type<table>()), pre_name.c_str(), args, ups, std::forward<F>(f)));
         }
+
+        // the function object is created once and kept in a global,
+        // e.g. for pairs to return next without allocating a closure
+        template<typename F, size_t N>
+        auto global(const char* name, const std::array<const char*, N>& args, F&& f)
+        {
+            auto pre_name = prefix.empty() ? name : prefix + "." + name;
+            auto global   = "*" + pre_name;
+            auto type     = self.get_type<function>();
+            BinaryenAddGlobal(self.mod, global.c_str(), type, true, BinaryenRefNull(self.mod, type));
+            result.push_back(BinaryenGlobalSet(self.mod, global.c_str(), self.build_lua_func(pre_name.c_str(), args, self.null(), std::forward<F>(f))));
+            return [mod = self.mod, global, type]()
+            {
+                return BinaryenGlobalGet(mod, global.c_str(), type);
+            };
+        }
     };
 
     template<typename F, size_t N>
     auto add_lua_func(expr_ref tbl, const char* name, const std::array<const char*, N>& arg_names, expr_ref ups, F&& f)
+    {
+        return call(functions::table_set,
+                    std::array{
+                        tbl,
+                        add_string(name),
+                        build_lua_func(name, arg_names, ups, std::forward<F>(f)),
+                    });
+    }
+
+    template<typename F, size_t N>
+    expr_ref build_lua_func(const char* name, const std::array<const char*, N>& arg_names, expr_ref ups, F&& f)
     {
         function_stack stack{mod};
 
@@ -435,12 +568,7 @@ struct runtime : ext_types
                                            return make_block(result);
                                        });
 
-        return call(functions::table_set,
-                    std::array{
-                        tbl,
-                        add_string(name),
-                        function::create(*this, std::array{func.get_ref(), ups}),
-                    });
+        return function::create(*this, std::array{func.get_ref(), ups, const_i32(0)});
     }
 };
 
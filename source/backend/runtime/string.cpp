@@ -0,0 +1,434 @@
+#include "runtime.hpp"
+
+#include "backend/wasm_util.hpp"
+#include "binaryen-c.h"
+#include "utils/type.hpp"
+
+#include <limits>
+
+namespace wumbo
+{
+// copies the parts of a rope into one array, the first part is followed
+// iteratively so ropes grown by repeated appending do not recurse.
+// Only called from *string_data, which handles nested ropes in the other parts.
+static runtime::function_stack::func_t flatten(runtime* self)
+{
+    auto mod = self->mod;
+    runtime::function_stack stack{mod};
+
+    return stack.add_function("*flatten", self->get_type<ext_types::string_array>(), [&](runtime::function_stack& stack)
+                              {
+                                  auto str = stack.alloc(self->type<value_type::string>(), "str");
+                                  stack.locals();
+
+                                  auto data  = stack.alloc(self->get_type<ext_types::string_array>(), "data");
+                                  auto node  = stack.alloc(self->type<value_type::string>(), "node");
+                                  auto parts = stack.alloc(self->ref_array_type(), "parts");
+                                  auto i     = stack.alloc(self->size_type(), "i");
+                                  auto end   = stack.alloc(self->size_type(), "end");
+                                  auto part  = stack.alloc(self->get_type<ext_types::string_array>(), "part");
+
+                                  auto part_at = [&](expr_ref index)
+                                  {
+                                      return BinaryenRefCast(mod, ext_types::ref_array::get(*self, stack.get(parts), index), self->type<value_type::string>());
+                                  };
+
+                                  return self->make_block(std::array{
+                                      stack.set(end, ext_types::string::get<ext_types::string::length>(*self, stack.get(str))),
+                                      stack.set(data, ext_types::string_array::create(*self, stack.get(end))),
+                                      stack.set(node, stack.get(str)),
+                                      BinaryenLoop(mod,
+                                                   "+node",
+                                                   self->make_block(std::array{
+                                                       stack.set(parts, ext_types::string::get<ext_types::string::parts>(*self, stack.get(node))),
+                                                       stack.set(i, self->array_len(stack.get(parts))),
+                                                       // all parts but the first, from the back
+                                                       BinaryenLoop(mod,
+                                                                    "+part",
+                                                                    self->make_if(self->binop(BinaryenGtUInt32(), stack.get(i), self->const_i32(1)),
+                                                                                  self->make_block(std::array{
+                                                                                      stack.set(part, self->make_call("*string_data", part_at(stack.tee(i, self->binop(BinaryenSubInt32(), stack.get(i), self->const_i32(1)))), self->get_type<ext_types::string_array>())),
+                                                                                      stack.set(end, self->binop(BinaryenSubInt32(), stack.get(end), self->array_len(stack.get(part)))),
+                                                                                      BinaryenArrayCopy(mod, stack.get(data), stack.get(end), stack.get(part), self->const_i32(0), self->array_len(stack.get(part))),
+                                                                                      BinaryenBreak(mod, "+part", nullptr, nullptr),
+                                                                                  }))),
+                                                       // continue with the first part while it is a rope
+                                                       BinaryenBreak(mod,
+                                                                     "+node",
+                                                                     BinaryenRefIsNull(mod, ext_types::string::get<ext_types::string::data>(*self, stack.tee(node, part_at(self->const_i32(0))))),
+                                                                     nullptr),
+                                                   })),
+                                      BinaryenArrayCopy(mod, stack.get(data), self->const_i32(0), ext_types::string::get<ext_types::string::data>(*self, stack.get(node)), self->const_i32(0), stack.get(end)),
+
+                                      // the rope becomes a flat string, the parts can be collected
+                                      ext_types::string::set<ext_types::string::data>(*self, stack.get(str), stack.get(data)),
+                                      ext_types::string::set<ext_types::string::parts>(*self, stack.get(str), self->null()),
+                                      stack.get(data),
+                                  });
+                              });
+}
+
+expr_ref runtime::string_data(expr_ref str)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function("*string_data", get_type<string_array>(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto str = stack.alloc(type<value_type::string>(), "str");
+                                       stack.locals();
+
+                                       return make_block(std::array{
+                                                             BinaryenBrOn(mod, BinaryenBrOnNonNull(), "+flat", string::get<string::data>(*this, stack.get(str)), BinaryenTypeNone()),
+                                                             flatten(this)(std::array{stack.get(str)}, true),
+                                                         },
+                                                         "+flat",
+                                                         get_type<string_array>());
+                                   });
+    return func(std::array{str});
+}
+
+expr_ref runtime::string_length(expr_ref str)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function("*string_length", size_type(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto str = stack.alloc(type<value_type::string>(), "str");
+                                       stack.locals();
+
+                                       return make_if(BinaryenRefIsNull(mod, string::get<string::data>(*this, stack.get(str))),
+                                                      string::get<string::length>(*this, stack.get(str)),
+                                                      array_len(string::get<string::data>(*this, stack.get(str))));
+                                   });
+    return func(std::array{str});
+}
+
+runtime::function_stack::func_t runtime::integer_to_string()
+{
+    runtime::function_stack stack{mod};
+
+    return stack.add_function("*integer_to_string", type<value_type::string>(), [&](runtime::function_stack& stack)
+                              {
+                                  auto value = stack.alloc(integer_type(), "value");
+                                  stack.locals();
+
+                                  auto rest = stack.alloc(integer_type(), "rest");
+                                  auto neg  = stack.alloc(size_type(), "neg");
+                                  auto len  = stack.alloc(size_type(), "len");
+                                  auto data = stack.alloc(get_type<string_array>(), "data");
+
+                                  return make_block(std::array{
+                                      // the magnitude as unsigned value, this also covers math.mininteger
+                                      stack.set(neg, binop(BinaryenLtSInt64(), stack.get(value), const_integer(0))),
+                                      stack.set(rest, make_if(stack.get(neg), binop(BinaryenSubInt64(), const_integer(0), stack.get(value)), stack.get(value))),
+
+                                      // count the digits
+                                      stack.set(len, binop(BinaryenAddInt32(), stack.get(neg), const_i32(1))),
+                                      stack.set(value, stack.get(rest)),
+                                      BinaryenLoop(mod,
+                                                   "+count",
+                                                   make_if(binop(BinaryenGeUInt64(), stack.get(value), const_integer(10)),
+                                                           make_block(std::array{
+                                                               stack.set(value, binop(BinaryenDivUInt64(), stack.get(value), const_integer(10))),
+                                                               stack.set(len, binop(BinaryenAddInt32(), stack.get(len), const_i32(1))),
+                                                               BinaryenBreak(mod, "+count", nullptr, nullptr),
+                                                           }))),
+
+                                      // fill from the back
+                                      stack.set(data, string_array::create(*this, stack.get(len))),
+                                      BinaryenLoop(mod,
+                                                   "+fill",
+                                                   make_block(std::array{
+                                                       string_array::set(*this,
+                                                                         stack.get(data),
+                                                                         stack.tee(len, binop(BinaryenSubInt32(), stack.get(len), const_i32(1))),
+                                                                         binop(BinaryenAddInt32(),
+                                                                               const_i32('0'),
+                                                                               unop(BinaryenWrapInt64(), binop(BinaryenRemUInt64(), stack.get(rest), const_integer(10))))),
+                                                       BinaryenBreak(mod,
+                                                                     "+fill",
+                                                                     binop(BinaryenNeInt64(),
+                                                                           stack.tee(rest, binop(BinaryenDivUInt64(), stack.get(rest), const_integer(10))),
+                                                                           const_integer(0)),
+                                                                     nullptr),
+                                                   })),
+                                      make_if(stack.get(neg), string_array::set(*this, stack.get(data), const_i32(0), const_i32('-'))),
+                                      new_string(stack.get(data)),
+                                  });
+                              });
+}
+
+// lua formats floats with "%.14g" and appends ".0" if the result looks like an integer
+runtime::function_stack::func_t runtime::number_to_string()
+{
+    runtime::function_stack stack{mod};
+
+    return stack.add_function("*number_to_string", type<value_type::string>(), [&](runtime::function_stack& stack)
+                              {
+                                  auto value = stack.alloc(number_type(), "value");
+                                  stack.locals();
+
+                                  auto neg     = stack.alloc(size_type(), "neg");
+                                  auto abs     = stack.alloc(number_type(), "abs");
+                                  auto scale   = stack.alloc(number_type(), "scale");
+                                  auto divisor = stack.alloc(number_type(), "divisor");
+                                  auto exp     = stack.alloc(size_type(), "exp");
+                                  auto exp_abs = stack.alloc(size_type(), "exp_abs");
+                                  auto large   = stack.alloc(size_type(), "large");
+                                  auto digits  = stack.alloc(integer_type(), "digits");
+                                  auto count   = stack.alloc(size_type(), "count");
+                                  auto dot     = stack.alloc(size_type(), "dot");
+                                  auto pos     = stack.alloc(size_type(), "pos");
+                                  auto len     = stack.alloc(size_type(), "len");
+                                  auto data    = stack.alloc(get_type<string_array>(), "data");
+                                  auto exp_neg = [&]()
+                                  {
+                                      return binop(BinaryenLtSInt32(), stack.get(exp), const_i32(0));
+                                  };
+                                  auto signed_string = [&](const char* str)
+                                  {
+                                      return make_return(make_if(stack.get(neg), add_string("-"s + str), add_string(str)));
+                                  };
+                                  auto add = [&](expr_ref a, expr_ref b)
+                                  {
+                                      return binop(BinaryenAddInt32(), a, b);
+                                  };
+                                  auto sub = [&](expr_ref a, expr_ref b)
+                                  {
+                                      return binop(BinaryenSubInt32(), a, b);
+                                  };
+                                  auto digit = [&](expr_ref value)
+                                  {
+                                      return add(const_i32('0'), value);
+                                  };
+                                  auto set_char = [&](expr_ref index, expr_ref c)
+                                  {
+                                      return string_array::set(*this, stack.get(data), index, c);
+                                  };
+                                  // the digits from pos backwards, skipping the dot
+                                  auto fill = [&](const char* label)
+                                  {
+                                      return BinaryenLoop(mod,
+                                                          label,
+                                                          make_block(std::array{
+                                                              set_char(stack.get(pos), digit(unop(BinaryenWrapInt64(), binop(BinaryenRemSInt64(), stack.get(digits), const_integer(10))))),
+                                                              stack.set(pos, sub(stack.get(pos), const_i32(1))),
+                                                              make_if(binop(BinaryenEqInt32(), stack.get(pos), stack.get(dot)),
+                                                                      stack.set(pos, sub(stack.get(pos), const_i32(1)))),
+                                                              BinaryenBreak(mod,
+                                                                            label,
+                                                                            binop(BinaryenNeInt64(),
+                                                                                  stack.tee(digits, binop(BinaryenDivSInt64(), stack.get(digits), const_integer(10))),
+                                                                                  const_integer(0)),
+                                                                            nullptr),
+                                                          }));
+                                  };
+                                  // scales abs by 10^22, the largest exact power of ten, until the rest fits in one exact factor
+                                  auto coarse = [&](const char* label, expr_ref far, BinaryenOp op, int32_t step)
+                                  {
+                                      return BinaryenLoop(mod,
+                                                          label,
+                                                          make_if(far,
+                                                                  make_block(std::array{
+                                                                      stack.set(abs, binop(op, stack.get(abs), const_number(1e22))),
+                                                                      stack.set(exp, add(stack.get(exp), const_i32(step))),
+                                                                      BinaryenBreak(mod, label, nullptr, nullptr),
+                                                                  })));
+                                  };
+                                  auto exp_digits = [&]()
+                                  {
+                                      return add(const_i32(2), stack.get(large));
+                                  };
+
+                                  return make_block(std::array{
+                                      stack.set(neg, binop(BinaryenLtSInt64(), unop(BinaryenReinterpretFloat64(), stack.get(value)), const_integer(0))),
+                                      stack.set(abs, unop(BinaryenAbsFloat64(), stack.get(value))),
+                                      make_if(binop(BinaryenNeFloat64(), stack.get(abs), stack.get(abs)), signed_string("nan")),
+                                      make_if(binop(BinaryenEqFloat64(), stack.get(abs), const_number(std::numeric_limits<double>::infinity())), signed_string("inf")),
+                                      make_if(binop(BinaryenEqFloat64(), stack.get(abs), const_number(0)), signed_string("0.0")),
+
+                                      // 14 significant digits, digits = abs * 10^(13 - exp)
+                                      stack.set(exp, const_i32(13)),
+                                      coarse("+coarse_down", binop(BinaryenGeFloat64(), stack.get(abs), const_number(1e35)), BinaryenDivFloat64(), 22),
+                                      coarse("+coarse_up", binop(BinaryenLtFloat64(), stack.get(abs), const_number(1e-9)), BinaryenMulFloat64(), -22),
+                                      stack.set(scale, const_number(1)),
+                                      BinaryenLoop(mod,
+                                                   "+scale",
+                                                   make_if(binop(BinaryenLtFloat64(), binop(BinaryenMulFloat64(), stack.get(abs), stack.get(scale)), const_number(1e13)),
+                                                           make_block(std::array{
+                                                               stack.set(exp, sub(stack.get(exp), const_i32(1))),
+                                                               stack.set(scale, binop(BinaryenMulFloat64(), stack.get(scale), const_number(10))),
+                                                               BinaryenBreak(mod, "+scale", nullptr, nullptr),
+                                                           }))),
+                                      stack.set(divisor, const_number(1)),
+                                      BinaryenLoop(mod,
+                                                   "+divide",
+                                                   make_if(binop(BinaryenGeFloat64(), stack.get(abs), binop(BinaryenMulFloat64(), stack.get(divisor), const_number(1e14))),
+                                                           make_block(std::array{
+                                                               stack.set(exp, add(stack.get(exp), const_i32(1))),
+                                                               stack.set(divisor, binop(BinaryenMulFloat64(), stack.get(divisor), const_number(10))),
+                                                               BinaryenBreak(mod, "+divide", nullptr, nullptr),
+                                                           }))),
+                                      stack.set(digits,
+                                                unop(BinaryenTruncSFloat64ToInt64(),
+                                                     unop(BinaryenNearestFloat64(), binop(BinaryenDivFloat64(), binop(BinaryenMulFloat64(), stack.get(abs), stack.get(scale)), stack.get(divisor))))),
+                                      // rounding carried into a new digit
+                                      make_if(binop(BinaryenGeSInt64(), stack.get(digits), const_integer(100000000000000)),
+                                              make_block(std::array{
+                                                  stack.set(digits, binop(BinaryenDivSInt64(), stack.get(digits), const_integer(10))),
+                                                  stack.set(exp, add(stack.get(exp), const_i32(1))),
+                                              })),
+
+                                      // drop trailing zeros
+                                      stack.set(count, const_i32(14)),
+                                      BinaryenLoop(mod,
+                                                   "+trim",
+                                                   make_if(unop(BinaryenEqZInt64(), binop(BinaryenRemSInt64(), stack.get(digits), const_integer(10))),
+                                                           make_block(std::array{
+                                                               stack.set(digits, binop(BinaryenDivSInt64(), stack.get(digits), const_integer(10))),
+                                                               stack.set(count, sub(stack.get(count), const_i32(1))),
+                                                               BinaryenBreak(mod, "+trim", nullptr, nullptr),
+                                                           }))),
+
+                                      // [-] digit [. digits] e sign two or three exponent digits, like printf
+                                      make_if(binop(BinaryenOrInt32(),
+                                                    binop(BinaryenLtSInt32(), stack.get(exp), const_i32(-4)),
+                                                    binop(BinaryenGeSInt32(), stack.get(exp), const_i32(14))),
+                                              make_block(std::array{
+                                                  stack.set(exp_abs, make_if(exp_neg(), sub(const_i32(0), stack.get(exp)), stack.get(exp))),
+                                                  stack.set(large, binop(BinaryenGeUInt32(), stack.get(exp_abs), const_i32(100))),
+                                                  // the last digit of the mantissa, the dot follows the first one
+                                                  stack.set(pos, add(stack.get(neg), make_if(binop(BinaryenGtUInt32(), stack.get(count), const_i32(1)), stack.get(count), const_i32(0)))),
+                                                  stack.set(dot, add(stack.get(neg), const_i32(1))),
+                                                  stack.set(len, add(add(stack.get(pos), const_i32(3)), exp_digits())),
+                                                  stack.set(data, string_array::create(*this, stack.get(len), const_i32('0'))),
+                                                  make_if(stack.get(neg), set_char(const_i32(0), const_i32('-'))),
+                                                  make_if(binop(BinaryenGtUInt32(), stack.get(count), const_i32(1)), set_char(stack.get(dot), const_i32('.'))),
+                                                  set_char(sub(stack.get(len), const_i32(1)), digit(binop(BinaryenRemUInt32(), stack.get(exp_abs), const_i32(10)))),
+                                                  set_char(sub(stack.get(len), const_i32(2)), digit(binop(BinaryenRemUInt32(), binop(BinaryenDivUInt32(), stack.get(exp_abs), const_i32(10)), const_i32(10)))),
+                                                  make_if(stack.get(large), set_char(sub(stack.get(len), const_i32(3)), digit(binop(BinaryenDivUInt32(), stack.get(exp_abs), const_i32(100))))),
+                                                  set_char(sub(sub(stack.get(len), const_i32(1)), exp_digits()), make_if(exp_neg(), const_i32('-'), const_i32('+'))),
+                                                  set_char(sub(sub(stack.get(len), const_i32(2)), exp_digits()), const_i32('e')),
+                                                  fill("+fill_exp"),
+                                                  make_return(new_string(stack.get(data))),
+                                              })),
+
+                                      // [-] integer part . fraction, at least one digit on each side
+                                      stack.set(dot, add(stack.get(neg), make_if(exp_neg(), const_i32(1), add(stack.get(exp), const_i32(1))))),
+                                      // position of the last significant digit
+                                      stack.set(pos,
+                                                make_if(exp_neg(),
+                                                        add(sub(stack.get(neg), stack.get(exp)), stack.get(count)),
+                                                        add(add(stack.get(neg), sub(stack.get(count), const_i32(1))),
+                                                            binop(BinaryenGtSInt32(), sub(stack.get(count), const_i32(1)), stack.get(exp))))),
+                                      // the zero padding comes from the fill value
+                                      stack.set(data,
+                                                string_array::create(*this,
+                                                                     add(add(stack.get(dot), const_i32(2)),
+                                                                         BinaryenSelect(mod,
+                                                                                        binop(BinaryenGtSInt32(), stack.get(pos), add(stack.get(dot), const_i32(1))),
+                                                                                        sub(stack.get(pos), add(stack.get(dot), const_i32(1))),
+                                                                                        const_i32(0),
+                                                                                        size_type())),
+                                                                     const_i32('0'))),
+                                      set_char(stack.get(dot), const_i32('.')),
+                                      make_if(stack.get(neg), set_char(const_i32(0), const_i32('-'))),
+                                      fill("+fill"),
+                                      new_string(stack.get(data)),
+                                  });
+                              });
+}
+
+build_return_t runtime::concat()
+{
+    auto list = [&]()
+    {
+        return local_get(0, ref_array_type());
+    };
+    size_t i     = 1;
+    size_t len   = 2;
+    size_t total = 3;
+    size_t str   = 4;
+    size_t data  = 5;
+
+    auto casts = std::array{
+        value_type::string,
+        value_type::integer,
+        value_type::number,
+        value_type::boolean,
+        value_type::table,
+        value_type::function,
+        value_type::userdata,
+        value_type::thread,
+    };
+
+    // every operand becomes a string in place, numbers are formatted here
+    auto convert = make_block(switch_value(ref_array::get(*this, list(), local_get(i, size_type())), casts, [&](value_type vtype, expr_ref exp)
+                                           {
+                                               switch (vtype)
+                                               {
+                                               case value_type::string:
+                                                   break;
+                                               case value_type::integer:
+                                                   exp = integer_to_string()(std::array{unbox_integer(exp)});
+                                                   break;
+                                               case value_type::number:
+                                                   exp = number_to_string()(std::array{unbox_number(exp)});
+                                                   break;
+                                               case value_type::nil:
+                                               case value_type::boolean:
+                                               case value_type::table:
+                                               case value_type::function:
+                                               case value_type::userdata:
+                                               case value_type::thread:
+                                                   return throw_error(add_string("attempt to concatenate a "s + type_name(vtype) + " value"));
+                                               default:
+                                                   return BinaryenUnreachable(mod);
+                                               }
+                                               return BinaryenBreak(mod, "+string", nullptr, exp);
+                                           }),
+                              "+string",
+                              type<value_type::string>());
+
+    auto part = [&]()
+    {
+        return string_data(local_get(str, type<value_type::string>()));
+    };
+
+    // one allocation for the result, the parts are copied in with array.copy
+    auto result = new_string(local_get(data, get_type<string_array>()));
+    return {std::vector<BinaryenType>{
+                size_type(),
+                size_type(),
+                size_type(),
+                type<value_type::string>(),
+                get_type<string_array>(),
+            },
+            make_block(std::array{
+                loop(i,
+                     len,
+                     make_block(std::array{
+                         ref_array::set(*this, list(), local_get(i, size_type()), local_tee(str, convert, type<value_type::string>())),
+                         // the length of a rope operand is known without flattening it
+                         local_set(total, binop(BinaryenAddInt32(), local_get(total, size_type()), string_length(local_get(str, type<value_type::string>())))),
+                     }),
+                     const_i32(0),
+                     array_len(list())),
+                // long results keep the converted parts and are copied only when needed, a
+                // shorter result has no rope operands
+                make_if(binop(BinaryenGeUInt32(), local_get(total, size_type()), const_i32(min_rope_length)),
+                        make_return(string::create(*this, std::array{null(), const_i32(0), list(), local_get(total, size_type())}))),
+                local_set(data, string_array::create(*this, local_get(total, size_type()))),
+                local_set(total, const_i32(0)),
+                loop(i,
+                     len,
+                     make_block(std::array{
+                         local_set(str, BinaryenRefCast(mod, ref_array::get(*this, list(), local_get(i, size_type())), type<value_type::string>())),
+                         BinaryenArrayCopy(mod, local_get(data, get_type<string_array>()), local_get(total, size_type()), part(), const_i32(0), array_len(part())),
+                         local_set(total, binop(BinaryenAddInt32(), local_get(total, size_type()), array_len(part()))),
+                     }),
+                     const_i32(0)),
+                make_return(intern_strings ? call(functions::intern_string, result) : result),
+            })};
+}
+} // namespace wumbo
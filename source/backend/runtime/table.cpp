@@ -4,10 +4,139 @@
 #include "binaryen-c.h"
 #include "utils/type.hpp"
 
+#include <limits>
+
 namespace wumbo
 {
+// smallest power of two that holds count entries below the maximum load factor
+// and keeps at least one slot empty, see table_next
+static expr_ref hash_capacity(runtime* self, expr_ref count)
+{
+    runtime::function_stack stack{self->mod};
+
+    auto func = stack.add_function("*hash_capacity", self->size_type(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto count = stack.alloc(self->size_type(), "count");
+                                       stack.locals();
+
+                                       // count * 1.25 + 1 rounded up to a power of two, at least 2
+                                       auto needed = self->binop(BinaryenAddInt32(),
+                                                                 self->binop(BinaryenAddInt32(), stack.get(count), self->binop(BinaryenShrUInt32(), stack.get(count), self->const_i32(2))),
+                                                                 self->const_i32(1));
+                                       return self->make_if(self->binop(BinaryenLeUInt32(), stack.tee(count, needed), self->const_i32(2)),
+                                                            self->const_i32(2),
+                                                            self->binop(BinaryenShlInt32(),
+                                                                        self->const_i32(1),
+                                                                        self->binop(BinaryenSubInt32(),
+                                                                                    self->const_i32(32),
+                                                                                    self->unop(BinaryenClzInt32(), self->binop(BinaryenSubInt32(), stack.get(count), self->const_i32(1))))));
+                                   });
+    return func(std::array{count});
+}
+
+// bumped whenever a table marked with prototype_flag changes, field caches of inherited
+// keys are only used while it has the value they were filled at
+static expr_ref field_epoch(runtime* self)
+{
+    auto name = "*field_epoch";
+    if (!BinaryenGetGlobal(self->mod, name))
+        BinaryenAddGlobal(self->mod, name, self->size_type(), true, self->const_i32(0));
+    return BinaryenGlobalGet(self->mod, name, self->size_type());
+}
+
+// parts shared by all tables that have not used them yet. The array part is empty and
+// the hash part has a single empty slot, so lookups miss at the first probe and the
+// first insert rehashes before anything is written
+static expr_ref empty_part(runtime* self, const char* name, BinaryenType type, int32_t length)
+{
+    if (!BinaryenGetGlobal(self->mod, name))
+        BinaryenAddGlobal(self->mod, name, type, false, BinaryenArrayNew(self->mod, BinaryenTypeGetHeapType(type), self->const_i32(length), nullptr));
+    return BinaryenGlobalGet(self->mod, name, type);
+}
+
 struct runtime::tbl
 {
+    // finalizer that spreads every input bit over the low bits used by calc_pos,
+    // sequential and strided keys would otherwise fill neighbouring slots
+    static expr_ref mix64(runtime* self, runtime::function_stack& stack, size_t x)
+    {
+        auto mod   = self->mod;
+        auto shift = [&]()
+        {
+            // x ^ (x >> 32)
+            return self->binop(BinaryenXorInt64(), stack.get(x), self->binop(BinaryenShrUInt64(), stack.get(x), BinaryenConst(mod, BinaryenLiteralInt64(32))));
+        };
+        auto round = [&]()
+        {
+            return stack.set(x, self->binop(BinaryenMulInt64(), shift(), BinaryenConst(mod, BinaryenLiteralInt64(0xd6e8feb86659fd93))));
+        };
+        return self->make_block(std::array{
+            round(),
+            round(),
+            self->unop(BinaryenWrapInt64(), shift()),
+        });
+    }
+
+    // murmur3 fmix32
+    static expr_ref mix32(runtime* self, runtime::function_stack& stack, size_t x)
+    {
+        auto shift = [&](int32_t n)
+        {
+            return self->binop(BinaryenXorInt32(), stack.get(x), self->binop(BinaryenShrUInt32(), stack.get(x), self->const_i32(n)));
+        };
+        auto mul = [&](expr_ref value, uint32_t factor)
+        {
+            return stack.set(x, self->binop(BinaryenMulInt32(), value, self->const_i32(static_cast<int32_t>(factor))));
+        };
+        return self->make_block(std::array{
+            mul(shift(16), 0x85ebca6b),
+            mul(shift(13), 0xc2b2ae35),
+            shift(16),
+        });
+    }
+
+    // float keys with an integral value are the integer keys, t[1.0] is t[1]
+    template<typename F>
+    static expr_ref integral_float_key(runtime* self, runtime::function_stack& stack, size_t key, F&& use_integer)
+    {
+        auto mod = self->mod;
+        auto f   = stack.alloc(self->number_type(), "f");
+        auto n   = stack.alloc(self->integer_type(), "n");
+
+        auto trunc = self->big_int ? BinaryenTruncSatSFloat64ToInt64() : BinaryenTruncSatSFloat64ToInt32();
+        auto back  = self->big_int ? BinaryenConvertSInt64ToFloat64() : BinaryenConvertSInt32ToFloat64();
+        auto limit = self->big_int ? 0x1p63 : 0x1p31;
+        return self->make_if(self->binop(BinaryenAndInt32(),
+                                         self->binop(BinaryenEqFloat64(),
+                                                     stack.tee(f, number::get<number::inner>(*self, stack.get(key))),
+                                                     self->unop(back, stack.tee(n, self->unop(trunc, stack.get(f))))),
+                                         self->binop(BinaryenLtFloat64(), stack.get(f), BinaryenConst(mod, BinaryenLiteralFloat64(limit)))),
+                             use_integer(self->new_integer(stack.get(n))));
+    }
+
+    // reference types hash by identity, an object gets its id the first time it is
+    // used as a key. The ids are a counter run through mix32, which is a bijection,
+    // so they are unique, never 0 and already spread over the low bits
+    template<typename T>
+    static std::vector<expr_ref> object_id(runtime* self, runtime::function_stack& stack, size_t key)
+    {
+        auto mod         = self->mod;
+        const char* next = "*next_id";
+        if (!BinaryenGetGlobal(mod, next))
+            BinaryenAddGlobal(mod, next, self->size_type(), true, self->const_i32(0));
+
+        auto id = stack.alloc(self->size_type(), "id");
+        return std::vector{
+            self->make_if(stack.tee(id, T::template get<typename T::id>(*self, stack.get(key))),
+                          self->make_return(stack.get(id))),
+            stack.set(id, self->binop(BinaryenAddInt32(), BinaryenGlobalGet(mod, next, self->size_type()), self->const_i32(1))),
+            BinaryenGlobalSet(mod, next, stack.get(id)),
+            stack.set(id, mix32(self, stack, id)),
+            T::template set<typename T::id>(*self, stack.get(key), stack.get(id)),
+            stack.get(id),
+        };
+    }
+
     static auto hash(runtime* self, value_type vtype)
     {
         auto mod = self->mod;
@@ -23,17 +152,33 @@ struct runtime::tbl
                                           switch (vtype)
                                           {
                                           case value_type::integer:
-                                              return std::vector{self->integer_to_size(self->unbox_integer(stack.get(key)))};
+                                          {
+                                              auto x = stack.alloc(self->integer_type(), "x");
+                                              return std::vector{
+                                                  stack.set(x, self->unbox_integer(stack.get(key))),
+                                                  self->big_int ? mix64(self, stack, x) : mix32(self, stack, x),
+                                              };
+                                          }
                                           case value_type::number:
-                                              // BinaryenTruncSFloat64ToInt32
-                                              return std::vector{BinaryenUnreachable(mod)};
+                                          {
+                                              // adding 0.0 turns -0.0 into 0.0, they are equal keys
+                                              auto x = stack.alloc(BinaryenTypeInt64(), "x");
+                                              return std::vector{
+                                                  stack.set(x, self->unop(BinaryenReinterpretFloat64(), self->binop(BinaryenAddFloat64(), number::get<number::inner>(*self, stack.get(key)), BinaryenConst(mod, BinaryenLiteralFloat64(0.0))))),
+                                                  mix64(self, stack, x),
+                                              };
+                                          }
                                           case value_type::string:
                                           {
                                               auto h       = stack.alloc(self->size_type(), "h");
                                               auto len     = stack.alloc(self->size_type(), "len");
                                               auto step    = stack.alloc(self->size_type(), "step");
-                                              auto tee_len = stack.tee(len, self->array_len(stack.get(key)));
+                                              auto data    = stack.alloc(self->get_type<string_array>(), "data");
+                                              auto tee_len = stack.tee(len, self->array_len(stack.tee(data, self->string_data(stack.get(key)))));
                                               return std::vector{
+                                                  // the hash is cached in the string after the first call
+                                                  self->make_if(stack.tee(h, string::get<string::hash>(*self, stack.get(key))),
+                                                                self->make_return(stack.get(h))),
                                                   // unsigned int h = seed ^ (unsigned int)len;
                                                   stack.set(h, self->binop(BinaryenXorInt32(), tee_len, self->const_i32(0x3eb1b260))),
                                                   // size_t step = (len >> 5) + 1;
@@ -57,24 +202,36 @@ struct runtime::tbl
                                                                                                                                    self->binop(BinaryenShrUInt32(),
                                                                                                                                                stack.get(h),
                                                                                                                                                self->const_i32(2))),
-                                                                                                                       string::get(*self,
-                                                                                                                                   stack.get(key),
-                                                                                                                                   self->binop(BinaryenSubInt32(), stack.get(len), self->const_i32(1)))))),
+                                                                                                                       string_array::get(*self,
+                                                                                                                                         stack.get(data),
+                                                                                                                                         self->binop(BinaryenSubInt32(), stack.get(len), self->const_i32(1)))))),
                                                                                      // len -= step;
                                                                                      stack.set(len, self->binop(BinaryenSubInt32(), stack.get(len), stack.get(step))),
                                                                                      BinaryenBreak(mod, "+loop", nullptr, nullptr),
                                                                                  })),
                                                                })),
+                                                  // 0 is reserved for "not hashed yet"
+                                                  stack.set(h, BinaryenSelect(mod, stack.get(h), stack.get(h), self->const_i32(1), self->size_type())),
+                                                  string::set<string::hash>(*self, stack.get(key), stack.get(h)),
                                                   // return h;
                                                   stack.get(h),
                                               };
                                           }
-                                          case value_type::nil:
                                           case value_type::boolean:
+                                              return std::vector{
+                                                  self->make_if(bool_box::get<bool_box::inner>(*self, stack.get(key)),
+                                                                self->const_i32(0x3c6ef372),
+                                                                self->const_i32(0x5a2c9e1b)),
+                                              };
                                           case value_type::function:
+                                              return object_id<function>(self, stack, key);
                                           case value_type::userdata:
+                                              return object_id<userdata>(self, stack, key);
                                           case value_type::thread:
+                                              return object_id<thread>(self, stack, key);
                                           case value_type::table:
+                                              return object_id<table>(self, stack, key);
+                                          case value_type::nil:
                                           default:
                                               return std::vector{BinaryenUnreachable(mod)};
                                           };
@@ -84,157 +241,614 @@ struct runtime::tbl
                                   });
     }
 
+    // capacities are powers of two, see hash_capacity and map_resize
     static expr_ref
     calc_pos(runtime* self, expr_ref len, expr_ref hash_value)
     {
-        // TODO: use bin and
-        return self->binop(BinaryenRemUInt32(),
+        return self->binop(BinaryenAndInt32(),
                            hash_value,
-                           len);
-        // return self->binop(BinaryenAndInt32(),
-        //                    hash_value,
-        //                    self->binop(BinaryenSubInt32(),
-        //                    len, self->const_i32(1)));
+                           self->binop(BinaryenSubInt32(),
+                                       len,
+                                       self->const_i32(1)));
     }
 
-    static auto get_distance(runtime* self)
+    // metadata of a hash slot: 0 is empty, an occupied slot keeps the hash of its key
+    // with the top bit set. Values with the top bit clear are left for tombstones.
+    static constexpr int32_t meta_occupied = std::numeric_limits<int32_t>::min();
+
+    static expr_ref meta_of(runtime* self, expr_ref hash_value)
+    {
+        return self->binop(BinaryenOrInt32(), hash_value, self->const_i32(meta_occupied));
+    }
+
+    // distance of the slot at pos from the slot its metadata hashes to,
+    // (pos + len - best_pos) & (len - 1)
+    static expr_ref distance(runtime* self, runtime::function_stack& stack, size_t meta, size_t pos, size_t len)
+    {
+        auto best_pos = calc_pos(self, stack.get(len), stack.get(meta));
+        return calc_pos(self, stack.get(len), self->binop(BinaryenSubInt32(), self->binop(BinaryenAddInt32(), stack.get(pos), stack.get(len)), best_pos));
+    }
+
+    static expr_ref next_pos(runtime* self, runtime::function_stack& stack, size_t pos, size_t len)
+    {
+        return calc_pos(self, stack.get(len), self->binop(BinaryenAddInt32(), stack.get(pos), self->const_i32(1)));
+    }
+
+    // every occupied slot has a value, deletion removes the entry, see map_remove
+    static expr_ref occupied(runtime* self, runtime::function_stack& stack, size_t metas, size_t pos)
+    {
+        return size_array::get(*self, stack.get(metas), stack.get(pos));
+    }
+
+    // robin hood insert of a key that is not in the map yet, starting at pos
+    // where the entry is dist slots away from its best position
+    static auto map_insert_with_hint(runtime* self)
     {
         auto mod = self->mod;
         runtime::function_stack stack{mod};
 
-        return stack.add_function("*get_distance", self->size_type(), [&](runtime::function_stack& stack)
+        return stack.add_function("*map_insert_with_hint", BinaryenTypeNone(), [&](runtime::function_stack& stack)
                                   {
-                                      auto hash_map = stack.alloc(self->get_type<hash_array>(), "hash_map");
-                                      auto element  = stack.alloc(self->get_type<hash_entry>(), "element");
-                                      auto pos      = stack.alloc(self->size_type(), "pos");
+                                      auto keys   = stack.alloc(self->ref_array_type(), "keys");
+                                      auto values = stack.alloc(self->ref_array_type(), "values");
+                                      auto metas  = stack.alloc(self->get_type<size_array>(), "metas");
+                                      auto key    = stack.alloc(anyref(), "key");
+                                      auto value  = stack.alloc(anyref(), "value");
+                                      auto meta   = stack.alloc(self->size_type(), "meta");
+                                      auto pos    = stack.alloc(self->size_type(), "pos");
+                                      auto dist   = stack.alloc(self->size_type(), "dist");
                                       stack.locals();
 
-                                      auto len = stack.alloc(self->size_type(), "len");
+                                      auto slot_meta = stack.alloc(self->size_type(), "slot_meta");
+                                      auto slot_dist = stack.alloc(self->size_type(), "slot_dist");
+                                      auto capacity  = stack.alloc(self->size_type(), "capacity");
+                                      auto swap      = stack.alloc(anyref(), "swap");
+
+                                      auto exchange = [&](size_t array, size_t local)
+                                      {
+                                          return self->make_block(std::array{
+                                              stack.set(swap, ref_array::get(*self, stack.get(array), stack.get(pos))),
+                                              ref_array::set(*self, stack.get(array), stack.get(pos), stack.get(local)),
+                                              stack.set(local, stack.get(swap)),
+                                          });
+                                      };
 
-                                      auto hash_value = hash_entry::get<hash_entry::hash>(*self, stack.get(element));
-                                      auto best_pos   = calc_pos(self, stack.get(len), hash_value);
                                       return self->make_block(std::array{
+                                          stack.set(capacity, self->array_len(stack.get(metas))),
 
-                                          calc_pos(self, self->binop(BinaryenSubInt32(), self->binop(BinaryenAddInt32(), stack.get(pos), stack.get(len)), best_pos), stack.tee(len, self->array_len(stack.get(hash_map)))),
+                                          BinaryenLoop(mod,
+                                                       "+loop",
+                                                       self->make_block(std::array{
+                                                           self->make_if(self->unop(BinaryenEqZInt32(), stack.tee(slot_meta, size_array::get(*self, stack.get(metas), stack.get(pos)))),
+                                                                         self->make_block(std::array{
+                                                                             ref_array::set(*self, stack.get(keys), stack.get(pos), stack.get(key)),
+                                                                             ref_array::set(*self, stack.get(values), stack.get(pos), stack.get(value)),
+                                                                             size_array::set(*self, stack.get(metas), stack.get(pos), stack.get(meta)),
+                                                                             self->make_return(),
+                                                                         })),
+                                                           // if (slot_dist < dist) the new entry takes the slot
+                                                           self->make_if(self->binop(BinaryenLtUInt32(), stack.tee(slot_dist, distance(self, stack, slot_meta, pos, capacity)), stack.get(dist)),
+                                                                         self->make_block(std::array{
+                                                                             exchange(keys, key),
+                                                                             exchange(values, value),
+                                                                             size_array::set(*self, stack.get(metas), stack.get(pos), stack.get(meta)),
+                                                                             stack.set(meta, stack.get(slot_meta)),
+                                                                             stack.set(dist, stack.get(slot_dist)),
+                                                                         })),
+                                                           stack.set(pos, next_pos(self, stack, pos, capacity)),
+                                                           stack.set(dist, self->binop(BinaryenAddInt32(), stack.get(dist), self->const_i32(1))),
+                                                           BinaryenBreak(mod, "+loop", nullptr, nullptr),
+                                                       })),
                                       });
                                   });
     }
 
-    static auto map_insert_with_hint(runtime* self)
+    // a table with a shape gets its values with the first key
+    static expr_ref own_values(runtime* self, runtime::function_stack& stack, size_t tbl, expr_ref capacity)
+    {
+        return self->make_if(self->unop(BinaryenEqZInt32(), self->array_len(table::get<table::hash_values>(*self, stack.get(tbl)))),
+                             table::set<table::hash_values>(*self, stack.get(tbl), ref_array::create(*self, capacity)));
+    }
+
+    // gives the table its own copy of the keys of its shape before they are written
+    static auto unshape(runtime* self)
     {
         auto mod = self->mod;
         runtime::function_stack stack{mod};
 
-        return stack.add_function("*map_insert_with_hint", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+        return stack.add_function("*table_unshape", BinaryenTypeNone(), [&](runtime::function_stack& stack)
                                   {
-                                      auto hash_map = stack.alloc(self->get_type<hash_array>(), "hash_map");
-                                      auto new_ele  = stack.alloc(self->hash_entry_type(), "new_ele");
-                                      auto pos      = stack.alloc(self->size_type(), "pos");
-                                      auto dist     = stack.alloc(self->size_type(), "dist");
-
+                                      auto tbl = stack.alloc(self->get_type<table>(), "table");
                                       stack.locals();
-                                      size_t ele    = stack.alloc(self->hash_entry_type(), "ele");
-                                      auto ele_dist = stack.alloc(self->size_type(), "ele_dist");
+                                      auto keys     = stack.alloc(self->ref_array_type(), "keys");
+                                      auto metas    = stack.alloc(self->get_type<size_array>(), "metas");
                                       auto capacity = stack.alloc(self->size_type(), "capacity");
-                                      auto i        = stack.alloc(self->size_type(), "i");
 
-                                      auto get_distance_func = get_distance(self);
+                                      return self->make_block(std::array{
+                                          self->make_if(BinaryenRefIsNull(mod, table::get<table::shape>(*self, stack.get(tbl))),
+                                                        self->make_return()),
+                                          stack.set(capacity, self->array_len(table::get<table::hash_keys>(*self, stack.get(tbl)))),
+                                          own_values(self, stack, tbl, stack.get(capacity)),
+                                          BinaryenArrayCopy(mod,
+                                                            stack.tee(keys, ref_array::create(*self, stack.get(capacity))),
+                                                            self->const_i32(0),
+                                                            table::get<table::hash_keys>(*self, stack.get(tbl)),
+                                                            self->const_i32(0),
+                                                            stack.get(capacity)),
+                                          BinaryenArrayCopy(mod,
+                                                            stack.tee(metas, size_array::create(*self, stack.get(capacity))),
+                                                            self->const_i32(0),
+                                                            table::get<table::hash_meta>(*self, stack.get(tbl)),
+                                                            self->const_i32(0),
+                                                            stack.get(capacity)),
+                                          table::set<table::hash_keys>(*self, stack.get(tbl), stack.get(keys)),
+                                          table::set<table::hash_meta>(*self, stack.get(tbl), stack.get(metas)),
+                                          table::set<table::shape>(*self, stack.get(tbl), self->null()),
+                                      });
+                                  });
+    }
+
+    // a new string key of a table with a shape, in the empty slot pos. The first table
+    // to add a key to a shape creates the transition that later tables follow, see set
+    static auto add_shaped(runtime* self)
+    {
+        auto mod = self->mod;
+        runtime::function_stack stack{mod};
+
+        return stack.add_function("*table_add_shaped", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+                                  {
+                                      auto tbl   = stack.alloc(self->get_type<table>(), "table");
+                                      auto key   = stack.alloc(self->type<value_type::string>(), "key");
+                                      auto value = stack.alloc(anyref(), "value");
+                                      auto pos   = stack.alloc(self->size_type(), "pos");
+                                      auto meta  = stack.alloc(self->size_type(), "meta");
+                                      stack.locals();
+                                      auto from = stack.alloc(self->get_type<shape>(), "shape");
+                                      auto next = stack.alloc(self->get_type<shape>(), "next");
 
                                       return self->make_block(std::array{
-                                          stack.set(capacity, self->array_len(stack.get(hash_map))),
+                                          stack.set(from, table::get<table::shape>(*self, stack.get(tbl))),
+                                          unshape(self)(std::array{stack.get(tbl)}),
+                                          ref_array::set(*self, table::get<table::hash_keys>(*self, stack.get(tbl)), stack.get(pos), stack.get(key)),
+                                          ref_array::set(*self, table::get<table::hash_values>(*self, stack.get(tbl)), stack.get(pos), stack.get(value)),
+                                          size_array::set(*self, table::get<table::hash_meta>(*self, stack.get(tbl)), stack.get(pos), stack.get(meta)),
+                                          table::set<table::hash_size>(*self, stack.get(tbl), self->binop(BinaryenAddInt32(), table::get<table::hash_size>(*self, stack.get(tbl)), self->const_i32(1))),
+                                          // a shape has one transition, other keys and deep shapes leave the table on its own
+                                          self->make_if(BinaryenRefIsNull(mod, shape::get<shape::next>(*self, stack.get(from))),
+                                                        self->make_if(self->binop(BinaryenLtUInt32(), shape::get<shape::depth>(*self, stack.get(from)), self->const_i32(max_shape_depth)),
+                                                                      self->make_block(std::array{
+                                                                          stack.set(next, shape::create(*self, std::array{
+                                                                                                                   table::get<table::hash_keys>(*self, stack.get(tbl)),
+                                                                                                                   table::get<table::hash_meta>(*self, stack.get(tbl)),
+                                                                                                                   self->binop(BinaryenAddInt32(), shape::get<shape::depth>(*self, stack.get(from)), self->const_i32(1)),
+                                                                                                                   self->null(),
+                                                                                                                   self->const_i32(0),
+                                                                                                                   self->null(),
+                                                                                                               })),
+                                                                          shape::set<shape::next_key>(*self, stack.get(from), stack.get(key)),
+                                                                          shape::set<shape::next_slot>(*self, stack.get(from), stack.get(pos)),
+                                                                          shape::set<shape::next>(*self, stack.get(from), stack.get(next)),
+                                                                          table::set<table::shape>(*self, stack.get(tbl), stack.get(next)),
+                                                                      }))),
+                                      });
+                                  });
+    }
+
+    // backward shift deletion: the entries after pos move one slot closer to their
+    // best position until an empty slot or an entry already at its best position
+    static auto map_remove(runtime* self)
+    {
+        auto mod = self->mod;
+        runtime::function_stack stack{mod};
+
+        return stack.add_function("*map_remove", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+                                  {
+                                      auto tbl = stack.alloc(self->get_type<table>(), "table");
+                                      auto pos = stack.alloc(self->size_type(), "pos");
+                                      stack.locals();
+
+                                      auto keys      = stack.alloc(self->ref_array_type(), "keys");
+                                      auto values    = stack.alloc(self->ref_array_type(), "values");
+                                      auto metas     = stack.alloc(self->get_type<size_array>(), "metas");
+                                      auto next      = stack.alloc(self->size_type(), "next");
+                                      auto slot_meta = stack.alloc(self->size_type(), "slot_meta");
+                                      auto capacity  = stack.alloc(self->size_type(), "capacity");
+
+                                      auto move = [&](size_t array)
+                                      {
+                                          return ref_array::set(*self, stack.get(array), stack.get(pos), ref_array::get(*self, stack.get(array), stack.get(next)));
+                                      };
+
+                                      return self->make_block(std::array{
+                                          unshape(self)(std::array{stack.get(tbl)}),
+                                          stack.set(keys, table::get<table::hash_keys>(*self, stack.get(tbl))),
+                                          stack.set(values, table::get<table::hash_values>(*self, stack.get(tbl))),
+                                          stack.set(capacity, self->array_len(stack.tee(metas, table::get<table::hash_meta>(*self, stack.get(tbl))))),
+                                          table::set<table::hash_size>(*self, stack.get(tbl), self->binop(BinaryenSubInt32(), table::get<table::hash_size>(*self, stack.get(tbl)), self->const_i32(1))),
 
                                           BinaryenLoop(mod,
                                                        "+loop",
                                                        self->make_block(std::array{
-
-                                                           self->make_if(BinaryenRefIsNull(mod, stack.tee(ele, hash_array::get(*self, stack.get(hash_map), stack.get(pos)))),
-
+                                                           stack.set(next, next_pos(self, stack, pos, capacity)),
+                                                           self->make_if(self->make_if(stack.tee(slot_meta, size_array::get(*self, stack.get(metas), stack.get(next))),
+                                                                                       self->unop(BinaryenEqZInt32(), distance(self, stack, slot_meta, next, capacity)),
+                                                                                       self->const_i32(1)),
                                                                          self->make_block(std::array{
-                                                                             hash_array::set(*self, stack.get(hash_map), stack.get(pos), stack.get(new_ele)),
+                                                                             size_array::set(*self, stack.get(metas), stack.get(pos), self->const_i32(0)),
+                                                                             ref_array::set(*self, stack.get(keys), stack.get(pos), self->null()),
+                                                                             ref_array::set(*self, stack.get(values), stack.get(pos), self->null()),
                                                                              self->make_return(),
                                                                          })),
-                                                           // auto ele_dist = get_distance(hash_map, ele, pos);
-                                                           // if (ele_dist < dist)
-                                                           self->make_if(self->binop(BinaryenLtUInt32(), stack.tee(ele_dist, get_distance_func(std::array{stack.get(hash_map), stack.get(ele), stack.get(pos)})), stack.get(dist)),
-                                                                         self->make_block(std::array{
-                                                                             // swap
-                                                                             hash_array::set(*self, stack.get(hash_map), stack.get(pos), stack.get(new_ele)),
-                                                                             stack.set(new_ele, stack.get(ele)),
-                                                                             // dist = ele_dist
-                                                                             stack.set(dist, stack.get(ele_dist)),
-                                                                         })),
-                                                           // pos = calc_pos(pos + 1)
-                                                           stack.set(pos, calc_pos(self, stack.get(capacity), self->binop(BinaryenAddInt32(), stack.get(pos), self->const_i32(1)))),
-
-                                                           // dist++
-                                                           stack.set(dist, self->binop(BinaryenAddInt32(), stack.get(dist), self->const_i32(1))),
+                                                           move(keys),
+                                                           move(values),
+                                                           size_array::set(*self, stack.get(metas), stack.get(pos), stack.get(slot_meta)),
+                                                           stack.set(pos, stack.get(next)),
                                                            BinaryenBreak(mod, "+loop", nullptr, nullptr),
-
                                                        })),
-
                                       });
                                   });
     }
 
-    static auto map_insert(runtime* self)
+    // key - 1 for an integer key, compared in the integer domain so keys
+    // beyond 32 bits do not wrap into the array part
+    static expr_ref array_index(runtime* self, runtime::function_stack& stack, size_t key, size_t index, expr_ref capacity)
+    {
+        return self->lt_uint(stack.tee(index, self->sub_int(self->unbox_integer(stack.get(key)), self->const_integer(1))),
+                             self->size_to_integer(capacity));
+    }
+
+    // ceil(log2(k)), the slot of k in the histogram of computesizes
+    static expr_ref ceil_log2(runtime* self, expr_ref k)
+    {
+        return self->binop(BinaryenSubInt32(),
+                           self->const_i32(32),
+                           self->unop(BinaryenClzInt32(), self->binop(BinaryenSubInt32(), k, self->const_i32(1))));
+    }
+
+    // largest array part supported, like MAXASIZE in lua
+    static constexpr int32_t max_array_size = 1 << 30;
+
+    static auto array_resize(runtime* self)
     {
         auto mod = self->mod;
         runtime::function_stack stack{mod};
 
-        return stack.add_function("*map_insert", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+        return stack.add_function("*array_resize", BinaryenTypeNone(), [&](runtime::function_stack& stack)
                                   {
-                                      auto hash_map = stack.alloc(self->get_type<hash_array>(), "hash_map");
-                                      auto new_ele  = stack.alloc(self->hash_entry_type(), "new_ele");
-
+                                      auto tbl      = stack.alloc(self->get_type<table>(), "table");
+                                      auto capacity = stack.alloc(self->size_type(), "capacity");
                                       stack.locals();
+                                      auto array  = stack.alloc(self->ref_array_type(), "array");
+                                      auto keys   = stack.alloc(self->ref_array_type(), "keys");
+                                      auto values = stack.alloc(self->ref_array_type(), "values");
+                                      auto metas  = stack.alloc(self->get_type<size_array>(), "metas");
+                                      auto i      = stack.alloc(self->size_type(), "i");
+                                      auto index  = stack.alloc(self->integer_type(), "index");
+                                      auto length = stack.alloc(self->size_type(), "length");
+
+                                      auto old_array = table::get<table::array>(*self, stack.get(tbl));
+                                      return self->make_block(std::array{
+                                          stack.set(array, ref_array::create(*self, stack.get(capacity))),
+                                          // a smaller array part only drops trailing nils, see array_trim
+                                          stack.set(length, self->array_len(table::get<table::array>(*self, stack.get(tbl)))),
+                                          BinaryenArrayCopy(mod,
+                                                            stack.get(array),
+                                                            self->const_i32(0),
+                                                            old_array,
+                                                            self->const_i32(0),
+                                                            BinaryenSelect(mod,
+                                                                           self->binop(BinaryenLtUInt32(), stack.get(capacity), stack.get(length)),
+                                                                           stack.get(capacity),
+                                                                           stack.get(length),
+                                                                           self->size_type())),
+                                          table::set<table::array>(*self, stack.get(tbl), stack.get(array)),
+
+                                          // integer keys now covered by the array part move out of the hash part
+                                          self->make_if(self->binop(BinaryenLeUInt32(), stack.get(capacity), stack.get(length)), self->make_return()),
+                                          self->make_if(self->unop(BinaryenEqZInt32(), table::get<table::hash_size>(*self, stack.get(tbl))), self->make_return()),
+                                          stack.set(keys, table::get<table::hash_keys>(*self, stack.get(tbl))),
+                                          stack.set(values, table::get<table::hash_values>(*self, stack.get(tbl))),
+                                          stack.set(i, self->array_len(stack.tee(metas, table::get<table::hash_meta>(*self, stack.get(tbl))))),
+                                          BinaryenLoop(mod,
+                                                       "+loop",
+                                                       self->make_if(stack.get(i),
+                                                                     self->make_block(std::array{
+                                                                         stack.set(i, self->binop(BinaryenSubInt32(), stack.get(i), self->const_i32(1))),
+                                                                         self->make_if(self->binop(BinaryenAndInt32(),
+                                                                                                   occupied(self, stack, metas, i),
+                                                                                                   self->is_integer(ref_array::get(*self, stack.get(keys), stack.get(i)))),
+                                                                                       self->make_if(self->lt_uint(stack.tee(index, self->sub_int(self->unbox_integer(ref_array::get(*self, stack.get(keys), stack.get(i))), self->const_integer(1))),
+                                                                                                                   self->size_to_integer(stack.get(capacity))),
+                                                                                                     self->make_block(std::array{
+                                                                                                         ref_array::set(*self, stack.get(array), self->integer_to_size(stack.get(index)), ref_array::get(*self, stack.get(values), stack.get(i))),
+                                                                                                         // the slot is visited again, removing may shift an unvisited entry into it
+                                                                                                         map_remove(self)(std::array{stack.get(tbl), stack.get(i)}),
+                                                                                                         stack.set(i, self->binop(BinaryenAddInt32(), stack.get(i), self->const_i32(1))),
+                                                                                                     }))),
+                                                                         BinaryenBreak(mod, "+loop", nullptr, nullptr),
+                                                                     }))),
+                                      });
+                                  });
+    }
+
+    // hash parts up to this capacity are never shrunk
+    static constexpr int32_t min_shrink_capacity = 8;
 
-                                      return map_insert_with_hint(self)(std::array{
-                                                                            stack.get(hash_map),
-                                                                            stack.get(new_ele),
+    // drops the trailing nils of the array part once it is less than a quarter used,
+    // the new capacity is the smallest power of two with room to double
+    static auto array_trim(runtime* self)
+    {
+        auto mod = self->mod;
+        runtime::function_stack stack{mod};
 
-                                                                            calc_pos(self, self->array_len(stack.get(hash_map)), hash_entry::get<hash_entry::hash>(*self, stack.get(new_ele))),
-                                                                            self->const_i32(0),
-                                                                        },
-                                                                        true);
+        return stack.add_function("*array_trim", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+                                  {
+                                      auto tbl = stack.alloc(self->get_type<table>(), "table");
+                                      stack.locals();
+                                      auto array    = stack.alloc(self->ref_array_type(), "array");
+                                      auto length   = stack.alloc(self->size_type(), "length");
+                                      auto capacity = stack.alloc(self->size_type(), "capacity");
+
+                                      return self->make_block(std::array{
+                                          stack.set(length, stack.tee(capacity, self->array_len(stack.tee(array, table::get<table::array>(*self, stack.get(tbl)))))),
+                                          // while (length && array[length - 1] == nil) length--;
+                                          BinaryenLoop(mod,
+                                                       "+loop",
+                                                       self->make_if(stack.get(length),
+                                                                     self->make_if(BinaryenRefIsNull(mod, ref_array::get(*self, stack.get(array), self->binop(BinaryenSubInt32(), stack.get(length), self->const_i32(1)))),
+                                                                                   self->make_block(std::array{
+                                                                                       stack.set(length, self->binop(BinaryenSubInt32(), stack.get(length), self->const_i32(1))),
+                                                                                       BinaryenBreak(mod, "+loop", nullptr, nullptr),
+                                                                                   })))),
+                                          self->make_if(self->binop(BinaryenAndInt32(),
+                                                                    self->binop(BinaryenGtUInt32(), stack.get(capacity), self->const_i32(4)),
+                                                                    self->binop(BinaryenLeUInt32(), self->binop(BinaryenShlInt32(), stack.get(length), self->const_i32(2)), stack.get(capacity))),
+                                                        array_resize(self)(std::array{
+                                                            stack.get(tbl),
+                                                            self->make_if(stack.get(length),
+                                                                          self->binop(BinaryenShlInt32(),
+                                                                                      self->const_i32(1),
+                                                                                      ceil_log2(self, self->binop(BinaryenShlInt32(), stack.get(length), self->const_i32(1)))),
+                                                                          self->const_i32(0)),
+                                                        })),
+                                      });
                                   });
     }
 
+    // called when the hash part is full or mostly empty: like computesizes in lua,
+    // the array part grows to the largest power of two n that is more than half used
+    // by the integer keys 1..n, then the remaining entries are rehashed into a hash
+    // part sized for them
     static auto map_resize(runtime* self)
     {
         auto mod = self->mod;
         runtime::function_stack stack{mod};
 
-        return stack.add_function("*map_grow", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+        return stack.add_function("*map_rehash", BinaryenTypeNone(), [&](runtime::function_stack& stack)
                                   {
                                       auto tbl = stack.alloc(self->get_type<table>(), "table");
                                       stack.locals();
-                                      auto hash_map     = stack.alloc(self->get_type<hash_array>(), "hash_map");
-                                      auto new_hash_map = stack.alloc(self->get_type<hash_array>(), "new_hash_map");
-                                      auto capacity     = stack.alloc(self->size_type(), "capacity");
-                                      auto ele          = stack.alloc(self->get_type<hash_entry>(), "ele");
-
-                                      auto tee_hash_map     = stack.tee(hash_map, table::get<table::hash>(*self, stack.get(tbl)));
-                                      auto tee_capacity     = stack.tee(capacity, self->array_len(tee_hash_map));
-                                      auto tee_capacity_dec = stack.tee(capacity, self->binop(BinaryenSubInt32(), stack.get(capacity), self->const_i32(1)));
-                                      auto tee_new_hash_map = stack.tee(new_hash_map, hash_array::create(*self, self->binop(BinaryenMulInt32(), tee_capacity, self->const_i32(2))));
-                                      auto insert           = map_insert(self);
+                                      auto keys       = stack.alloc(self->ref_array_type(), "keys");
+                                      auto values     = stack.alloc(self->ref_array_type(), "values");
+                                      auto metas      = stack.alloc(self->get_type<size_array>(), "metas");
+                                      auto new_keys   = stack.alloc(self->ref_array_type(), "new_keys");
+                                      auto new_values = stack.alloc(self->ref_array_type(), "new_values");
+                                      auto new_metas  = stack.alloc(self->get_type<size_array>(), "new_metas");
+                                      auto capacity   = stack.alloc(self->size_type(), "capacity");
+                                      auto array      = stack.alloc(self->ref_array_type(), "array");
+                                      auto nums       = stack.alloc(self->get_type<size_array>(), "nums");
+                                      auto total      = stack.alloc(self->size_type(), "total");
+                                      auto index      = stack.alloc(self->integer_type(), "index");
+                                      auto slot       = stack.alloc(self->size_type(), "slot");
+                                      auto count      = stack.alloc(self->size_type(), "count");
+                                      auto twotoi     = stack.alloc(self->size_type(), "twotoi");
+                                      auto optimal    = stack.alloc(self->size_type(), "optimal");
+
+                                      auto count_key = [&](expr_ref k)
+                                      {
+                                          return self->make_block(std::array{
+                                              stack.set(slot, ceil_log2(self, k)),
+                                              size_array::set(*self, stack.get(nums), stack.get(slot), self->binop(BinaryenAddInt32(), size_array::get(*self, stack.get(nums), stack.get(slot)), self->const_i32(1))),
+                                              stack.set(total, self->binop(BinaryenAddInt32(), stack.get(total), self->const_i32(1))),
+                                          });
+                                      };
+                                      // for (capacity = len; capacity--;) body
+                                      auto count_down = [&](const char* label, expr_ref len, expr_ref body)
+                                      {
+                                          return self->make_block(std::array{
+                                              stack.set(capacity, len),
+                                              BinaryenLoop(mod,
+                                                           label,
+                                                           self->make_if(stack.get(capacity),
+                                                                         self->make_block(std::array{
+                                                                             stack.set(capacity, self->binop(BinaryenSubInt32(), stack.get(capacity), self->const_i32(1))),
+                                                                             body,
+                                                                             BinaryenBreak(mod, label, nullptr, nullptr),
+                                                                         }))),
+                                          });
+                                      };
+                                      auto key = [&]()
+                                      {
+                                          return ref_array::get(*self, stack.get(keys), stack.get(capacity));
+                                      };
+                                      auto insert = map_insert_with_hint(self);
+
                                       return self->make_block(std::array{
-                                          table::set<table::hash>(*self, stack.get(tbl), tee_new_hash_map),
+                                          stack.set(nums, size_array::create(*self, self->const_i32(32))),
+                                          stack.set(keys, table::get<table::hash_keys>(*self, stack.get(tbl))),
+                                          stack.set(values, table::get<table::hash_values>(*self, stack.get(tbl))),
+                                          stack.set(metas, table::get<table::hash_meta>(*self, stack.get(tbl))),
+
+                                          // integer keys in the array part
+                                          count_down("+array",
+                                                     self->array_len(stack.tee(array, table::get<table::array>(*self, stack.get(tbl)))),
+                                                     self->make_if(self->unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, ref_array::get(*self, stack.get(array), stack.get(capacity)))),
+                                                                   count_key(self->binop(BinaryenAddInt32(), stack.get(capacity), self->const_i32(1))))),
+                                          // integer keys in the hash part
+                                          count_down("+hash",
+                                                     self->array_len(stack.get(metas)),
+                                                     self->make_if(self->binop(BinaryenAndInt32(), occupied(self, stack, metas, capacity), self->is_integer(key())),
+                                                                   self->make_if(self->lt_uint(stack.tee(index, self->sub_int(self->unbox_integer(key()), self->const_integer(1))),
+                                                                                               self->const_integer(max_array_size)),
+                                                                                 count_key(self->binop(BinaryenAddInt32(), self->integer_to_size(stack.get(index)), self->const_i32(1)))))),
+
+                                          // for (slot = 0, twotoi = 1; twotoi <= max && total > twotoi / 2; slot++, twotoi *= 2)
+                                          stack.set(twotoi, self->const_i32(1)),
+                                          stack.set(slot, self->const_i32(0)),
                                           BinaryenLoop(mod,
-                                                       "+loop",
-                                                       self->make_block(std::array{
-                                                           self->make_if(self->unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, stack.tee(ele, hash_array::get(*self, stack.get(hash_map), tee_capacity_dec)))),
-                                                                         insert(std::array{
-                                                                             stack.get(new_hash_map),
-                                                                             stack.get(ele),
-                                                                         })),
-                                                           BinaryenBreak(mod, "+loop", stack.get(capacity), nullptr),
-                                                       })),
+                                                       "+sizes",
+                                                       self->make_if(self->binop(BinaryenAndInt32(),
+                                                                                 self->binop(BinaryenLeUInt32(), stack.get(twotoi), self->const_i32(max_array_size)),
+                                                                                 self->binop(BinaryenGtUInt32(), stack.get(total), self->binop(BinaryenShrUInt32(), stack.get(twotoi), self->const_i32(1)))),
+                                                                     self->make_block(std::array{
+                                                                         stack.set(count, self->binop(BinaryenAddInt32(), stack.get(count), size_array::get(*self, stack.get(nums), stack.get(slot)))),
+                                                                         self->make_if(self->binop(BinaryenGtUInt32(), stack.get(count), self->binop(BinaryenShrUInt32(), stack.get(twotoi), self->const_i32(1))),
+                                                                                       stack.set(optimal, stack.get(twotoi))),
+                                                                         stack.set(slot, self->binop(BinaryenAddInt32(), stack.get(slot), self->const_i32(1))),
+                                                                         stack.set(twotoi, self->binop(BinaryenShlInt32(), stack.get(twotoi), self->const_i32(1))),
+                                                                         BinaryenBreak(mod, "+sizes", nullptr, nullptr),
+                                                                     }))),
+                                          self->make_if(self->binop(BinaryenGtUInt32(), stack.get(optimal), self->array_len(stack.get(array))),
+                                                        array_resize(self)(std::array{stack.get(tbl), stack.get(optimal)})),
+
+                                          // rehash the remaining entries
+                                          stack.set(count, self->const_i32(0)),
+                                          count_down("+count",
+                                                     self->array_len(stack.get(metas)),
+                                                     self->make_if(occupied(self, stack, metas, capacity),
+                                                                   stack.set(count, self->binop(BinaryenAddInt32(), stack.get(count), self->const_i32(1))))),
+                                          stack.set(slot, hash_capacity(self, self->binop(BinaryenAddInt32(), stack.get(count), self->const_i32(1)))),
+                                          stack.set(new_keys, ref_array::create(*self, stack.get(slot))),
+                                          stack.set(new_values, ref_array::create(*self, stack.get(slot))),
+                                          stack.set(new_metas, size_array::create(*self, stack.get(slot))),
+                                          count_down("+insert",
+                                                     self->array_len(stack.get(metas)),
+                                                     self->make_if(occupied(self, stack, metas, capacity),
+                                                                   insert(std::array{
+                                                                       stack.get(new_keys),
+                                                                       stack.get(new_values),
+                                                                       stack.get(new_metas),
+                                                                       key(),
+                                                                       ref_array::get(*self, stack.get(values), stack.get(capacity)),
+                                                                       size_array::get(*self, stack.get(metas), stack.get(capacity)),
+                                                                       calc_pos(self, stack.get(slot), size_array::get(*self, stack.get(metas), stack.get(capacity))),
+                                                                       self->const_i32(0),
+                                                                   }))),
+                                          table::set<table::hash_keys>(*self, stack.get(tbl), stack.get(new_keys)),
+                                          table::set<table::hash_values>(*self, stack.get(tbl), stack.get(new_values)),
+                                          table::set<table::hash_meta>(*self, stack.get(tbl), stack.get(new_metas)),
+                                          table::set<table::hash_size>(*self, stack.get(tbl), stack.get(count)),
+                                          // the arrays of the shape were only read
+                                          table::set<table::shape>(*self, stack.get(tbl), self->null()),
+                                      });
+                                  });
+    }
+
+    enum class lookup
+    {
+        // the value, a missing key continues with __index
+        value,
+        // the value without metamethods
+        raw,
+        // the position of the key for table_next, -1 when the key is missing
+        find,
+        // the slot of the key in the hash part, -1 when the key is missing
+        slot,
+    };
+
+    static std::string get_name(lookup mode, value_type vtype)
+    {
+        switch (mode)
+        {
+        case lookup::value:
+            return "*table_get_"s + type_name(vtype);
+        case lookup::raw:
+            return "*table_rawget_"s + type_name(vtype);
+        case lookup::slot:
+            return "*table_slot_"s + type_name(vtype);
+        default:
+            return "*table_find_"s + type_name(vtype);
+        }
+    }
+
+    static expr_ref event_bit(runtime* self, runtime::event e)
+    {
+        return self->const_i32(1 << static_cast<int>(e));
+    }
+
+    // the metatable has no such field, the bit was set by runtime::metamethod
+    static expr_ref known_absent(runtime* self, expr_ref metatable, runtime::event e)
+    {
+        return self->binop(BinaryenAndInt32(), table::get<table::flags>(*self, metatable), event_bit(self, e));
+    }
+
+    // __index of a table whose own lookup missed. A table handler continues in table_get
+    // through a tail call, a chain of prototypes runs in constant stack space
+    static auto index(runtime* self)
+    {
+        auto mod = self->mod;
+
+        runtime::function_stack stack{mod};
+
+        return stack.add_function("*table_index", anyref(), [&](runtime::function_stack& stack)
+                                  {
+                                      auto table = stack.alloc(self->type<value_type::table>(), "table");
+                                      auto key   = stack.alloc(anyref(), "key");
+                                      stack.locals();
+                                      auto handler = stack.alloc(anyref(), "handler");
+
+                                      expr_ref args[] = {stack.get(handler), stack.get(key)};
+                                      return self->make_block(std::array{
+                                          self->make_if(BinaryenRefIsNull(mod, stack.tee(handler, self->metamethod(table::get<table::metatable>(*self, stack.get(table)), runtime::event::index))),
+                                                        self->make_return(self->null())),
+                                          self->make_if(BinaryenRefTest(mod, stack.get(handler), self->type<value_type::table>()),
+                                                        BinaryenReturnCall(mod, self->require(functions::table_get).name, args, std::size(args), anyref())),
+                                          self->make_return(self->first_result(self->call(functions::invoke,
+                                                                                          std::array{
+                                                                                              stack.get(handler),
+                                                                                              ref_array::create_fixed(*self, std::array{stack.get(table), stack.get(key)}),
+                                                                                          }))),
+                                      });
+                                  });
+    }
+
+    // __newindex of a table that does not have the key. Without a handler the flag
+    // is set now and the assignment is repeated without coming back here
+    static auto newindex(runtime* self)
+    {
+        auto mod = self->mod;
+
+        runtime::function_stack stack{mod};
+
+        return stack.add_function("*table_newindex", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+                                  {
+                                      auto table = stack.alloc(self->type<value_type::table>(), "table");
+                                      auto key   = stack.alloc(anyref(), "key");
+                                      auto value = stack.alloc(anyref(), "value");
+                                      stack.locals();
+                                      auto handler = stack.alloc(anyref(), "handler");
+
+                                      auto set = [&](expr_ref target)
+                                      {
+                                          expr_ref args[] = {target, stack.get(key), stack.get(value)};
+                                          return BinaryenReturnCall(mod, self->require(functions::table_set).name, args, std::size(args), BinaryenTypeNone());
+                                      };
+                                      return self->make_block(std::array{
+                                          self->make_if(BinaryenRefIsNull(mod, stack.tee(handler, self->metamethod(table::get<table::metatable>(*self, stack.get(table)), runtime::event::newindex))),
+                                                        set(stack.get(table))),
+                                          self->make_if(BinaryenRefTest(mod, stack.get(handler), self->type<value_type::table>()),
+                                                        set(stack.get(handler))),
+                                          self->drop(self->call(functions::invoke,
+                                                                std::array{
+                                                                    stack.get(handler),
+                                                                    ref_array::create_fixed(*self, std::array{stack.get(table), stack.get(key), stack.get(value)}),
+                                                                })),
                                       });
                                   });
     }
 
-    static auto set(runtime* self, value_type vtype)
+    // without grow the caller has presized the hash part, the load factor is not checked
+    static auto set(runtime* self, value_type vtype, bool grow = true)
     {
         auto mod = self->mod;
 
@@ -246,202 +860,476 @@ struct runtime::tbl
             auto key   = stack.alloc(self->type(vtype), "key");
             auto value = stack.alloc(anyref(), "value");
             stack.locals();
-            auto o = BinaryenNop(mod);
+            auto metatable = stack.alloc(self->type<value_type::table>(), "metatable");
+            auto o         = BinaryenNop(mod);
 
-            if (vtype == value_type::integer)
+            // a key that is not in the table goes to __newindex first
+            auto newindex = [&]()
             {
-                // TODO check 0xFF00000001
+                if (!grow)
+                    return BinaryenNop(mod);
+                expr_ref args[] = {stack.get(table), stack.get(key), stack.get(value)};
+                return self->make_if(self->unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, stack.tee(metatable, table::get<table::metatable>(*self, stack.get(table))))),
+                                     self->make_if(self->unop(BinaryenEqZInt32(), known_absent(self, stack.get(metatable), runtime::event::newindex)),
+                                                   BinaryenReturnCall(mod, "*table_newindex", args, std::size(args), BinaryenTypeNone())));
+            };
 
-                auto i     = stack.alloc(self->size_type(), "i");
-                auto tee_i = stack.tee(i, self->binop(BinaryenSubInt32(), self->integer_to_size(integer::get<integer::inner>(*self, stack.get(key))), self->const_i32(1)));
-                o          = self->make_if(self->binop(BinaryenLtUInt32(),
-                                              tee_i,
-                                              self->array_len(table::get<table::array>(*self, stack.get(table)))),
+            if (vtype == value_type::string)
+            {
+                auto from = stack.alloc(self->get_type<shape>(), "shape");
+                auto next = stack.alloc(self->get_type<shape>(), "next");
+                o         = self->make_block(std::array{
+                    // metamethods are string keys, a metatable forgets which ones were missing
+                    self->prototype_changed(stack.get(table)),
+                    table::set<table::flags>(*self, stack.get(table), self->binop(BinaryenAndInt32(), table::get<table::flags>(*self, stack.get(table)), self->const_i32(prototype_flag))),
+                    // the key another table of the same shape added next, the slot is known
+                    // without hashing and the keys are shared with that table
+                    self->make_if(self->unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, stack.tee(from, table::get<table::shape>(*self, stack.get(table))))),
+                                  self->make_if(self->unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, stack.tee(next, shape::get<shape::next>(*self, stack.get(from))))),
+                                                self->make_if(self->compare(vtype)(std::array{stack.get(key), shape::get<shape::next_key>(*self, stack.get(from))}),
+                                                              self->make_block(std::array{
+                                                                  newindex(),
+                                                                  self->make_if(BinaryenRefIsNull(mod, stack.get(value)), self->make_return()),
+                                                                  table::set<table::hash_keys>(*self, stack.get(table), shape::get<shape::keys>(*self, stack.get(next))),
+                                                                  table::set<table::hash_meta>(*self, stack.get(table), shape::get<shape::metas>(*self, stack.get(next))),
+                                                                  table::set<table::shape>(*self, stack.get(table), stack.get(next)),
+                                                                  own_values(self, stack, table, self->array_len(shape::get<shape::keys>(*self, stack.get(next)))),
+                                                                  ref_array::set(*self, table::get<table::hash_values>(*self, stack.get(table)), shape::get<shape::next_slot>(*self, stack.get(from)), stack.get(value)),
+                                                                  table::set<table::hash_size>(*self, stack.get(table), self->binop(BinaryenAddInt32(), table::get<table::hash_size>(*self, stack.get(table)), self->const_i32(1))),
+                                                                  self->make_return(),
+                                                              })))),
+                });
+                stack.free_local(from);
+                stack.free_local(next);
+            }
+            if (vtype == value_type::number)
+                o = self->make_block(std::array{
+                    // NaN is never equal to itself, it can not be a key
+                    self->make_if(self->binop(BinaryenNeFloat64(), number::get<number::inner>(*self, stack.get(key)), number::get<number::inner>(*self, stack.get(key))),
+                                  self->throw_error(self->add_string("table index is NaN"))),
+                    // *table_set_integer is built next to it by table_set
+                    integral_float_key(self, stack, key, [&](expr_ref integer)
+                                       {
+                                           expr_ref args[] = {stack.get(table), integer, stack.get(value)};
+                                           return BinaryenReturnCall(mod, "*table_set_integer", args, std::size(args), BinaryenTypeNone());
+                                       }),
+                });
+            if (vtype == value_type::integer)
+            {
+                auto index    = stack.alloc(self->integer_type(), "index");
+                auto capacity = stack.alloc(self->size_type(), "array_capacity");
+                auto array    = [&]()
+                {
+                    return table::get<table::array>(*self, stack.get(table));
+                };
+                o = self->make_block(std::array{
+                    self->make_if(array_index(self, stack, key, index, stack.tee(capacity, self->array_len(array()))),
+                                  self->make_block(std::array{
+                                      self->make_if(BinaryenRefIsNull(mod, ref_array::get(*self, array(), self->integer_to_size(stack.get(index)))),
+                                                    newindex()),
+                                      ref_array::set(*self, array(), self->integer_to_size(stack.get(index)), stack.get(value)),
+                                      // clearing the last slot may leave a tail of nils to drop
+                                      self->make_if(self->binop(BinaryenAndInt32(),
+                                                                BinaryenRefIsNull(mod, stack.get(value)),
+                                                                self->eq_int(stack.get(index), self->size_to_integer(self->binop(BinaryenSubInt32(), stack.get(capacity), self->const_i32(1))))),
+                                                    array_trim(self)(std::array{stack.get(table)})),
+                                      self->make_return(),
+                                  })),
+                    // appending right after the array part doubles it
+                    self->make_if(self->binop(BinaryenAndInt32(),
+                                              self->eq_int(stack.get(index), self->size_to_integer(stack.get(capacity))),
+                                              self->unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, stack.get(value)))),
                                   self->make_block(std::array{
-                                      ref_array::set(*self, table::get<table::array>(*self, stack.get(table)), stack.get(i), stack.get(value)),
+                                      newindex(),
+                                      array_resize(self)(std::array{
+                                          stack.get(table),
+                                          self->make_if(self->binop(BinaryenLtUInt32(), stack.get(capacity), self->const_i32(2)),
+                                                        self->const_i32(4),
+                                                        self->binop(BinaryenShlInt32(), stack.get(capacity), self->const_i32(1))),
+                                      }),
+                                      ref_array::set(*self, array(), stack.get(capacity), stack.get(value)),
+                                      table::set<table::border>(*self, stack.get(table), self->binop(BinaryenAddInt32(), stack.get(capacity), self->const_i32(1))),
                                       self->make_return(),
-                                  }));
-                stack.free_local(i);
+                                  })),
+                });
+                stack.free_local(index);
+                stack.free_local(capacity);
             }
 
-            size_t hash_map   = stack.alloc(self->hash_array_type(), "hash_map");
-            size_t hash_value = stack.alloc(self->size_type(), "hash_value");
-            size_t dist       = stack.alloc(self->size_type(), "dist");
-            size_t pos        = stack.alloc(self->size_type(), "pos");
-            size_t ele_dist   = stack.alloc(self->size_type(), "ele_dist");
-            size_t ele        = stack.alloc(self->hash_entry_type(), "ele");
-            size_t new_ele    = stack.alloc(self->hash_entry_type(), "new_ele");
-            size_t capacity   = stack.alloc(self->size_type(), "capacity");
-            size_t size       = stack.alloc(self->size_type(), "size");
-
-            auto tee_hash_map = stack.tee(hash_map, table::get<table::hash>(*self, stack.get(table)));
-
-            auto tee_hash_value = stack.tee(hash_value, hash(self, vtype)(std::array{stack.get(key)}));
-            auto tee_capacity   = stack.tee(capacity, self->array_len(tee_hash_map));
-            auto tee_size       = stack.tee(size, table::get<table::hash_size>(*self, stack.get(table)));
-
-            auto get_distance_func = get_distance(self);
-            auto map_resize_func   = map_resize(self);
-            auto set_ele           = [&]()
+            auto keys      = stack.alloc(self->ref_array_type(), "keys");
+            auto values    = stack.alloc(self->ref_array_type(), "values");
+            auto metas     = stack.alloc(self->get_type<size_array>(), "metas");
+            auto meta      = stack.alloc(self->size_type(), "meta");
+            auto dist      = stack.alloc(self->size_type(), "dist");
+            auto pos       = stack.alloc(self->size_type(), "pos");
+            auto slot_meta = stack.alloc(self->size_type(), "slot_meta");
+            auto slot_dist = stack.alloc(self->size_type(), "slot_dist");
+            auto capacity  = stack.alloc(self->size_type(), "capacity");
+            auto size      = stack.alloc(self->size_type(), "size");
+
+            auto set_slot = [&]()
             {
-                return hash_array::set(*self, stack.get(hash_map), stack.get(pos), stack.get(new_ele));
+                return self->make_block(std::array{
+                    ref_array::set(*self, stack.get(keys), stack.get(pos), stack.get(key)),
+                    ref_array::set(*self, stack.get(values), stack.get(pos), stack.get(value)),
+                    size_array::set(*self, stack.get(metas), stack.get(pos), stack.get(meta)),
+                });
             };
             auto inc_size = [&]()
             {
                 return table::set<table::hash_size>(*self, stack.get(table), self->binop(BinaryenAddInt32(), stack.get(size), self->const_i32(1)));
             };
+            // assigning nil to a key that is not in the map
+            auto skip_nil = [&]()
+            {
+                return self->make_if(BinaryenRefIsNull(mod, stack.get(value)), self->make_return());
+            };
+            auto self_call = [&]()
+            {
+                expr_ref args[] = {stack.get(table), stack.get(key), stack.get(value)};
+                return BinaryenReturnCall(mod, ((grow ? "*table_set_"s : "*table_init_"s) + type_name(vtype)).c_str(), args, std::size(args), BinaryenTypeNone());
+            };
+            // the keys of a shape are shared, a table writes to its own copy
+            auto shaped = [&](bool add)
+            {
+                auto shared = self->unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, table::get<table::shape>(*self, stack.get(table))));
+                if (add && vtype == value_type::string)
+                {
+                    expr_ref args[] = {stack.get(table), stack.get(key), stack.get(value), stack.get(pos), stack.get(meta)};
+                    return self->make_if(shared, BinaryenReturnCall(mod, "*table_add_shaped", args, std::size(args), BinaryenTypeNone()));
+                }
+                return self->make_if(shared,
+                                     self->make_block(std::array{
+                                         unshape(self)(std::array{stack.get(table)}),
+                                         self_call(),
+                                     }));
+            };
+            // only inserting a new key rehashes, next keeps working when fields are
+            // assigned or cleared during a traversal
+            auto rehash = [&]()
+            {
+                if (!grow)
+                    return BinaryenNop(mod);
+                // if (size + 1 > capacity * max_load_factor || size < capacity * min_load_factor),
+                // with load factors of 0.8 and 0.125
+                auto full   = self->binop(BinaryenGtUInt32(),
+                                          self->binop(BinaryenMulInt32(), self->binop(BinaryenAddInt32(), stack.get(size), self->const_i32(1)), self->const_i32(5)),
+                                          self->binop(BinaryenMulInt32(), stack.get(capacity), self->const_i32(4)));
+                auto sparse = self->binop(BinaryenAndInt32(),
+                                          self->binop(BinaryenGtUInt32(), stack.get(capacity), self->const_i32(min_shrink_capacity)),
+                                          self->binop(BinaryenLtUInt32(), self->binop(BinaryenMulInt32(), stack.get(size), self->const_i32(8)), stack.get(capacity)));
+                return self->make_if(self->binop(BinaryenOrInt32(), full, sparse),
+                                     self->make_block(std::array{
+                                         // integer keys may move to the array part
+                                         map_resize(self)(std::array{stack.get(table)}),
+                                         self_call(),
+                                     }));
+            };
 
             auto body = std::array{
                 o,
-                // if (size > capacity * max_load_factor)
-                self->make_if(self->binop(BinaryenGtFloat32(), self->unop(BinaryenConvertUInt32ToFloat32(), tee_size), self->binop(BinaryenMulFloat32(), self->unop(BinaryenConvertUInt32ToFloat32(), tee_capacity), BinaryenConst(mod, BinaryenLiteralFloat32(0.8f)))),
-                              self->make_block(std::array{
-                                  // resize
-                                  map_resize_func(std::array{stack.get(table)}),
-                                  stack.set(capacity, self->array_len(stack.tee(hash_map, table::get<table::hash>(*self, stack.get(table))))),
-                              })),
-
-                stack.set(pos, calc_pos(self, stack.get(capacity), tee_hash_value)),
-                stack.set(new_ele, hash_entry::create(*self, std::array{stack.get(key), stack.get(value), stack.get(hash_value)})),
+                stack.set(size, table::get<table::hash_size>(*self, stack.get(table))),
+                stack.set(capacity, self->array_len(stack.tee(metas, table::get<table::hash_meta>(*self, stack.get(table))))),
+                stack.set(keys, table::get<table::hash_keys>(*self, stack.get(table))),
+                stack.set(values, table::get<table::hash_values>(*self, stack.get(table))),
+
+                stack.set(pos, calc_pos(self, stack.get(capacity), stack.tee(meta, meta_of(self, hash(self, vtype)(std::array{stack.get(key)}))))),
+                stack.set(dist, self->const_i32(0)),
                 BinaryenLoop(mod,
                              "+loop",
                              self->make_block(std::array{
-
-                                 self->make_if(BinaryenRefIsNull(mod, stack.tee(ele, hash_array::get(*self, stack.get(hash_map), stack.get(pos)))),
+                                 self->make_if(self->unop(BinaryenEqZInt32(), stack.tee(slot_meta, size_array::get(*self, stack.get(metas), stack.get(pos)))),
                                                self->make_block(std::array{
-                                                   set_ele(),
+                                                   newindex(),
+                                                   skip_nil(),
+                                                   rehash(),
+                                                   shaped(true),
+                                                   set_slot(),
                                                    inc_size(),
                                                    self->make_return(),
                                                })),
-                                 self->make_if(self->binop(BinaryenEqInt32(), stack.get(hash_value), hash_entry::get<hash_entry::hash>(*self, stack.get(ele))),
-                                               self->make_if(self->compare(vtype)(std::array{stack.get(key), hash_entry::get<hash_entry::key>(*self, stack.get(ele))}),
+                                 // same key, only the value changes or the entry is removed
+                                 self->make_if(self->binop(BinaryenEqInt32(), stack.get(meta), stack.get(slot_meta)),
+                                               self->make_if(self->compare(vtype)(std::array{stack.get(key), ref_array::get(*self, stack.get(keys), stack.get(pos))}),
                                                              self->make_block(std::array{
-                                                                 set_ele(),
+                                                                 self->make_if(BinaryenRefIsNull(mod, stack.get(value)),
+                                                                               self->make_block(std::array{
+                                                                                   map_remove(self)(std::array{stack.get(table), stack.get(pos)}),
+                                                                                   self->make_return(),
+                                                                               })),
+                                                                 ref_array::set(*self, stack.get(values), stack.get(pos), stack.get(value)),
                                                                  self->make_return(),
                                                              }))),
-                                 // auto ele_dist = get_distance(hash_map, ele, pos);
-                                 // if (ele_dist < dist)
-                                 self->make_if(self->binop(BinaryenLtUInt32(), stack.tee(ele_dist, get_distance_func(std::array{stack.get(hash_map), stack.get(ele), stack.get(pos)})), stack.get(dist)),
+                                 // if (slot_dist < dist) the new entry takes the slot, the old one moves on
+                                 self->make_if(self->binop(BinaryenLtUInt32(), stack.tee(slot_dist, distance(self, stack, slot_meta, pos, capacity)), stack.get(dist)),
                                                self->make_block(std::array{
-                                                   // swap
-                                                   set_ele(),
+                                                   newindex(),
+                                                   skip_nil(),
+                                                   rehash(),
+                                                   shaped(false),
                                                    inc_size(),
                                                    map_insert_with_hint(self)(std::array{
-                                                                                  stack.get(hash_map),
-                                                                                  stack.get(ele),
-                                                                                  calc_pos(self, stack.get(capacity), self->binop(BinaryenAddInt32(), stack.get(pos), self->const_i32(1))),
-                                                                                  self->binop(BinaryenAddInt32(), stack.get(ele_dist), self->const_i32(1)),
-                                                                              },
-                                                                              true),
+                                                       stack.get(keys),
+                                                       stack.get(values),
+                                                       stack.get(metas),
+                                                       ref_array::get(*self, stack.get(keys), stack.get(pos)),
+                                                       ref_array::get(*self, stack.get(values), stack.get(pos)),
+                                                       stack.get(slot_meta),
+                                                       next_pos(self, stack, pos, capacity),
+                                                       self->binop(BinaryenAddInt32(), stack.get(slot_dist), self->const_i32(1)),
+                                                   }),
+                                                   set_slot(),
+                                                   self->make_return(),
                                                })),
-                                 // pos = calc_pos(pos + 1)
-                                 stack.set(pos, calc_pos(self, stack.get(capacity), self->binop(BinaryenAddInt32(), stack.get(pos), self->const_i32(1)))),
-
-                                 // dist++
+                                 stack.set(pos, next_pos(self, stack, pos, capacity)),
                                  stack.set(dist, self->binop(BinaryenAddInt32(), stack.get(dist), self->const_i32(1))),
-
                                  BinaryenBreak(mod, "+loop", nullptr, nullptr),
-
                              })),
             };
 
             return self->make_block(body);
         };
 
-        return stack.add_function(("*table_set_"s + type_name(vtype)).c_str(), BinaryenTypeNone(), set);
+        if (grow)
+            newindex(self);
+        if (vtype == value_type::string)
+            add_shaped(self);
+        return stack.add_function((grow ? "*table_set_"s : "*table_init_"s) + type_name(vtype), BinaryenTypeNone(), set);
     }
 
-    static auto get(runtime* self, value_type vtype)
+    static auto get(runtime* self, value_type vtype, lookup mode = lookup::value)
     {
         auto mod = self->mod;
 
         runtime::function_stack stack{mod};
 
+        bool find     = mode == lookup::find;
+        bool position = find || mode == lookup::slot;
+        auto name     = get_name(mode, vtype);
+        auto ret_type = position ? self->size_type() : anyref();
+
         auto get = [&](runtime::function_stack& stack)
         {
             auto table = stack.alloc(self->type<value_type::table>(), "table");
             auto key   = stack.alloc(self->type(vtype), "key");
             stack.locals();
+            auto metatable = stack.alloc(self->type<value_type::table>(), "metatable");
+
+            // without a metatable or __index a miss costs a null check and a bit test
+            auto missing = [&]()
+            {
+                if (mode != lookup::value)
+                    return self->make_return(position ? self->const_i32(-1) : self->null());
+                expr_ref args[] = {stack.get(table), stack.get(key)};
+                return self->make_block(std::array{
+                    self->make_if(BinaryenRefIsNull(mod, stack.tee(metatable, table::get<table::metatable>(*self, stack.get(table)))),
+                                  self->make_return(self->null())),
+                    self->make_if(known_absent(self, stack.get(metatable), runtime::event::index),
+                                  self->make_return(self->null())),
+                    BinaryenReturnCall(mod, "*table_index", args, std::size(args), anyref()),
+                });
+            };
+
             auto o = BinaryenNop(mod);
+            if (vtype == value_type::number)
+                // the integer version is built next to it by table_get and table_next
+                o = integral_float_key(self, stack, key, [&](expr_ref integer)
+                                       {
+                                           expr_ref args[] = {stack.get(table), integer};
+                                           return BinaryenReturnCall(mod, get_name(mode, value_type::integer).c_str(), args, std::size(args), ret_type);
+                                       });
             if (vtype == value_type::integer)
             {
-                // TODO check 0xFF00000001
-                auto i     = stack.alloc(self->size_type(), "i");
-                auto tee_i = stack.tee(i, self->binop(BinaryenSubInt32(), self->integer_to_size(integer::get<integer::inner>(*self, stack.get(key))), self->const_i32(1)));
-                o          = self->make_if(self->binop(BinaryenLtUInt32(),
-                                              tee_i,
-                                              self->array_len(table::get<table::array>(*self, stack.get(table)))),
-                                  self->make_return(ref_array::get(*self, table::get<table::array>(*self, stack.get(table)), stack.get(i))));
-                stack.free_local(i);
+                auto index    = stack.alloc(self->integer_type(), "index");
+                auto value    = stack.alloc(anyref(), "value");
+                auto capacity = self->array_len(table::get<table::array>(*self, stack.get(table)));
+                auto slot     = [&]()
+                {
+                    return ref_array::get(*self, table::get<table::array>(*self, stack.get(table)), self->integer_to_size(stack.get(index)));
+                };
+                // keys in the range of the array part are never in the hash part
+                auto in_array = mode == lookup::value ? self->make_block(std::array{
+                                                            self->make_if(self->unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, stack.tee(value, slot()))),
+                                                                          self->make_return(stack.get(value))),
+                                                            missing(),
+                                                        })
+                                                      : self->make_return(position ? self->integer_to_size(stack.get(index)) : slot());
+
+                o = self->make_if(array_index(self, stack, key, index, capacity), in_array);
+                stack.free_local(index);
+                stack.free_local(value);
             }
 
-            auto hash_map   = stack.alloc(self->hash_array_type(), "hash_map");
-            auto hash_value = stack.alloc(self->size_type(), "hash_value");
-            auto dist       = stack.alloc(self->size_type(), "dist");
-            auto pos        = stack.alloc(self->size_type(), "pos");
-            auto ele_dist   = stack.alloc(self->size_type(), "ele_dist");
-            auto ele        = stack.alloc(self->hash_entry_type(), "ele");
-
-            auto tee_hash_map   = stack.tee(hash_map, table::get<table::hash>(*self, stack.get(table)));
-            auto tee_hash_value = stack.tee(hash_value, hash(self, vtype)(std::array{stack.get(key)}));
+            auto metas     = stack.alloc(self->get_type<size_array>(), "metas");
+            auto meta      = stack.alloc(self->size_type(), "meta");
+            auto dist      = stack.alloc(self->size_type(), "dist");
+            auto pos       = stack.alloc(self->size_type(), "pos");
+            auto slot_meta = stack.alloc(self->size_type(), "slot_meta");
+            auto capacity  = stack.alloc(self->size_type(), "capacity");
 
-            auto get_distance_func = get_distance(self);
+            auto found = [&]()
+            {
+                if (find)
+                    return self->make_return(hash_position(self, stack.get(table), stack.get(pos), stack.get(capacity)));
+                if (position)
+                    return self->make_return(stack.get(pos));
+                return self->make_return(ref_array::get(*self, table::get<table::hash_values>(*self, stack.get(table)), stack.get(pos)));
+            };
 
             auto body = std::array{
                 o,
-                stack.set(pos, calc_pos(self, self->array_len(tee_hash_map), tee_hash_value)),
+                stack.set(capacity, self->array_len(stack.tee(metas, table::get<table::hash_meta>(*self, stack.get(table))))),
+                stack.set(pos, calc_pos(self, stack.get(capacity), stack.tee(meta, meta_of(self, hash(self, vtype)(std::array{stack.get(key)}))))),
+                stack.set(dist, self->const_i32(0)),
 
                 BinaryenLoop(mod,
                              "+loop",
                              self->make_block(std::array{
+                                 // an empty slot or an entry closer to its best position ends the probe
+                                 self->make_if(self->unop(BinaryenEqZInt32(), stack.tee(slot_meta, size_array::get(*self, stack.get(metas), stack.get(pos)))),
+                                               missing()),
+                                 self->make_if(self->binop(BinaryenLtUInt32(), distance(self, stack, slot_meta, pos, capacity), stack.get(dist)),
+                                               missing()),
+                                 // the key array is only read when the metadata matches
+                                 self->make_if(self->binop(BinaryenEqInt32(), stack.get(meta), stack.get(slot_meta)),
+                                               self->make_if(self->compare(vtype)(std::array{stack.get(key), ref_array::get(*self, table::get<table::hash_keys>(*self, stack.get(table)), stack.get(pos))}),
+                                                             found())),
+                                 stack.set(pos, next_pos(self, stack, pos, capacity)),
+                                 stack.set(dist, self->binop(BinaryenAddInt32(), stack.get(dist), self->const_i32(1))),
+                                 BinaryenBreak(mod, "+loop", nullptr, nullptr),
+                             })),
+            };
+            return self->make_block(body);
+        };
 
-                                 self->make_if(BinaryenRefIsNull(mod, stack.tee(ele, hash_array::get(*self, stack.get(hash_map), stack.get(pos)))),
-
-                                               self->make_block(std::array{
+        if (mode == lookup::value)
+            index(self);
+        return stack.add_function(name, ret_type, get);
+    }
 
-                                                   // return null;
-                                                   self->make_return(self->null()),
-                                               })),
-                                 // auto ele_dist = get_distance(hash_map, ele, pos);
-                                 // if (ele_dist < dist)
-                                 self->make_if(self->binop(BinaryenLtUInt32(), stack.tee(ele_dist, get_distance_func(std::array{stack.get(hash_map), stack.get(ele), stack.get(pos)})), stack.get(dist)),
-                                               self->make_block(std::array{
-                                                   // return null;
-                                                   self->make_return(self->null()),
+    // the slow path of table_get_field. Metatables and prototypes on the way to an
+    // inherited key are marked so that changing them invalidates the cache
+    static auto field_miss(runtime* self)
+    {
+        auto mod = self->mod;
 
-                                               })),
-                                 // if (ele.hash == hash_value && ele.key == key)
-                                 self->make_if(self->binop(BinaryenEqInt32(), stack.get(hash_value), hash_entry::get<hash_entry::hash>(*self, stack.get(ele))),
-                                               self->make_if(self->compare(vtype)(std::array{stack.get(key), hash_entry::get<hash_entry::key>(*self, stack.get(ele))}),
-                                                             self->make_block(std::array{
-                                                                 // return ele;
-                                                                 self->make_return(hash_entry::get<hash_entry::value>(*self, stack.get(ele))),
-                                                             }))),
-                                 // pos = calc_pos(pos + 1)
-                                 stack.set(pos, calc_pos(self, self->array_len(stack.get(hash_map)), self->binop(BinaryenAddInt32(), stack.get(pos), self->const_i32(1)))),
+        runtime::function_stack stack{mod};
 
-                                 // dist++
-                                 stack.set(dist, self->binop(BinaryenAddInt32(), stack.get(dist), self->const_i32(1))),
+        return stack.add_function("*table_get_field_miss", anyref(), [&](runtime::function_stack& stack)
+                                  {
+                                      auto table = stack.alloc(self->type<value_type::table>(), "table");
+                                      auto key   = stack.alloc(self->type<value_type::string>(), "key");
+                                      auto cache = stack.alloc(self->get_type<field_cache>(), "cache");
+                                      stack.locals();
+                                      auto slot      = stack.alloc(self->size_type(), "slot");
+                                      auto holder    = stack.alloc(self->type<value_type::table>(), "holder");
+                                      auto metatable = stack.alloc(self->type<value_type::table>(), "metatable");
+                                      auto handler   = stack.alloc(anyref(), "handler");
 
-                                 BinaryenBreak(mod, "+loop", nullptr, nullptr),
+                                      auto find = [&](size_t tbl)
+                                      {
+                                          return self->binop(BinaryenNeInt32(),
+                                                             stack.tee(slot, get(self, value_type::string, lookup::slot)(std::array{stack.get(tbl), stack.get(key)})),
+                                                             self->const_i32(-1));
+                                      };
+                                      auto value = [&]()
+                                      {
+                                          return self->make_return(ref_array::get(*self, table::get<table::hash_values>(*self, stack.get(holder)), stack.get(slot)));
+                                      };
+                                      auto mark = [&](size_t tbl)
+                                      {
+                                          return table::set<table::flags>(*self, stack.get(tbl), self->binop(BinaryenOrInt32(), table::get<table::flags>(*self, stack.get(tbl)), self->const_i32(prototype_flag)));
+                                      };
 
-                             })),
+                                      return self->make_block(std::array{
+                                          self->make_if(find(table),
+                                                        self->make_block(std::array{
+                                                            field_cache::set<field_cache::holder>(*self, stack.get(cache), BinaryenRefNull(mod, self->type<value_type::table>())),
+                                                            field_cache::set<field_cache::slot>(*self, stack.get(cache), stack.get(slot)),
+                                                            // the keys of a shape are never written, other tables with them have the key at the same slot
+                                                            field_cache::set<field_cache::keys>(*self,
+                                                                                                stack.get(cache),
+                                                                                                self->make_if(BinaryenRefIsNull(mod, table::get<table::shape>(*self, stack.get(table))),
+                                                                                                              BinaryenRefNull(mod, self->ref_array_type()),
+                                                                                                              table::get<table::hash_keys>(*self, stack.get(table)))),
+                                                            self->make_return(ref_array::get(*self, table::get<table::hash_values>(*self, stack.get(table)), stack.get(slot))),
+                                                        })),
+                                          stack.set(holder, stack.get(table)),
+                                          BinaryenLoop(mod,
+                                                       "+chain",
+                                                       self->make_block(std::array{
+                                                           self->make_if(BinaryenRefIsNull(mod, stack.tee(metatable, table::get<table::metatable>(*self, stack.get(holder)))),
+                                                                         self->make_return(self->null())),
+                                                           self->make_if(BinaryenRefIsNull(mod, stack.tee(handler, self->metamethod(stack.get(metatable), runtime::event::index))),
+                                                                         self->make_return(self->null())),
+                                                           // functions are called every time, only table chains are cached
+                                                           self->make_if(self->unop(BinaryenEqZInt32(), BinaryenRefTest(mod, stack.get(handler), self->type<value_type::table>())),
+                                                                         self->make_return(self->first_result(self->call(functions::invoke,
+                                                                                                                         std::array{
+                                                                                                                             stack.get(handler),
+                                                                                                                             ref_array::create_fixed(*self, std::array{stack.get(holder), stack.get(key)}),
+                                                                                                                         })))),
+                                                           mark(metatable),
+                                                           stack.set(holder, BinaryenRefCast(mod, stack.get(handler), self->type<value_type::table>())),
+                                                           mark(holder),
+                                                           self->make_if(find(holder),
+                                                                         self->make_block(std::array{
+                                                                             field_cache::set<field_cache::holder>(*self, stack.get(cache), stack.get(holder)),
+                                                                             field_cache::set<field_cache::metatable>(*self, stack.get(cache), table::get<table::metatable>(*self, stack.get(table))),
+                                                                             field_cache::set<field_cache::slot>(*self, stack.get(cache), stack.get(slot)),
+                                                                             field_cache::set<field_cache::epoch>(*self, stack.get(cache), field_epoch(self)),
+                                                                             field_cache::set<field_cache::keys>(*self, stack.get(cache), BinaryenRefNull(mod, self->ref_array_type())),
+                                                                             value(),
+                                                                         })),
+                                                           BinaryenBreak(mod, "+chain", nullptr, nullptr),
+                                                       })),
+                                      });
+                                  });
+    }
 
-            };
-            return self->make_block(body);
-        };
+    // positions used by next: the array part is 0 .. n - 1, the hash part has the top
+    // bit set and counts from the slot after next_start. The hash part never shrinks
+    // during a traversal, and backward shift deletion only moves entries towards
+    // next_start as the empty slot stops every shift
+    static constexpr int32_t hash_position_bit = std::numeric_limits<int32_t>::min();
 
-        return stack.add_function(("*table_get_"s + type_name(vtype)).c_str(), anyref(), get);
+    static expr_ref hash_position(runtime* self, expr_ref tbl, expr_ref slot, expr_ref capacity)
+    {
+        // ((slot - next_start - 1) & (capacity - 1)) | hash_position_bit
+        return self->binop(BinaryenOrInt32(),
+                           calc_pos(self,
+                                    capacity,
+                                    self->binop(BinaryenSubInt32(),
+                                                self->binop(BinaryenSubInt32(), slot, table::get<table::next_start>(*self, tbl)),
+                                                self->const_i32(1))),
+                           self->const_i32(hash_position_bit));
     }
 };
 
 build_return_t runtime::table_create_array()
 {
-    return {std::vector<BinaryenType>{},
+    auto capacity = [&]()
+    {
+        return local_get(2, size_type());
+    };
+    auto empty = [&]()
+    {
+        return unop(BinaryenEqZInt32(), local_get(1, size_type()));
+    };
+    return {std::vector<BinaryenType>{size_type()},
             make_block(std::array{
+                local_set(2, hash_capacity(this, local_get(1, size_type()))),
                 table::create(*this, std::array{
                                          local_get(0, ref_array_type()),
-                                         hash_array::create_fixed(*this, std::array{null()}),
+                                         make_if(empty(), empty_part(this, "*empty_keys", ref_array_type(), 1), ref_array::create(*this, capacity())),
+                                         make_if(empty(), empty_part(this, "*empty_values", ref_array_type(), 1), ref_array::create(*this, capacity())),
+                                         make_if(empty(), empty_part(this, "*empty_metas", get_type<size_array>(), 1), size_array::create(*this, capacity())),
+                                         const_i32(0),
+                                         null(),
+                                         const_i32(0),
+                                         const_i32(0),
+                                         const_i32(0),
+                                         const_i32(0),
                                          const_i32(0),
                                          null(),
                                      }),
@@ -450,31 +1338,100 @@ build_return_t runtime::table_create_array()
 
 build_return_t runtime::table_create_map()
 {
-    return {std::vector<BinaryenType>{},
+    auto capacity = [&]()
+    {
+        return local_get(1, size_type());
+    };
+    auto empty = [&]()
+    {
+        return unop(BinaryenEqZInt32(), local_get(0, size_type()));
+    };
+    return {std::vector<BinaryenType>{size_type()},
             make_block(std::array{
+                local_set(1, hash_capacity(this, local_get(0, size_type()))),
                 table::create(*this, std::array{
+                                         empty_part(this, "*empty_array", ref_array_type(), 0),
+                                         make_if(empty(), empty_part(this, "*empty_keys", ref_array_type(), 1), ref_array::create(*this, capacity())),
+                                         make_if(empty(), empty_part(this, "*empty_values", ref_array_type(), 1), ref_array::create(*this, capacity())),
+                                         make_if(empty(), empty_part(this, "*empty_metas", get_type<size_array>(), 1), size_array::create(*this, capacity())),
+                                         const_i32(0),
                                          null(),
-                                         hash_array::create(*this, const_i32(2) /*local_get(0, size_type())*/),
+                                         const_i32(0),
+                                         const_i32(0),
+                                         const_i32(0),
+                                         const_i32(0),
                                          const_i32(0),
                                          null(),
                                      }),
             })};
 }
 
-build_return_t runtime::table_set()
+build_return_t runtime::table_create_shaped()
 {
-    auto table = local_get(0, anyref());
-    auto key   = local_get(1, anyref());
-    auto value = local_get(2, anyref());
-    table      = BinaryenRefCast(mod, table, type<value_type::table>());
+    auto root = [&]()
+    {
+        return local_get(0, get_type<shape>());
+    };
+    return {std::vector<BinaryenType>{},
+            table::create(*this, std::array{
+                                     empty_part(this, "*empty_array", ref_array_type(), 0),
+                                     shape::get<shape::keys>(*this, root()),
+                                     empty_part(this, "*empty_array", ref_array_type(), 0),
+                                     shape::get<shape::metas>(*this, root()),
+                                     const_i32(0),
+                                     null(),
+                                     const_i32(0),
+                                     const_i32(0),
+                                     const_i32(0),
+                                     const_i32(0),
+                                     const_i32(0),
+                                     root(),
+                                 })};
+}
 
+build_return_t runtime::table_init()
+{
     auto casts = std::array{
-        value_type::number,
-        value_type::integer,
         value_type::string,
     };
     return {std::vector<BinaryenType>{},
-            make_block(switch_value(key, casts, [&](value_type type, expr_ref exp)
+            make_block(switch_value(local_get(1, anyref()), casts, [&](value_type type, expr_ref exp)
+                                    {
+                                        if (type == value_type::string)
+                                            return tbl::set(this, type, false)(std::array{local_get(0, get_type<table>()), exp, local_get(2, anyref())}, true);
+                                        return make_block(std::array{
+                                            call(functions::table_set, std::array{local_get(0, get_type<table>()), local_get(1, anyref()), local_get(2, anyref())}),
+                                            make_return(),
+                                        });
+                                    }))};
+}
+
+// every key type has its own *table_set_* and *table_get_*
+static constexpr std::array key_types = {
+    value_type::number,
+    value_type::integer,
+    value_type::string,
+    value_type::boolean,
+    value_type::table,
+    value_type::function,
+    value_type::userdata,
+    value_type::thread,
+};
+
+build_return_t runtime::table_set()
+{
+    auto table = [&]()
+    {
+        return BinaryenRefCast(mod, local_get(0, anyref()), type<value_type::table>());
+    };
+    auto key   = local_get(1, anyref());
+    auto value = [&]()
+    {
+        return local_get(2, anyref());
+    };
+
+    return {std::vector<BinaryenType>{},
+            make_block(switch_value(key, key_types, [&](value_type type, expr_ref exp)
                                     {
                                         switch (type)
                                         {
@@ -487,9 +1444,10 @@ build_return_t runtime::table_set()
                                         case value_type::thread:
                                         case value_type::table:
 
-                                            return tbl::set(this, type)(std::array{table, exp, value}, true);
-                                        default:
+                                            return tbl::set(this, type)(std::array{table(), exp, value()}, true);
                                         case value_type::nil:
+                                            return throw_error(add_string("table index is nil"));
+                                        default:
                                             return BinaryenUnreachable(mod);
                                         }
                                     }))};
@@ -497,19 +1455,15 @@ build_return_t runtime::table_set()
 
 build_return_t runtime::table_get()
 {
-    auto table = local_get(0, anyref());
-    auto key   = local_get(1, anyref());
-    table      = BinaryenRefCast(mod, table, type<value_type::table>());
-
-    auto casts = std::array{
-        value_type::number,
-        value_type::integer,
-        value_type::string,
+    auto table = [&]()
+    {
+        return BinaryenRefCast(mod, local_get(0, anyref()), type<value_type::table>());
     };
+    auto key = local_get(1, anyref());
 
     return {std::vector<BinaryenType>{},
             make_block(switch_value(key,
-                                    casts,
+                                    key_types,
                                     [&](value_type type, expr_ref exp)
                                     {
                                         switch (type)
@@ -522,11 +1476,419 @@ build_return_t runtime::table_get()
                                         case value_type::userdata:
                                         case value_type::thread:
                                         case value_type::table:
-                                            return tbl::get(this, type)(std::array{table, exp}, true);
-                                        default:
+                                            return tbl::get(this, type)(std::array{table(), exp}, true);
                                         case value_type::nil:
+                                            return make_return(null());
+                                        default:
                                             return BinaryenUnreachable(mod);
                                         }
                                     }))};
 }
+
+// the field of the metatable or null. A missing field sets its bit in the flags of the
+// metatable, following lookups only test the bit until a string key is assigned to it
+expr_ref runtime::metamethod(expr_ref metatable, event e)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function("*metamethod", anyref(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto table = stack.alloc(get_type<runtime::table>(), "metatable");
+                                       auto bit   = stack.alloc(size_type(), "bit");
+                                       auto name  = stack.alloc(type<value_type::string>(), "name");
+                                       stack.locals();
+                                       auto value = stack.alloc(anyref(), "value");
+
+                                       auto flags = [&]()
+                                       {
+                                           return table::get<table::flags>(*this, stack.get(table));
+                                       };
+                                       return make_block(std::array{
+                                           make_if(BinaryenRefIsNull(mod, stack.get(table)),
+                                                   make_return(null())),
+                                           make_if(binop(BinaryenAndInt32(), flags(), stack.get(bit)),
+                                                   make_return(null())),
+                                           make_if(BinaryenRefIsNull(mod, stack.tee(value, tbl::get(this, value_type::string, tbl::lookup::raw)(std::array{stack.get(table), stack.get(name)}))),
+                                                   table::set<table::flags>(*this, stack.get(table), binop(BinaryenOrInt32(), flags(), stack.get(bit)))),
+                                           make_return(stack.get(value)),
+                                       });
+                                   });
+
+    return func(std::array{metatable, tbl::event_bit(this, e), add_string(event_names[static_cast<size_t>(e)])});
+}
+
+// only tables carry a metatable
+expr_ref runtime::metatable_of(expr_ref value)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function("*metatable_of", get_type<runtime::table>(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto value = stack.alloc(anyref(), "value");
+                                       stack.locals();
+
+                                       return make_if(BinaryenRefTest(mod, stack.get(value), type<value_type::table>()),
+                                                      table::get<table::metatable>(*this, BinaryenRefCast(mod, stack.get(value), type<value_type::table>())),
+                                                      BinaryenRefNull(mod, get_type<runtime::table>()));
+                                   });
+
+    return func(std::array{value});
+}
+
+expr_ref runtime::prototype_changed(expr_ref tbl)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function("*prototype_changed", BinaryenTypeNone(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto table = stack.alloc(get_type<runtime::table>(), "table");
+                                       stack.locals();
+
+                                       return make_if(binop(BinaryenAndInt32(), table::get<table::flags>(*this, stack.get(table)), const_i32(prototype_flag)),
+                                                      BinaryenGlobalSet(mod, "*field_epoch", binop(BinaryenAddInt32(), field_epoch(this), const_i32(1))));
+                                   });
+
+    return func(std::array{tbl});
+}
+
+// obj.name with a constant name. A table with the keys of the shape the key was found
+// with has it at the cached slot. Otherwise a key of the table itself is checked at the
+// cached slot, an inherited key needs the same metatable, an unchanged field_epoch, the key still
+// at the cached slot of the prototype and a miss in the table
+build_return_t runtime::table_get_field()
+{
+    auto object = [&]()
+    {
+        return local_get(0, anyref());
+    };
+    auto key = [&]()
+    {
+        return local_get(1, type<value_type::string>());
+    };
+    auto cache = [&]()
+    {
+        return local_get(2, get_type<field_cache>());
+    };
+    auto table = [&]()
+    {
+        return local_get(3, get_type<runtime::table>());
+    };
+    auto slot = [&]()
+    {
+        return local_get(4, size_type());
+    };
+    auto holder = [&]()
+    {
+        return local_get(5, get_type<runtime::table>());
+    };
+    // slot < capacity && keys[slot] == key, the slot may be empty or hold another type of key
+    auto key_at = [&](expr_ref tbl, expr_ref then)
+    {
+        return make_if(binop(BinaryenLtUInt32(), slot(), array_len(table::get<table::hash_keys>(*this, tbl))),
+                       make_if(BinaryenRefTest(mod, local_tee(6, ref_array::get(*this, table::get<table::hash_keys>(*this, tbl), slot()), anyref()), type<value_type::string>()),
+                               make_if(compare(value_type::string)(std::array{key(), local_get(6, anyref())}),
+                                       then)));
+    };
+    auto value_at = [&](expr_ref tbl)
+    {
+        return make_return(ref_array::get(*this, table::get<table::hash_values>(*this, tbl), slot()));
+    };
+    auto same_metatable = [&]()
+    {
+        return BinaryenRefEq(mod, table::get<table::metatable>(*this, table()), field_cache::get<field_cache::metatable>(*this, cache()));
+    };
+    expr_ref generic[] = {object(), key()};
+    expr_ref miss[]    = {table(), key(), cache()};
+    tbl::field_miss(this);
+
+    return {std::vector<BinaryenType>{get_type<runtime::table>(), size_type(), get_type<runtime::table>(), anyref()},
+            make_block(std::array{
+                make_if(unop(BinaryenEqZInt32(), BinaryenRefTest(mod, object(), type<value_type::table>())),
+                        BinaryenReturnCall(mod, require(functions::table_get).name, generic, std::size(generic), anyref())),
+                local_set(3, BinaryenRefCast(mod, object(), type<value_type::table>())),
+                local_set(4, field_cache::get<field_cache::slot>(*this, cache())),
+                make_if(BinaryenRefEq(mod, table::get<table::hash_keys>(*this, table()), field_cache::get<field_cache::keys>(*this, cache())),
+                        value_at(table())),
+                make_if(BinaryenRefIsNull(mod, local_tee(5, field_cache::get<field_cache::holder>(*this, cache()), get_type<runtime::table>())),
+                        key_at(table(), value_at(table())),
+                        make_if(same_metatable(),
+                                make_if(binop(BinaryenEqInt32(), field_cache::get<field_cache::epoch>(*this, cache()), field_epoch(this)),
+                                        key_at(holder(),
+                                               make_if(BinaryenRefIsNull(mod, tbl::get(this, value_type::string, tbl::lookup::raw)(std::array{table(), key()})),
+                                                       value_at(holder())))))),
+                BinaryenReturnCall(mod, "*table_get_field_miss", miss, std::size(miss), anyref()),
+            })};
+}
+
+// a border of the table for #. The border found last is kept in the table, appending
+// or removing at the end only moves it by one and is checked first. Otherwise it is a
+// binary search in the array part when its last slot is empty, or an unbound search
+// into the hash part like luaH_getn
+expr_ref runtime::table_border(expr_ref tbl)
+{
+    runtime::function_stack stack{mod};
+
+    auto func = stack.add_function("*table_border", size_type(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto table = stack.alloc(get_type<runtime::table>(), "table");
+                                       stack.locals();
+
+                                       auto array  = stack.alloc(ref_array_type(), "array");
+                                       auto lo     = stack.alloc(size_type(), "lo");
+                                       auto hi     = stack.alloc(size_type(), "hi");
+                                       auto mid    = stack.alloc(size_type(), "mid");
+                                       auto length = stack.alloc(size_type(), "length");
+                                       auto hint   = stack.alloc(size_type(), "hint");
+
+                                       auto empty = [&](expr_ref i)
+                                       {
+                                           return BinaryenRefIsNull(mod, ref_array::get(*this, stack.get(array), i));
+                                       };
+                                       auto get   = tbl::get(this, value_type::integer, tbl::lookup::raw);
+                                       auto empty_key = [&](size_t i)
+                                       {
+                                           return BinaryenRefIsNull(mod, get(std::array{stack.get(table), new_integer(size_to_integer(stack.get(i)))}));
+                                       };
+                                       auto found = [&](size_t border)
+                                       {
+                                           return make_block(std::array{
+                                               table::set<table::border>(*this, stack.get(table), stack.get(border)),
+                                               make_return(stack.get(border)),
+                                           });
+                                       };
+                                       // i < length, t[i] is not nil (or i is 0) and t[i + 1] is nil
+                                       auto try_array = [&](expr_ref i)
+                                       {
+                                           return make_if(binop(BinaryenLtUInt32(), stack.tee(mid, i), stack.get(length)),
+                                                          make_if(make_if(make_if(stack.get(mid), unop(BinaryenEqZInt32(), empty(binop(BinaryenSubInt32(), stack.get(mid), const_i32(1)))), const_i32(1)),
+                                                                          empty(stack.get(mid)),
+                                                                          const_i32(0)),
+                                                                  found(mid)));
+                                       };
+
+                                       return make_block(std::array{
+                                           stack.set(length, array_len(stack.tee(array, table::get<table::array>(*this, stack.get(table))))),
+                                           stack.set(hint, table::get<table::border>(*this, stack.get(table))),
+                                           make_if(binop(BinaryenLeUInt32(), stack.get(hint), stack.get(length)),
+                                                   make_block(std::array{
+                                                       try_array(stack.get(hint)),
+                                                       try_array(binop(BinaryenAddInt32(), stack.get(hint), const_i32(1))),
+                                                       try_array(binop(BinaryenSubInt32(), stack.get(hint), const_i32(1))),
+                                                   }),
+                                                   // a border in the hash part
+                                                   make_if(unop(BinaryenEqZInt32(), empty_key(hint)),
+                                                           make_if(make_block(std::array{
+                                                                       stack.set(mid, binop(BinaryenAddInt32(), stack.get(hint), const_i32(1))),
+                                                                       empty_key(mid),
+                                                                   }),
+                                                                   found(hint)))),
+
+                                           stack.set(hi, stack.get(length)),
+                                           make_if(make_if(stack.get(hi), empty(binop(BinaryenSubInt32(), stack.get(hi), const_i32(1))), const_i32(0)),
+                                                   make_block(std::array{
+                                                       // slot lo - 1 has a value (or lo is 0), slot hi - 1 is empty
+                                                       BinaryenLoop(mod,
+                                                                    "+search",
+                                                                    make_if(binop(BinaryenGtUInt32(), binop(BinaryenSubInt32(), stack.get(hi), stack.get(lo)), const_i32(1)),
+                                                                            make_block(std::array{
+                                                                                stack.set(mid, binop(BinaryenShrUInt32(), binop(BinaryenAddInt32(), stack.get(lo), stack.get(hi)), const_i32(1))),
+                                                                                make_if(empty(binop(BinaryenSubInt32(), stack.get(mid), const_i32(1))),
+                                                                                        stack.set(hi, stack.get(mid)),
+                                                                                        stack.set(lo, stack.get(mid))),
+                                                                                BinaryenBreak(mod, "+search", nullptr, nullptr),
+                                                                            }))),
+                                                       found(lo),
+                                                   })),
+
+                                           // t[lo] is not nil (or lo is 0), double hi until t[hi] is nil
+                                           stack.set(lo, stack.get(hi)),
+                                           stack.set(hi, binop(BinaryenAddInt32(), stack.get(hi), const_i32(1))),
+                                           BinaryenLoop(mod,
+                                                        "+unbound",
+                                                        make_if(unop(BinaryenEqZInt32(), empty_key(hi)),
+                                                                make_block(std::array{
+                                                                    stack.set(lo, stack.get(hi)),
+                                                                    stack.set(hi, binop(BinaryenShlInt32(), stack.get(hi), const_i32(1))),
+                                                                    BinaryenBreak(mod, "+unbound", nullptr, nullptr),
+                                                                }))),
+                                           // then a binary search between lo and hi
+                                           BinaryenLoop(mod,
+                                                        "+hash",
+                                                        make_if(binop(BinaryenGtUInt32(), binop(BinaryenSubInt32(), stack.get(hi), stack.get(lo)), const_i32(1)),
+                                                                make_block(std::array{
+                                                                    stack.set(mid, binop(BinaryenShrUInt32(), binop(BinaryenAddInt32(), stack.get(lo), stack.get(hi)), const_i32(1))),
+                                                                    make_if(empty_key(mid),
+                                                                            stack.set(hi, stack.get(mid)),
+                                                                            stack.set(lo, stack.get(mid))),
+                                                                    BinaryenBreak(mod, "+hash", nullptr, nullptr),
+                                                                }))),
+                                           found(lo),
+                                       });
+                                   });
+    return func(std::array{tbl});
+}
+
+// next without a lookup per step: the position of the key returned last is kept in the
+// table and only looked up again when another key is passed, e.g. by a nested traversal.
+// A key that was removed during the traversal resumes at the kept position, backward
+// shift deletion moved the following entry there
+expr_ref runtime::table_next(expr_ref tbl, expr_ref key)
+{
+    runtime::function_stack stack{mod};
+
+    auto find = stack.add_function("*table_find", size_type(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto table = stack.alloc(get_type<runtime::table>(), "table");
+                                       auto key   = stack.alloc(anyref(), "key");
+                                       stack.locals();
+                                       return make_block(switch_value(stack.get(key), key_types, [&](value_type type, expr_ref exp)
+                                                                      {
+                                                                          if (type == value_type::nil || exp == nullptr)
+                                                                              return BinaryenUnreachable(mod);
+                                                                          return tbl::get(this, type, tbl::lookup::find)(std::array{stack.get(table), exp}, true);
+                                                                      }),
+                                                         nullptr,
+                                                         size_type());
+                                   });
+
+    auto func = stack.add_function("*table_next", ref_array_type(), [&](runtime::function_stack& stack)
+                                   {
+                                       auto table = stack.alloc(get_type<runtime::table>(), "table");
+                                       auto key   = stack.alloc(anyref(), "key");
+                                       stack.locals();
+
+                                       auto array    = stack.alloc(ref_array_type(), "array");
+                                       auto metas    = stack.alloc(get_type<size_array>(), "metas");
+                                       auto capacity = stack.alloc(size_type(), "capacity");
+                                       auto position = stack.alloc(size_type(), "position");
+                                       auto cursor   = stack.alloc(size_type(), "cursor");
+                                       auto slot     = stack.alloc(size_type(), "slot");
+
+                                       auto eq = [&](expr_ref value)
+                                       {
+                                           return BinaryenRefCast(mod, value, BinaryenTypeFromHeapType(BinaryenHeapTypeEq(), true));
+                                       };
+                                       // slot of a hash position
+                                       auto hash_slot = [&](expr_ref position)
+                                       {
+                                           return tbl::calc_pos(this,
+                                                                stack.get(capacity),
+                                                                binop(BinaryenAddInt32(),
+                                                                      binop(BinaryenAddInt32(), table::get<table::next_start>(*this, stack.get(table)), const_i32(1)),
+                                                                      position));
+                                       };
+                                       auto without_bit = [&](size_t local)
+                                       {
+                                           return binop(BinaryenAndInt32(), stack.get(local), const_i32(~tbl::hash_position_bit));
+                                       };
+                                       auto inc = [&](size_t local)
+                                       {
+                                           return stack.set(local, binop(BinaryenAddInt32(), stack.get(local), const_i32(1)));
+                                       };
+                                       auto result = [&](expr_ref k, expr_ref v)
+                                       {
+                                           return make_block(std::array{
+                                               table::set<table::next_index>(*this, stack.get(table), stack.get(position)),
+                                               make_return(ref_array::create_fixed(*this, std::array{k, v})),
+                                           });
+                                       };
+
+                                       // the key returned last, in the array part it is the integer position + 1
+                                       auto is_cursor = make_if(binop(BinaryenAndInt32(), stack.get(cursor), const_i32(tbl::hash_position_bit)),
+                                                                make_if(binop(BinaryenLtUInt32(), without_bit(cursor), stack.get(capacity)),
+                                                                        BinaryenRefEq(mod, eq(ref_array::get(*this, table::get<table::hash_keys>(*this, stack.get(table)), hash_slot(without_bit(cursor)))), eq(stack.get(key))),
+                                                                        const_i32(0)),
+                                                                make_if(is_integer(stack.get(key)),
+                                                                        eq_int(unbox_integer(stack.get(key)), size_to_integer(binop(BinaryenAddInt32(), stack.get(cursor), const_i32(1)))),
+                                                                        const_i32(0)));
+
+                                       return make_block(std::array{
+                                           stack.set(array, table::get<table::array>(*this, stack.get(table))),
+                                           stack.set(capacity, array_len(stack.tee(metas, table::get<table::hash_meta>(*this, stack.get(table))))),
+                                           make_if(BinaryenRefIsNull(mod, stack.get(key)),
+                                                   make_block(std::array{
+                                                       // the hash part is traversed starting after its first empty slot
+                                                       BinaryenLoop(mod,
+                                                                    "+start",
+                                                                    make_if(binop(BinaryenLtUInt32(), stack.get(slot), stack.get(capacity)),
+                                                                            make_if(size_array::get(*this, stack.get(metas), stack.get(slot)),
+                                                                                    make_block(std::array{
+                                                                                        inc(slot),
+                                                                                        BinaryenBreak(mod, "+start", nullptr, nullptr),
+                                                                                    })))),
+                                                       table::set<table::next_start>(*this, stack.get(table), stack.get(slot)),
+                                                   }),
+                                                   make_if(make_block(std::array{
+                                                               stack.set(cursor, table::get<table::next_index>(*this, stack.get(table))),
+                                                               is_cursor,
+                                                           }),
+                                                           stack.set(position, binop(BinaryenAddInt32(), stack.get(cursor), const_i32(1))),
+                                                           make_if(binop(BinaryenEqInt32(), stack.tee(position, find(std::array{stack.get(table), stack.get(key)})), const_i32(-1)),
+                                                                   stack.set(position, stack.get(cursor)),
+                                                                   inc(position)))),
+
+                                           // array part
+                                           BinaryenLoop(mod,
+                                                        "+array",
+                                                        make_if(binop(BinaryenLtUInt32(), stack.get(position), array_len(stack.get(array))),
+                                                                make_block(std::array{
+                                                                    make_if(unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, ref_array::get(*this, stack.get(array), stack.get(position)))),
+                                                                            result(new_integer(size_to_integer(binop(BinaryenAddInt32(), stack.get(position), const_i32(1)))),
+                                                                                   ref_array::get(*this, stack.get(array), stack.get(position)))),
+                                                                    inc(position),
+                                                                    BinaryenBreak(mod, "+array", nullptr, nullptr),
+                                                                }))),
+
+                                           // hash part
+                                           stack.set(position,
+                                                     BinaryenSelect(mod,
+                                                                    binop(BinaryenAndInt32(), stack.get(position), const_i32(tbl::hash_position_bit)),
+                                                                    stack.get(position),
+                                                                    const_i32(tbl::hash_position_bit),
+                                                                    size_type())),
+                                           BinaryenLoop(mod,
+                                                        "+hash",
+                                                        make_if(binop(BinaryenLtUInt32(), without_bit(position), stack.get(capacity)),
+                                                                make_block(std::array{
+                                                                    make_if(size_array::get(*this, stack.get(metas), stack.tee(slot, hash_slot(without_bit(position)))),
+                                                                            result(ref_array::get(*this, table::get<table::hash_keys>(*this, stack.get(table)), stack.get(slot)),
+                                                                                   ref_array::get(*this, table::get<table::hash_values>(*this, stack.get(table)), stack.get(slot)))),
+                                                                    inc(position),
+                                                                    BinaryenBreak(mod, "+hash", nullptr, nullptr),
+                                                                }))),
+                                           ref_array::create_fixed(*this, null()),
+                                       });
+                                   });
+    return func(std::array{tbl, key});
+}
+
+build_return_t runtime::intern_string()
+{
+    const char* interned = "*interned";
+    if (!BinaryenGetGlobal(mod, interned))
+        BinaryenAddGlobal(mod, interned, get_type<table>(), true, null());
+
+    auto str = [&]()
+    {
+        return local_get(0, type<value_type::string>());
+    };
+    auto map = [&]()
+    {
+        return BinaryenGlobalGet(mod, interned, get_type<table>());
+    };
+
+    return {std::vector<BinaryenType>{
+                anyref(),
+            },
+            make_block(std::array{
+                make_if(binop(BinaryenGtUInt32(), string_length(str()), const_i32(max_interned_length)),
+                        make_return(str())),
+                make_if(BinaryenRefIsNull(mod, map()),
+                        BinaryenGlobalSet(mod, interned, call(functions::table_create_map, const_i32(0)))),
+                make_if(unop(BinaryenEqZInt32(), BinaryenRefIsNull(mod, local_tee(1, tbl::get(this, value_type::string, tbl::lookup::raw)(std::array{map(), str()}), anyref()))),
+                        make_return(BinaryenRefCast(mod, local_get(1, anyref()), type<value_type::string>()))),
+                tbl::set(this, value_type::string)(std::array{map(), str(), str()}),
+                make_return(str()),
+            })};
+}
 } // namespace wumbo
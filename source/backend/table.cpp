@@ -12,6 +12,49 @@ expr_ref compiler::table_get(expr_ref table, expr_ref key)
                          });
 }
 
+// every lookup of a constant key has its own cache, see runtime::table_get_field.
+// A table with the keys the cache was filled with is read here without a call
+expr_ref compiler::table_get_field(expr_ref table, const name_t& name)
+{
+    auto label = "+field" + std::to_string(field_caches);
+    auto cache = "*field_cache" + std::to_string(field_caches++);
+    auto type  = get_type<field_cache>();
+    BinaryenAddGlobal(mod,
+                      cache.c_str(),
+                      type,
+                      false,
+                      field_cache::create(*this, std::array{
+                                                     BinaryenRefNull(mod, get_type<ext_types::table>()),
+                                                     BinaryenRefNull(mod, get_type<ext_types::table>()),
+                                                     const_i32(0),
+                                                     const_i32(0),
+                                                     BinaryenRefNull(mod, ref_array_type()),
+                                                 }));
+    auto get_cache = [&]()
+    {
+        return BinaryenGlobalGet(mod, cache.c_str(), type);
+    };
+    auto object = help_var_scope{_func_stack, anyref()};
+    auto cast   = [&]()
+    {
+        return BinaryenRefCast(mod, local_get(object, anyref()), get_type<ext_types::table>());
+    };
+    return make_block(std::array{
+        local_set(object, table),
+        make_if(BinaryenRefTest(mod, local_get(object, anyref()), get_type<ext_types::table>()),
+                make_if(BinaryenRefEq(mod, ext_types::table::get<ext_types::table::hash_keys>(*this, cast()), field_cache::get<field_cache::keys>(*this, get_cache())),
+                        BinaryenBreak(mod, label.c_str(), ref_array::get(*this, ext_types::table::get<ext_types::table::hash_values>(*this, cast()), field_cache::get<field_cache::slot>(*this, get_cache())), nullptr))),
+        _runtime.call(functions::table_get_field,
+                      std::array{
+                          local_get(object, anyref()),
+                          add_string(name),
+                          get_cache(),
+                      }),
+    },
+                      label.c_str(),
+                      anyref());
+}
+
 expr_ref compiler::table_set(expr_ref table, expr_ref key, expr_ref value)
 {
     return _runtime.call(functions::table_set,
@@ -28,6 +71,18 @@ expr_ref compiler::operator()(const table_constructor& p)
     expression_list array_init;
     auto tbl = help_var_scope{_func_stack, get_type<table>()};
     exp.push_back(nullptr);
+
+    // the hash part is presized for all keyed fields, so fields with a
+    // literal string key are inserted without checking for growth
+    auto init_field = [&](const std::string& key, const expression& value)
+    {
+        exp.push_back(_runtime.call(functions::table_init,
+                                    std::array{
+                                        local_get(tbl, get_type<table>()),
+                                        add_string(key),
+                                        (*this)(value),
+                                    }));
+    };
     for (auto& field : p)
     {
         std::visit(overload{
@@ -37,27 +92,50 @@ expr_ref compiler::operator()(const table_constructor& p)
                        },
                        [&](const expression& index)
                        {
-                           exp.push_back(table_set(local_get(tbl, get_type<table>()), (*this)(index), (*this)(field.value)));
+                           if (auto str = std::get_if<literal>(&index.inner))
+                               init_field(str->str, field.value);
+                           else
+                               exp.push_back(table_set(local_get(tbl, get_type<table>()), (*this)(index), (*this)(field.value)));
                        },
                        [&](const name_t& name)
                        {
-                           exp.push_back(table_set(local_get(tbl, get_type<table>()), add_string(name), (*this)(field.value)));
+                           init_field(name, field.value);
                        },
                    },
                    field.index);
     }
 
+    auto hash_count = const_i32(exp.size() - 1);
     if (!array_init.empty())
     {
         auto array = (*this)(array_init);
         exp[0]     = local_set(tbl, _runtime.call(functions::table_create_array, std::array{
                                                                                  array,
+                                                                                 hash_count,
                                                                              }));
     }
     else
-        exp[0] = local_set(tbl, _runtime.call(functions::table_create_map, std::array{
-                                                                               const_i32(exp.size() - 1),
-                                                                           }));
+    {
+        // tables from the same constructor start with the same shape and share their keys
+        // for as long as the keys are added in the same order
+        auto root     = "*shape" + std::to_string(shapes++);
+        auto capacity = const_i32(runtime::shape_capacity(static_cast<int32_t>(exp.size() - 1)));
+        BinaryenAddGlobal(mod,
+                          root.c_str(),
+                          get_type<shape>(),
+                          false,
+                          shape::create(*this, std::array{
+                                                   BinaryenArrayNew(mod, BinaryenTypeGetHeapType(ref_array_type()), capacity, nullptr),
+                                                   BinaryenArrayNew(mod, BinaryenTypeGetHeapType(get_type<size_array>()), capacity, nullptr),
+                                                   const_i32(0),
+                                                   BinaryenRefNull(mod, type<value_type::string>()),
+                                                   const_i32(0),
+                                                   BinaryenRefNull(mod, get_type<shape>()),
+                                               }));
+        exp[0] = local_set(tbl, _runtime.call(functions::table_create_shaped, std::array{
+                                                                                  BinaryenGlobalGet(mod, root.c_str(), get_type<shape>()),
+                                                                              }));
+    }
     exp.push_back(local_get(tbl, get_type<table>()));
     return make_block(exp);
 }
@@ -3,9 +3,12 @@
 #include "binaryen-c.h"
 
 #include <array>
+#include <bit>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
 #include <variant>
 #include <vector>
 
@@ -197,13 +200,62 @@ struct utils
 
 struct ext_types : utils
 {
-    size_t data_name = 0;
+    // every distinct literal lives once in a single passive segment and is
+    // materialized into its own global by the start function
+    struct string_pool
+    {
+        std::string data;
+        std::unordered_map<std::string, size_t> ids;
+        std::vector<std::pair<size_t, size_t>> ranges;
+        bool built = false;
+    };
+    std::shared_ptr<string_pool> strings = std::make_shared<string_pool>();
+
+    static std::string string_global(size_t id)
+    {
+        return "*str" + std::to_string(id);
+    }
 
     expr_ref add_string(const std::string& str)
     {
-        auto name = std::to_string(data_name++);
-        BinaryenAddDataSegment(mod, name.c_str(), "", true, 0, str.data(), str.size());
-        return BinaryenArrayNewData(mod, BinaryenTypeGetHeapType(type<value_type::string>()), name.c_str(), const_i32(0), const_i32(str.size()));
+        auto [it, inserted] = strings->ids.try_emplace(str, strings->ranges.size());
+        auto name           = string_global(it->second);
+        if (inserted)
+        {
+            // literals seen before are found in ids, a new one is appended
+            strings->ranges.emplace_back(strings->data.size(), str.size());
+            strings->data += str;
+            // array.new_data is not a constant expression, the global is only set once at start
+            BinaryenAddGlobal(mod, name.c_str(), type<value_type::string>(), true, BinaryenRefNull(mod, type<value_type::string>()));
+        }
+        return BinaryenGlobalGet(mod, name.c_str(), type<value_type::string>());
+    }
+
+    expr_ref new_string(expr_ref data)
+    {
+        return string::create(*this, std::array{data, const_i32(0), null(), const_i32(0)});
+    }
+
+    // with an intern function every literal is canonicalized once at start
+    void build_strings(const char* intern = nullptr)
+    {
+        if (strings->built || strings->ranges.empty())
+            return;
+        strings->built = true;
+
+        const char* segment = "*strings";
+        BinaryenAddDataSegment(mod, segment, "", true, 0, strings->data.data(), strings->data.size());
+
+        std::vector<expr_ref> init;
+        for (size_t i = 0; i < strings->ranges.size(); ++i)
+        {
+            auto [offset, size] = strings->ranges[i];
+            auto str            = new_string(BinaryenArrayNewData(mod, BinaryenTypeGetHeapType(get_type<string_array>()), segment, const_i32(offset), const_i32(size)));
+            if (intern)
+                str = make_call(intern, str, type<value_type::string>());
+            init.push_back(BinaryenGlobalSet(mod, string_global(i).c_str(), str));
+        }
+        BinaryenSetStart(mod, BinaryenAddFunction(mod, "*init_strings", BinaryenTypeNone(), BinaryenTypeNone(), nullptr, 0, make_block(init)));
     }
 
     void import_func(const char* name, BinaryenType params, BinaryenType results, const char* module_name, const char* import_name = nullptr)
@@ -211,6 +263,14 @@ struct ext_types : utils
         BinaryenAddFunctionImport(mod, name, module_name, import_name ? import_name : name, params, results);
     }
 
+    // C's fmod from the host, wasm has no remainder for floats
+    expr_ref fmod_num(expr_ref a, expr_ref b)
+    {
+        if (!BinaryenGetFunction(mod, "fmod"))
+            import_func("fmod", create_type(number_type(), number_type()), number_type(), "native");
+        return make_call("fmod", std::array{a, b}, number_type());
+    }
+
     static constexpr size_t type_count      = 14;
     static constexpr size_t lua_type_offset = 5;
 
@@ -228,9 +288,10 @@ struct ext_types : utils
         switch (t)
         {
         case value_type::boolean:
-            return BinaryenTypeI31ref();
+            return get_type<bool_box>();
         case value_type::integer:
-            return get_type<integer>();
+            // i31ref or a boxed integer, see new_integer
+            return BinaryenTypeFromHeapType(BinaryenHeapTypeEq(), false);
         case value_type::number:
             return get_type<number>();
         case value_type::string:
@@ -251,19 +312,74 @@ struct ext_types : utils
     bool big_int = true;
     bool big_num = true;
 
+    // true and false are immutable globals, booleans never allocate
+    expr_ref boolean_global(bool value)
+    {
+        const char* name = value ? "*true" : "*false";
+        if (!BinaryenGetGlobal(mod, name))
+        {
+            auto init = const_i32(value);
+            BinaryenAddGlobal(mod, name, get_type<bool_box>(), false, BinaryenStructNew(mod, &init, 1, BinaryenTypeGetHeapType(get_type<bool_box>())));
+        }
+        return BinaryenGlobalGet(mod, name, get_type<bool_box>());
+    }
+
     expr_ref new_boolean(expr_ref num)
     {
-        return BinaryenRefI31(mod, num);
+        if (BinaryenExpressionGetId(num) == BinaryenConstId())
+            return boolean_global(BinaryenConstGetValueI32(num));
+        return make_if(num, boolean_global(true), boolean_global(false));
+    }
+
+    // boxed constants are created once as immutable globals instead of on every evaluation
+    template<typename Desc>
+    expr_ref constant_global(const std::string& name, expr_ref value)
+    {
+        if (!BinaryenGetGlobal(mod, name.c_str()))
+            BinaryenAddGlobal(mod, name.c_str(), get_type<Desc>(), false, BinaryenStructNew(mod, &value, 1, BinaryenTypeGetHeapType(get_type<Desc>())));
+        return BinaryenGlobalGet(mod, name.c_str(), get_type<Desc>());
     }
 
     expr_ref new_number(expr_ref num)
     {
+        if (BinaryenExpressionGetId(num) == BinaryenConstId())
+            return constant_global<number>("*num" + std::to_string(std::bit_cast<uint64_t>(BinaryenConstGetValueF64(num))), num);
         return BinaryenStructNew(mod, &num, 1, BinaryenTypeGetHeapType(type<value_type::number>()));
     }
 
+    // integers in [-2^30, 2^30) are stored as i31ref, only larger values are boxed
+    static constexpr int64_t small_int_min = -(int64_t{1} << 30);
+    static constexpr int64_t small_int_max = (int64_t{1} << 30) - 1;
+
     expr_ref new_integer(expr_ref num)
     {
-        return BinaryenStructNew(mod, &num, 1, BinaryenTypeGetHeapType(type<value_type::integer>()));
+        if (BinaryenExpressionGetId(num) == BinaryenConstId())
+        {
+            auto value = BinaryenConstGetValueI64(num);
+            if (small_int_min <= value && value <= small_int_max)
+                return BinaryenRefI31(mod, const_i32(static_cast<int32_t>(value)));
+            return constant_global<integer>("*int" + std::to_string(value), num);
+        }
+
+        const char* name = "*new_integer";
+        if (!BinaryenGetFunction(mod, name))
+        {
+            auto value = [&]()
+            {
+                return local_get(0, integer_type());
+            };
+            auto boxed = value();
+            BinaryenAddFunction(mod,
+                                name,
+                                integer_type(),
+                                type<value_type::integer>(),
+                                nullptr,
+                                0,
+                                make_if(binop(BinaryenLtUInt64(), sub_int(value(), const_integer(small_int_min)), const_integer(small_int_max - small_int_min + 1)),
+                                        BinaryenRefI31(mod, unop(BinaryenWrapInt64(), value())),
+                                        BinaryenStructNew(mod, &boxed, 1, BinaryenTypeGetHeapType(get_type<integer>()))));
+        }
+        return make_call(name, num, type<value_type::integer>());
     }
 
     expr_ref unbox_number(expr_ref num)
@@ -271,9 +387,58 @@ struct ext_types : utils
         return BinaryenStructGet(mod, 0, num, number_type(), false);
     }
 
+    // accepts both integer representations
     expr_ref unbox_integer(expr_ref num)
     {
-        return BinaryenStructGet(mod, 0, num, integer_type(), false);
+        const char* name = "*unbox_integer";
+        if (!BinaryenGetFunction(mod, name))
+        {
+            auto value = [&]()
+            {
+                return local_get(0, anyref());
+            };
+            BinaryenAddFunction(mod,
+                                name,
+                                anyref(),
+                                integer_type(),
+                                nullptr,
+                                0,
+                                make_if(BinaryenRefTest(mod, value(), BinaryenTypeFromHeapType(BinaryenHeapTypeI31(), false)),
+                                        unop(BinaryenExtendSInt32(), BinaryenI31Get(mod, BinaryenRefCast(mod, value(), BinaryenTypeFromHeapType(BinaryenHeapTypeI31(), false)), true)),
+                                        BinaryenStructGet(mod, 0, BinaryenRefCast(mod, value(), get_type<integer>()), integer_type(), false)));
+        }
+        return make_call(name, num, integer_type());
+    }
+
+    expr_ref is_integer(expr_ref value)
+    {
+        const char* name = "*is_integer";
+        if (!BinaryenGetFunction(mod, name))
+        {
+            BinaryenAddFunction(mod,
+                                name,
+                                anyref(),
+                                bool_type(),
+                                nullptr,
+                                0,
+                                binop(BinaryenOrInt32(),
+                                      BinaryenRefTest(mod, local_get(0, anyref()), BinaryenTypeFromHeapType(BinaryenHeapTypeI31(), false)),
+                                      BinaryenRefTest(mod, local_get(0, anyref()), get_type<integer>())));
+        }
+        return make_call(name, value, bool_type());
+    }
+
+    // ref.test for a lua type, integers have two representations
+    expr_ref test_type(expr_ref value, value_type vtype)
+    {
+        if (vtype == value_type::integer)
+            return is_integer(value);
+        return BinaryenRefTest(mod, value, type(vtype));
+    }
+
+    expr_ref unbox_boolean(expr_ref value)
+    {
+        return BinaryenStructGet(mod, 0, BinaryenRefCast(mod, value, type<value_type::boolean>()), bool_type(), false);
     }
 
     static BinaryenType number_type()
@@ -355,6 +520,7 @@ struct ext_types : utils
     GEN_BINOP_INT(lt_int, BinaryenLtSInt64, BinaryenLtSInt32)
     GEN_BINOP_INT(le_int, BinaryenLeSInt64, BinaryenLeSInt32)
     GEN_BINOP_INT(ge_int, BinaryenGeSInt64, BinaryenGeSInt32)
+    GEN_BINOP_INT(lt_uint, BinaryenLtUInt64, BinaryenLtUInt32)
 
     GEN_BINOP_INT(add_num, BinaryenAddFloat64, BinaryenAddFloat32)
     GEN_BINOP_INT(mul_num, BinaryenMulFloat64, BinaryenMulFloat32)
@@ -437,7 +603,15 @@ struct ext_types : utils
 
         for (auto vtype : casts)
         {
-            exp = BinaryenBrOn(mod, BinaryenBrOnCast(), (type_name(vtype) + std::to_string(label_counter++)).c_str(), exp, type(vtype));
+            auto label = type_name(vtype) + std::to_string(label_counter++);
+            if (vtype == value_type::integer)
+            {
+                // both representations branch to the same block
+                exp = BinaryenBrOn(mod, BinaryenBrOnCast(), label.c_str(), exp, BinaryenTypeFromHeapType(BinaryenHeapTypeI31(), false));
+                exp = BinaryenBrOn(mod, BinaryenBrOnCast(), label.c_str(), exp, get_type<integer>());
+            }
+            else
+                exp = BinaryenBrOn(mod, BinaryenBrOnCast(), label.c_str(), exp, type(vtype));
         }
 
         expr_ref inner[] = {
@@ -485,6 +659,7 @@ struct ext_types : utils
         expr_ref exp[] = {
             func_ref,
             ups.empty() ? null() : BinaryenArrayNewFixed(mod, BinaryenTypeGetHeapType(ref_array_type()), std::data(ups), std::size(ups)),
+            const_i32(0),
         };
         return BinaryenStructNew(mod, std::data(exp), std::size(exp), BinaryenTypeGetHeapType(type<value_type::function>()));
     }
@@ -508,14 +683,6 @@ struct ext_types : utils
     {
         return types[2];
     }
-    BinaryenType hash_entry_type() const
-    {
-        return types[4];
-    }
-    BinaryenType hash_array_type() const
-    {
-        return types[5];
-    }
 
     template<typename Type, bool IsMutable = false, auto Pack = BinaryenPackedTypeNotPacked>
     struct member_desc
@@ -826,38 +993,22 @@ struct ext_types : utils
         using sig                         = sig_desc<type_list<ref_array, ref_array>, type_list<ref_array>>;
     };
 
-    struct hash_entry : struct_desc<hash_entry, true>
+    struct integer : struct_desc<integer>
     {
-        static constexpr const char* name = "hash_entry";
-
-        struct key : member_desc<any>
-        {
-            static constexpr const char* name = "key";
-        };
-
-        struct value : member_desc<any, true>
-        {
-            static constexpr const char* name = "value";
-        };
+        static constexpr const char* name = "integer";
 
-        struct hash : member_desc<size>
+        struct inner : member_desc<int_>
         {
-            static constexpr const char* name = "hash";
         };
-        using members = member_list<key, value, hash>;
-    };
 
-    struct hash_array : array_desc<hash_array, true>
-    {
-        static constexpr const char* name = "hash_array";
-        using array                       = array_type_desc<hash_entry, true>;
+        using members = member_list<inner>;
     };
 
-    struct integer : struct_desc<integer>
+    struct bool_box : struct_desc<bool_box>
     {
-        static constexpr const char* name = "integer";
+        static constexpr const char* name = "boolean";
 
-        struct inner : member_desc<int_>
+        struct inner : member_desc<size>
         {
         };
 
@@ -875,12 +1026,48 @@ struct ext_types : utils
         using members = member_list<inner>;
     };
 
-    struct string : array_desc<string, true>
+    struct string_array : array_desc<string_array, true>
     {
-        static constexpr const char* name = "string";
+        static constexpr const char* name = "string_array";
         using array                       = array_type_desc<char_, true, BinaryenPackedTypeInt8>;
     };
 
+    struct size_array : array_desc<size_array, true>
+    {
+        static constexpr const char* name = "size_array";
+        using array                       = array_type_desc<size_, true>;
+    };
+
+    struct string : struct_desc<string, true>
+    {
+        static constexpr const char* name = "string";
+
+        // null while the string is a rope
+        struct data : member_desc<string_array, true>
+        {
+            static constexpr const char* name = "data";
+        };
+
+        // 0 until the string is hashed for the first time
+        struct hash : member_desc<size, true>
+        {
+            static constexpr const char* name = "hash";
+        };
+
+        // the strings a rope is made of, null once it is flattened
+        struct parts : member_desc<ref_array, true>
+        {
+            static constexpr const char* name = "parts";
+        };
+
+        // byte length of a rope, flat strings use the length of data
+        struct length : member_desc<size>
+        {
+            static constexpr const char* name = "length";
+        };
+        using members = member_list<data, hash, parts, length>;
+    };
+
     struct function : struct_desc<function, true>
     {
         static constexpr const char* name = "function";
@@ -894,7 +1081,13 @@ struct ext_types : utils
         {
             static constexpr const char* name = "upvalues";
         };
-        using members = member_list<function_ref, upvalues>;
+
+        // 0 until the function is hashed as a table key
+        struct id : member_desc<size, true>
+        {
+            static constexpr const char* name = "id";
+        };
+        using members = member_list<function_ref, upvalues, id>;
     };
 
     struct userdata : struct_desc<userdata, true>
@@ -905,7 +1098,12 @@ struct ext_types : utils
         {
         };
 
-        using members = member_list<inner, inner>;
+        struct id : member_desc<size, true>
+        {
+            static constexpr const char* name = "id";
+        };
+
+        using members = member_list<inner, inner, id>;
     };
 
     struct thread : struct_desc<thread, true>
@@ -916,7 +1114,53 @@ struct ext_types : utils
         {
         };
 
-        using members = member_list<inner, inner, inner>;
+        struct id : member_desc<size, true>
+        {
+            static constexpr const char* name = "id";
+        };
+
+        using members = member_list<inner, inner, inner, id>;
+    };
+
+    // the keys of tables built the same way are stored once. The arrays of a shape are
+    // never written, a table that adds a key either follows the transition of its shape
+    // or copies them, see table_create_shaped
+    struct shape : struct_desc<shape, true>
+    {
+        static constexpr const char* name = "shape";
+
+        struct keys : member_desc<ref_array>
+        {
+            static constexpr const char* name = "keys";
+        };
+
+        struct metas : member_desc<size_array>
+        {
+            static constexpr const char* name = "metas";
+        };
+
+        struct depth : member_desc<size>
+        {
+            static constexpr const char* name = "depth";
+        };
+
+        // the shape after adding next_key at next_slot
+        struct next_key : member_desc<string, true>
+        {
+            static constexpr const char* name = "next_key";
+        };
+
+        struct next_slot : member_desc<size, true>
+        {
+            static constexpr const char* name = "next_slot";
+        };
+
+        struct next : member_desc<shape, true>
+        {
+            static constexpr const char* name = "next";
+        };
+
+        using members = member_list<keys, metas, depth, next_key, next_slot, next>;
     };
 
     struct table : struct_desc<table, true>
@@ -928,9 +1172,21 @@ struct ext_types : utils
             static constexpr const char* name = "array";
         };
 
-        struct hash : member_desc<hash_array, true>
+        // the hash part is open addressing over three parallel arrays of the same
+        // capacity, probes look at the metadata first, see hash_meta in table.cpp
+        struct hash_keys : member_desc<ref_array, true>
         {
-            static constexpr const char* name = "hash";
+            static constexpr const char* name = "hash_keys";
+        };
+
+        struct hash_values : member_desc<ref_array, true>
+        {
+            static constexpr const char* name = "hash_values";
+        };
+
+        struct hash_meta : member_desc<size_array, true>
+        {
+            static constexpr const char* name = "hash_meta";
         };
 
         struct hash_size : member_desc<size_, true>
@@ -942,22 +1198,95 @@ struct ext_types : utils
         {
             static constexpr const char* name = "metatable";
         };
-        using members = member_list<array, hash, hash_size, metatable>;
+
+        struct id : member_desc<size, true>
+        {
+            static constexpr const char* name = "id";
+        };
+
+        // position of the key returned last by next and the empty hash slot
+        // the traversal of the hash part starts after, see table_next
+        struct next_index : member_desc<size, true>
+        {
+            static constexpr const char* name = "next_index";
+        };
+
+        struct next_start : member_desc<size, true>
+        {
+            static constexpr const char* name = "next_start";
+        };
+        // the border returned last by #, see table_border
+        struct border : member_desc<size, true>
+        {
+            static constexpr const char* name = "border";
+        };
+        // metamethods known to be missing while the table is used as a metatable,
+        // one bit per runtime::event. Cleared whenever a string key is assigned,
+        // except for the top bit that marks tables a field_cache depends on
+        struct flags : member_desc<size, true>
+        {
+            static constexpr const char* name = "flags";
+        };
+        // the shared layout of hash_keys and hash_meta, null once the table has its own
+        struct shape : member_desc<ext_types::shape, true>
+        {
+            static constexpr const char* name = "shape";
+        };
+        using members = member_list<array, hash_keys, hash_values, hash_meta, hash_size, metatable, id, next_index, next_start, border, flags, shape>;
+    };
+
+    // a lookup of a constant string key remembers the slot the key was found in,
+    // one per call site, see runtime::table_get_field
+    struct field_cache : struct_desc<field_cache>
+    {
+        static constexpr const char* name = "field_cache";
+
+        // the prototype the key was inherited from, null for a key of the table itself
+        struct holder : member_desc<table, true>
+        {
+            static constexpr const char* name = "holder";
+        };
+
+        struct metatable : member_desc<table, true>
+        {
+            static constexpr const char* name = "metatable";
+        };
+
+        struct slot : member_desc<size, true>
+        {
+            static constexpr const char* name = "slot";
+        };
+
+        struct epoch : member_desc<size, true>
+        {
+            static constexpr const char* name = "epoch";
+        };
+
+        // the keys of the shape of the table, a table sharing them has the key at slot
+        struct keys : member_desc<ref_array, true>
+        {
+            static constexpr const char* name = "keys";
+        };
+
+        using members = member_list<holder, metatable, slot, epoch, keys>;
     };
 
     using types_ = type_builder<ref_array,
                                 upvalue,
                                 upvalue_array,
                                 lua_function,
-                                hash_entry,
-                                hash_array,
                                 integer,
                                 number,
                                 function,
                                 string,
                                 userdata,
                                 thread,
-                                table>;
+                                table,
+                                bool_box,
+                                string_array,
+                                size_array,
+                                shape,
+                                field_cache>;
     types_::type_array types;
 
     template<typename T>
@@ -1,4 +1,5 @@
 #include "ast/analyze.hpp"
+#include "ast/infer.hpp"
 #include "ast/ast.hpp"
 #include "backend/wasm.hpp"
 #include "lua2wasm.hpp"
@@ -24,12 +25,12 @@ extern "C"
 {
     using namespace wumbo;
 
-    EMSCRIPTEN_KEEPALIVE result* generate_runtime(uint32_t optimize)
+    EMSCRIPTEN_KEEPALIVE result* generate_runtime(uint32_t optimize, bool intern)
     {
         auto res = new result{};
         try
         {
-            res->mod = wumbo::make_runtime(optimize);
+            res->mod = wumbo::make_runtime(optimize, intern);
         }
         catch (const std::exception& e)
         {
@@ -39,7 +40,7 @@ extern "C"
         return res;
     }
 
-    EMSCRIPTEN_KEEPALIVE result* load_lua(const char* str, size_t size, uint32_t optimize, bool standalone)
+    EMSCRIPTEN_KEEPALIVE result* load_lua(const char* str, size_t size, uint32_t optimize, bool standalone, bool intern)
     {
         auto res = new result{};
         try
@@ -47,7 +48,8 @@ extern "C"
             ast::block chunk;
             parse_string(std::string_view{str, size}, chunk);
             ast::analyzer{}(chunk);
-            res->mod = wumbo::compile(chunk, optimize, standalone);
+            ast::infer_types(chunk);
+            res->mod = wumbo::compile(chunk, optimize, standalone, intern);
         }
         catch (const std::exception& e)
         {
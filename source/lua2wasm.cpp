@@ -14,14 +14,20 @@ void opt(wasm::mod& result)
     mod = reinterpret_cast<BinaryenModuleRef>(result.impl.get());
     free(res.binary);
     free(res.sourceMap);
+    // boxing helpers like *new_integer are tiny but called everywhere. The setting is
+    // global to Binaryen, it is restored for whatever else the process optimizes
+    auto inline_size = BinaryenGetAlwaysInlineMaxSize();
+    BinaryenSetAlwaysInlineMaxSize(12);
     BinaryenModuleOptimize(mod);
+    BinaryenSetAlwaysInlineMaxSize(inline_size);
 }
 
-wasm::mod make_runtime(uint32_t optimize)
+wasm::mod make_runtime(uint32_t optimize, bool intern_strings)
 {
     wasm::mod result;
     BinaryenModuleRef mod = reinterpret_cast<BinaryenModuleRef>(result.impl.get());
     runtime r{mod};
+    r.intern_strings = intern_strings;
 
     r.create_functions = function_action::all;
     r.export_functions = function_action::all;
@@ -36,11 +42,12 @@ wasm::mod make_runtime(uint32_t optimize)
     return result;
 }
 
-wasm::mod compile(const block& chunk, uint32_t optimize, bool stand_alone)
+wasm::mod compile(const block& chunk, uint32_t optimize, bool stand_alone, bool intern_strings)
 {
     wasm::mod result;
     BinaryenModuleRef mod = reinterpret_cast<BinaryenModuleRef>(result.impl.get());
     runtime r{mod};
+    r.intern_strings = intern_strings;
 
     if (!stand_alone)
     {
@@ -5,7 +5,7 @@
 
 namespace wumbo
 {
-wasm::mod make_runtime(uint32_t optimize);
+wasm::mod make_runtime(uint32_t optimize, bool intern_strings);
 
-wasm::mod compile(const ast::block& chunk, uint32_t optimize, bool standalone);
+wasm::mod compile(const ast::block& chunk, uint32_t optimize, bool standalone, bool intern_strings);
 } // namespace wumbo
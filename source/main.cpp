@@ -1,5 +1,6 @@
 #include "ast/ast.hpp"
 #include "ast/analyze.hpp"
+#include "ast/infer.hpp"
 #include "ast/printer.hpp"
 #include "backend/wasm.hpp"
 #include "lua2wasm.hpp"
@@ -43,6 +44,7 @@ int main(int argc, char** argv)
     export_mode mode  = export_mode::standalone;
     bool text         = false;
     uint32_t optimize = 0;
+    bool intern       = false;
 
     std::map<std::string, export_mode> map{{"standalone", export_mode::standalone}, {"minimal", export_mode::minimal}, {"runtime", export_mode::runtime}};
 
@@ -54,6 +56,7 @@ int main(int argc, char** argv)
 
     app.add_option("-O", optimize, "enable optimization")->capture_default_str();
     app.add_flag("-t,--text", text, "text format")->capture_default_str();
+    app.add_flag("--intern", intern, "intern string literals and short strings")->capture_default_str();
     CLI11_PARSE(app, argc, argv);
 
     try
@@ -68,7 +71,8 @@ int main(int argc, char** argv)
         }
 
         ast::analyzer{}(chunk);
-        wasm::mod result = (mode == export_mode::runtime) ? wumbo::make_runtime(optimize) : wumbo::compile(chunk, optimize, mode == export_mode::standalone);
+        ast::infer_types(chunk);
+        wasm::mod result = (mode == export_mode::runtime) ? wumbo::make_runtime(optimize, intern) : wumbo::compile(chunk, optimize, mode == export_mode::standalone, intern);
         {
             std::ofstream ofstream;
             if (!outfile.empty())
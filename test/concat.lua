@@ -29,3 +29,18 @@ print(result)         -- start-middle-end
 
 -- Concat with escaped characters
 print("line1\n" .. "line2")   -- line1 (newline) line2
+
+-- Long chains and mixed operands
+local n, f = -42, 0.25
+print("n=" .. n .. ", f=" .. f .. ", sum=" .. n + f .. "!")
+print(9223372036854775807 .. "|" .. -9223372036854775807 - 1)
+print(1 / 3 .. "|" .. 100.5 .. "|" .. -0.001 .. "|" .. 2^53 / 2^40)
+print(3.0 .. "|" .. -0.0 .. "|" .. 1e13 .. "|" .. 123456.789)
+print(tostring(0.1), tostring(-7.25), tostring(1234567))
+print(1e14, 2^53, 1e-5)
+print(-1.5e300, 1e100, 123456789012345.0, 0.0001, 0.00001234)
+print(1e14 .. "", 2^-20 .. "")
+
+-- Concatenating other types raises an error
+print((pcall(function() return "a" .. nil end)))
+print((pcall(function() return {} .. "b" end)))
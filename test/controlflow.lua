@@ -129,3 +129,27 @@ end
 print(sign(-10)) -- -1
 print(sign(0)) -- 0
 print(sign(10)) -- 1
+
+-- Conditions built from comparisons, not, and/or
+local function check(a, b)
+	local result = {}
+	if a < b and not (a == b) then result[#result + 1] = "lt" end
+	if a >= b or a ~= a then result[#result + 1] = "ge" end
+	if not (a > b) then result[#result + 1] = "le" end
+	if a == nil or b == nil then result[#result + 1] = "nil" end
+	return #result
+end
+print(check(1, 2), check(2.5, 2), check(2, 2.0), check(-1.5, -1))
+print(check("a", "b"), check("b", "a"))
+
+local flag
+if flag then print("set") elseif flag == nil then print("unset") end
+if not flag and 0 then print("zero is true") end
+if false or nil then print("never") else print("falsy") end
+
+local n = 0
+while n < 3 and n ~= 10 do n = n + 1 end
+print(n)
+repeat n = n - 1 until n <= 0 or n == 100
+print(n)
+print(1 < 2, 2 <= 1, not 1, not nil, 3 == 3.0, "x" ~= "y")
@@ -0,0 +1,49 @@
+-- the same call site sees tables with different layouts
+local function get_x(t) return t.x end
+print(get_x({x = 1}), get_x({y = 2, x = 3}), get_x({a = 1, b = 2, c = 3, x = 4}), get_x({}))  -- 1 3 4 nil
+
+-- inherited methods, overridden after the call site cached them
+local Base = {}
+Base.__index = Base
+function Base:name() return "base" end
+
+local Derived = setmetatable({}, {__index = Base})
+Derived.__index = Derived
+
+local obj = setmetatable({}, Derived)
+local function name(o) return o:name() end
+print(name(obj))    -- base
+print(name(obj))    -- base
+function Derived:name() return "derived" end
+print(name(obj))    -- derived
+obj.name = function() return "own" end
+print(name(obj))    -- own
+obj.name = nil
+print(name(obj))    -- derived
+Derived.name = nil
+print(name(obj))    -- base
+
+-- the prototype chain is replaced
+local Other = {name = function() return "other" end}
+Other.__index = Other
+print(name(setmetatable(obj, Other)))  -- other
+getmetatable(Derived).__index = Other
+print(name(setmetatable(obj, Derived)))  -- other
+
+-- values read through the cache follow assignments
+local proto = {count = 0}
+local inst = setmetatable({}, {__index = proto})
+local function count(o) return o.count end
+for i = 1, 3 do
+    proto.count = i
+    print(count(inst))  -- 1 2 3
+end
+
+-- globals are cached as fields of _ENV
+value = 1
+local function read() return value end
+print(read())   -- 1
+value = 2
+print(read())   -- 2
+value = nil
+print(read())   -- nil
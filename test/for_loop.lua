@@ -11,3 +11,41 @@ for i = 1, 20 do
     for j = 1, 10 do print(i, j) end
 end
 -- prints all (i, j) pairs: i in [1,20], j in [1,10]
+
+-- Numeric for: negative step and empty ranges
+for i = 10, 1, -3 do print(i) end
+for i = 1, 0 do print("never") end
+for i = 0, 1, -1 do print("never") end
+
+-- Numeric for: float control values
+for i = 1.0, 2, 0.25 do print(i) end
+for i = 1, 3.5 do print(i) end
+for i = 3, 0.5, -1 do print(i) end
+
+-- Numeric for: loop values from expressions
+local first, last, step = 2, 12, 5
+for i = first, last, step do print(i) end
+
+-- Numeric for: body does not read the counter
+local count = 0
+for _ = 1, 7 do count = count + 1 end
+print(count)
+
+-- Numeric for: every iteration gets a fresh variable
+local fns = {}
+for i = 1, 3 do fns[i] = function() return i end end
+print(fns[1](), fns[2](), fns[3]())
+
+-- Numeric for: break leaves the loop
+for i = 1, 10 do
+    if i == 4 then break end
+    print(i)
+end
+
+-- Numeric for: the limit is clipped to the integer range
+for i = 9223372036854775805, 1e300 do print(i) end
+
+-- Numeric for: untyped step with a constant initial value
+local function f(s) for i = 1, 3, s do print(i) end end
+f(1)
+f(0.5)
@@ -0,0 +1,41 @@
+-- tables without a hash part
+local list = {1, 2, 3}
+print(list.x, list[4], #list, next(list, 3))  -- nil nil 3 nil
+list.x = "x"
+list[10] = 10
+print(list.x, list[10], #list)  -- x 10 3
+
+-- empty tables read, cleared and traversed before anything is stored
+local function empty() return setmetatable({}, nil) end
+local e = empty()
+print(e.a, e[1], e[1.5], #e, next(e), rawlen(e))  -- nil nil nil 0 nil 0
+e.a = nil
+e[1] = nil
+for k, v in pairs(e) do print(k, v) end
+for i, v in ipairs(e) do print(i, v) end
+print(next(e))  -- nil
+
+-- many empty tables stay independent once they are filled
+local tables = {}
+for i = 1, 100 do
+    tables[i] = {}
+end
+for i = 1, 100 do
+    tables[i][i] = i
+    tables[i]["k" .. i] = -i
+end
+local sum = 0
+for i = 1, 100 do
+    sum = sum + tables[i][i] + tables[i]["k" .. i] + (tables[i][1] or 0)
+end
+print(sum, tables[1][1], tables[2][1], tables[50].k50)  -- 1 1 nil -50
+
+-- an empty table as a list and a map
+local t = {}
+for i = 1, 10 do t[i] = i end
+print(#t, t[10])  -- 10 10
+local m = {}
+m[true] = 1
+m[2.5] = 2
+m.key = 3
+print(m[true], m[2.5], m.key)  -- 1 2 3
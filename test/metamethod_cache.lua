@@ -0,0 +1,57 @@
+-- a metatable that is used before its metamethods are assigned
+local mt = {}
+local t = setmetatable({}, mt)
+print(t.x)          -- nil
+print(t[1])         -- nil
+mt.__index = function(_, k) return "index " .. tostring(k) end
+print(t.x)          -- index x
+print(t[1])         -- index 1
+mt.__index = nil
+print(t.x)          -- nil
+
+-- raw values win over __index
+t.x = 5
+mt.__index = {x = 1, y = 2}
+print(t.x, t.y)     -- 5 2
+
+-- long prototype chains
+local base = {depth = 0}
+local last = base
+for i = 1, 200 do
+    local level = setmetatable({}, {__index = last})
+    last = level
+end
+print(last.depth)   -- 0
+print(last.other)   -- nil
+
+-- __newindex as a table, existing keys are assigned directly
+local store = {}
+local front = setmetatable({kept = 1}, {__newindex = store})
+front.kept = 2
+front.added = 3
+front[10] = 4
+print(front.kept, front.added, store.added, store[10])  -- 2 nil 3 4
+
+-- __newindex assigned later
+local late_mt = {}
+local late = setmetatable({}, late_mt)
+late.a = 1
+local calls = 0
+late_mt.__newindex = function(t, k, v) calls = calls + 1 end
+late.a = 2
+late.b = 3
+late[1] = 4
+print(late.a, late.b, late[1], calls)  -- 2 nil nil 2
+
+-- arithmetic with a metamethod on either side
+local vec = {}
+vec.__add = function(a, b)
+    if type(a) == "number" then return a + b.v end
+    if type(b) == "number" then return a.v + b end
+    return a.v + b.v
+end
+vec.__unm = function(a) return -a.v end
+local v = setmetatable({v = 3}, vec)
+print(v + 1, 1 + v, v + v, -v)  -- 4 4 6 -3
+
+print((pcall(function() return {} + 1 end)))  -- false
@@ -67,3 +67,18 @@ print(#"")           -- 0
 print(#"hello")      -- 5
 print(#{1, 2, 3})    -- 3
 print(#{})           -- 0
+
+-- Arithmetic on values only known at runtime
+local a, b, x, y = 17, -5, 2.5, 0.5
+print(a + b, a - b, a * b, a / b, a % b, b % a)
+print(x + y, x - y, x * y, x / y, x % y, -x % y)
+print(a + x, x * a, a / y, a % x, a - 1, 1.5 + a, a * 2.0)
+print((pcall(function() return a % 0 end)))
+
+-- Float modulo with infinite and negative divisors
+local inf = 1 / 0
+local function modulo(p, q) return p % q end
+print(5 % inf, -5 % -inf, 5.5 % -2, -5.5 % 2, 5.25 % 0.5)
+print(-5 % inf == inf, 5 % -inf == -inf)
+print(modulo(5, inf), modulo(-5, -inf), modulo(5.5, -2), modulo(-5.5, 2), modulo(5.25, 0.5))
+print(modulo(-5, inf) == inf, modulo(5, -inf) == -inf)
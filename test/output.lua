@@ -0,0 +1,23 @@
+-- print and io.write share one output buffer
+
+io.write("a", "b", 1, " ", 2.5, "\n")
+print("after write")
+io.write("no newline yet ")
+print("then print")
+
+-- more output than fits the buffer between flushes
+for i = 1, 2000 do
+    print(i, i * 0.5, "line")
+end
+
+-- a single string longer than the buffer
+local s = ""
+for i = 1, 2000 do
+    s = s .. "0123456789"
+end
+io.write(s, "\n")
+print(#s)
+
+io.flush()
+print((pcall(io.write, {})))
+io.write("done\n")
@@ -0,0 +1,60 @@
+-- next, pairs and ipairs
+
+local list = {10, 20, 30, nil, 50}
+for i, v in ipairs(list) do
+    print(i, v)
+end
+
+-- pairs visits the array and the hash part once, in no particular order
+local t = {1, 2, 3, x = 4, y = 5}
+t[100] = 6
+t[2.5] = 7
+t[true] = 8
+local count, sum = 0, 0
+for k, v in pairs(t) do
+    count = count + 1
+    sum = sum + v
+end
+print(count, sum)
+
+print(next({}))
+local k, v = next({x = "only"})
+print(k, v)
+
+-- clearing fields during the traversal
+local big = {}
+for i = 1, 300 do
+    big["k" .. i] = i
+    big[i] = i
+end
+count, sum = 0, 0
+for k, v in pairs(big) do
+    count = count + 1
+    sum = sum + v
+    big[k] = nil
+end
+print(count, sum, next(big))
+
+-- assigning existing fields during the traversal
+local squares = {}
+for i = 1, 50 do
+    squares["n" .. i] = i
+end
+for k, v in pairs(squares) do
+    squares[k] = v * v
+end
+sum = 0
+for _, v in pairs(squares) do
+    sum = sum + v
+end
+print(sum)
+
+-- nested traversals of the same table
+local small = {a = 1, b = 2, c = 3}
+local pairs_count = 0
+for k1 in pairs(small) do
+    for k2 in pairs(small) do
+        pairs_count = pairs_count + 1
+    end
+end
+print(pairs_count)
@@ -0,0 +1,70 @@
+-- records from the same constructor, filled in the same order
+local function point(x, y)
+    local p = {}
+    p.x = x
+    p.y = y
+    return p
+end
+local a, b = point(1, 2), point(3, 4)
+print(a.x, a.y, b.x, b.y)   -- 1 2 3 4
+b.x = 5
+print(a.x, b.x)             -- 1 5
+
+-- the same fields in a different order
+local function swapped(x, y)
+    local p = {}
+    p.y = y
+    p.x = x
+    return p
+end
+local c = swapped(6, 7)
+local function sum(p) return p.x + p.y end
+print(sum(a), sum(b), sum(c))  -- 3 9 13
+
+-- one table leaves the shared keys, the others keep them
+a.z = 8
+b.w = 9
+print(a.z, a.w, b.z, b.w, point(0, 0).z)  -- 8 nil nil 9 nil
+a.x = nil
+print(a.x, a.y, a.z, sum(b))  -- nil 2 8 14
+a.x = 10
+print(sum(a), sum(point(1, 1)))  -- 12 2
+
+-- more fields than a shape follows
+local function wide(n)
+    local t = {}
+    for i = 1, n do
+        t["k" .. i] = i
+    end
+    return t
+end
+local w1, w2 = wide(40), wide(40)
+local total = 0
+for i = 1, 40 do
+    total = total + w1["k" .. i] + w2["k" .. i]
+end
+print(total, w1.k1, w2.k40)  -- 1640 1 40
+
+-- integer keys and nil values in shaped tables
+local function mixed()
+    local t = {name = "m"}
+    t[1] = "one"
+    t.other = nil
+    t.last = true
+    return t
+end
+local m1, m2 = mixed(), mixed()
+print(m1.name, m1[1], m1.other, m1.last, #m2)  -- m one nil true 1
+
+-- constructors with fields
+local function record(v) return {id = v, tag = "r"} end
+local records = {}
+for i = 1, 5 do
+    records[i] = record(i)
+    records[i].extra = i * 2
+end
+local ids = 0
+for i = 1, 5 do
+    ids = ids + records[i].id + records[i].extra
+end
+print(ids, records[3].tag)  -- 45 r
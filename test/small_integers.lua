@@ -0,0 +1,26 @@
+-- integers around the boundary of the unboxed representation
+local values = {1073741823, 1073741824, -1073741824, -1073741825, 0, -1}
+for i = 1, #values do
+    local v = values[i]
+    print(v, v + 1, v - 1, v * 2)
+end
+
+-- crossing the boundary through arithmetic
+local n = 1073741820
+for i = 1, 8 do
+    n = n + 1
+end
+print(n, n == 1073741828, n - 8 == 1073741820)
+
+-- values of both representations compare and index the same
+local t = {}
+t[1073741823] = "small"
+t[1073741824] = "large"
+print(t[1073741822 + 1], t[1073741823 + 1])
+print(1073741824 == 2^30, 1073741824 // 2 == 536870912)
+
+-- booleans
+local yes, no = true, false
+print(yes, no, not yes, not no, type(yes), tostring(no))
+print(yes == true, no == false, yes ~= no)
+print(1 < 2, 1 > 2, not nil)
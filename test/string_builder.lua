@@ -0,0 +1,41 @@
+-- strings grown by repeated concatenation
+local s = ""
+for i = 1, 200 do
+    s = s .. "line " .. i .. "\n"
+end
+print(#s)
+
+local t = {}
+local key = ""
+for i = 1, 100 do
+    key = key .. "k"
+end
+t[key] = "found"
+print(#key, t[key])
+
+-- the same content built twice compares equal
+local a, b = "", ""
+for i = 1, 300 do
+    a = a .. i % 10
+end
+for i = 1, 300 do
+    b = b .. i % 10
+end
+print(a == b, #a, a ~= b .. "x")
+
+-- appending to a long string after it was read
+local long = ""
+for i = 1, 50 do
+    long = long .. "0123456789"
+end
+print(#long)
+long = long .. "end"
+print(#long, long == long .. "")
+print(s)
+
+-- a million appends, copying the string on every step would not finish in time
+local big = ""
+for i = 1, 1000000 do
+    big = big .. "x"
+end
+print(#big, big .. "" == big)
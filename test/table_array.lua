@@ -0,0 +1,43 @@
+-- integer keys in the array part
+
+-- appending at the border
+local list = {}
+for i = 1, 100 do
+    list[#list + 1] = i * i
+end
+print(#list, list[1], list[50], list[100], list[101])
+
+-- keys inserted from the back end up in the array part after a rehash
+local back = {}
+for i = 64, 1, -1 do
+    back[i] = i
+end
+local sum = 0
+for i = 1, 64 do
+    sum = sum + back[i]
+end
+print(#back, sum)
+
+-- keys on both sides of the array part
+local mixed = { 1, 2, 3 }
+mixed[5] = 5
+mixed[4] = 4
+mixed[6] = 6
+print(#mixed, mixed[4], mixed[5], mixed[6])
+
+-- large keys do not wrap into the array part
+local wide = { "a", "b" }
+wide[4294967297] = "far"
+print(wide[1], wide[4294967297], #wide)
+
+-- string keys next to a growing array part
+local obj = { name = "obj" }
+for i = 1, 20 do
+    obj[i] = i
+    obj["k" .. i] = -i
+end
+print(#obj, obj.name, obj.k20, obj[20])
+
+-- removing the last element moves the border
+list[100] = nil
+print(#list)
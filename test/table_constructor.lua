@@ -0,0 +1,28 @@
+-- table constructors with many keyed fields
+
+local config = {
+    a = 1, b = 2, c = 3, d = 4, e = 5, f = 6, g = 7, h = 8, i = 9, j = 10,
+    k = 11, l = 12, m = 13, n = 14, o = 15, p = 16, q = 17, r = 18, s = 19, t = 20,
+}
+print(config.a, config.j, config.t, config.u)
+
+-- bracketed literal keys, duplicates keep the last value
+local dup = { x = 1, ["x"] = 2, ["y z"] = 3 }
+print(dup.x, dup["y z"])
+
+-- positional and keyed fields mixed
+local mixed = { 10, 20, name = "mixed", 30, kind = "list" }
+print(#mixed, mixed[1], mixed[3], mixed.name, mixed.kind)
+
+-- computed keys
+local key = "dyn" .. "amic"
+local computed = { [key] = true, [1 + 1] = "two", plain = key }
+print(computed.dynamic, computed[2], computed.plain)
+
+-- fields added after construction still grow the table
+local extra = { "v", "w", "x", "y", "z" }
+for i = 1, #extra do
+    config[extra[i]] = extra[i]
+end
+print(config.a, config.t, config.v, config.z)
+print(#{})
@@ -0,0 +1,52 @@
+-- removing keys from the hash part
+
+local t = {}
+for i = 1, 1000 do
+    t["k" .. i] = i
+end
+for i = 1, 1000, 2 do
+    t["k" .. i] = nil
+end
+local sum, missing = 0, 0
+for i = 1, 1000 do
+    local v = t["k" .. i]
+    if v then
+        sum = sum + v
+    else
+        missing = missing + 1
+    end
+end
+print(sum, missing, t.k1, t.k2)
+
+-- churn: a cache that is filled and emptied many times
+local cache = {}
+for round = 1, 20 do
+    for i = 1, 200 do
+        cache[i * 7919 + round] = round
+    end
+    for i = 1, 200 do
+        cache[i * 7919 + round] = nil
+    end
+end
+cache.kept = "kept"
+print(cache[7919 + 20], cache.kept)
+
+-- removing a key that is not there and removing twice
+cache.gone = nil
+cache.kept = nil
+cache.kept = nil
+print(cache.kept, cache.gone)
+
+-- a stack in the array part
+local stack = {}
+for i = 1, 100 do
+    stack[#stack + 1] = i
+end
+for i = 1, 95 do
+    stack[#stack] = nil
+end
+print(#stack, stack[5], stack[6])
+for i = 1, 10 do
+    stack[#stack + 1] = i * 10
+end
+print(#stack, stack[6], stack[15], stack[16])
@@ -0,0 +1,27 @@
+-- integer and float keys in the hash part
+
+local t = {}
+t[1.5] = "one and a half"
+t[2] = "two"
+t[2.0] = "two again"
+t[-0.0] = "zero"
+print(t[1.5], t[2], t[0], t[0.0], t[2.5])
+
+-- strided and negative keys
+local strided = {}
+for i = 1, 200 do
+    strided[i * 4096] = i
+    strided[-i] = -i
+end
+local sum = 0
+for i = 1, 200 do
+    sum = sum + strided[i * 4096] + strided[-i]
+end
+print(sum, strided[4096], strided[4097], strided[-200])
+
+-- float keys that are not integral
+local halves = {}
+for i = 1, 100 do
+    halves[i + 0.5] = i
+end
+print(halves[1.5], halves[100.5], halves[50], halves[0.5])
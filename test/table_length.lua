@@ -0,0 +1,40 @@
+-- the length of sequences while they grow and shrink
+
+local t = {}
+for i = 1, 1000 do
+    t[#t + 1] = i
+end
+print(#t, t[#t])
+
+while #t > 10 do
+    t[#t] = nil
+end
+print(#t, t[#t])
+
+-- constructors, and sequences that continue in the hash part
+local c = {1, 2, 3}
+print(#c)
+c[4] = 4
+c[5] = 5
+print(#c)
+
+local h = {}
+h[3] = 3
+h[2] = 2
+h[1] = 1
+print(#h)
+for i = 4, 100 do
+    h[i] = i
+end
+print(#h)
+
+-- # in a loop condition
+local q = {}
+local i = 0
+while #q < 50 do
+    i = i + 1
+    q[#q + 1] = i * i
+end
+print(#q, q[50])
+
+print(#{}, #{nil}, #{n = 1})
@@ -0,0 +1,53 @@
+-- tables, functions and booleans as keys
+
+local a, b = {}, {}
+local set = {}
+set[a] = "a"
+set[b] = "b"
+set[true] = "yes"
+set[false] = "no"
+print(set[a], set[b], set[{}], set[true], set[false])
+
+-- a memo cache keyed by closures
+local function make(n)
+    return function()
+        return n
+    end
+end
+local funcs = {}
+local cache = {}
+for i = 1, 100 do
+    local f = make(i)
+    funcs[i] = f
+    cache[f] = i * 2
+end
+local sum = 0
+for i = 1, 100 do
+    sum = sum + cache[funcs[i]]
+end
+print(sum, cache[make(1)], cache[print])
+
+-- objects as keys survive rehashing
+local objects = {}
+local index = {}
+for i = 1, 500 do
+    local o = {}
+    objects[i] = o
+    index[o] = i
+end
+local ok = true
+for i = 1, 500 do
+    if index[objects[i]] ~= i then
+        ok = false
+    end
+end
+print(ok)
+
+-- nil and NaN keys
+print(set[nil])
+print(pcall(function()
+    set[nil] = 1
+end) == false)
+print(pcall(function()
+    set[0 / 0] = 1
+end) == false)
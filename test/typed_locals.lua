@@ -0,0 +1,80 @@
+-- locals that only ever hold one type are kept unboxed
+
+-- integer accumulation
+local sum = 0
+for i = 1, 100 do
+    sum = sum + i * 2
+end
+print(sum)
+
+-- float accumulation
+local x = 0.5
+for i = 1, 10 do
+    x = x * 1.5 + i / 4
+end
+print(x)
+
+-- integer division and modulo mix
+local a, b = 17, 5
+print(a / b, a % b, -a % b, a % -b)
+print(-a, -(a - b))
+
+-- the type of a local changes, it stays boxed
+local c = 1
+c = c + 0.5
+print(c)
+c = "text"
+print(c)
+
+-- integers wrap around
+local big = 9223372036854775807
+big = big + 1
+print(big)
+
+-- modulo by zero still raises an error
+local zero = 0
+print((pcall(function(n)
+    return n % zero
+end, 3)))
+
+-- typed bounds of a numeric for
+local first, last, step = 10, 1, -3
+for i = first, last, step do
+    local j = i * i
+    print(i, j)
+end
+
+-- strings and tables
+local s = "abc"
+local t = {}
+t[1] = s
+s = s .. "def"
+print(s, #s, t[1])
+
+-- locals assigned from calls or captured by closures
+local function f()
+    return 42
+end
+local n = f()
+print(n + 1)
+
+local counter = 0
+local function inc()
+    counter = counter + 1
+end
+inc()
+inc()
+print(counter)
+
+-- multiple assignment
+local p, q = 1, 2
+p, q = q, p
+print(p, q)
+local r, s2, unused = 3, "s", 4.5, print("extra")
+print(r, s2, unused)
+
+-- comparisons of typed locals
+local lo, hi = 3, 7
+print(lo < hi, lo == hi, lo >= hi, hi ~= lo)
+local fl = 3.0
+print(lo == fl, fl < hi)